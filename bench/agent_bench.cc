@@ -0,0 +1,498 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks of the agent's hot paths, run without a JVM: `make bench`.
+//
+// The signal handler benchmark runs the handler's work after
+// AsyncGetCallTrace (frame lookup, sample ring push, stats) on synthetic
+// stacks, so it measures the agent's own share of the cost per sample. The
+// cost of AsyncGetCallTrace itself is reported by the stats-file option.
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "agent_stats.h"
+#include "delay_engine.h"
+#include "method_id_set.h"
+#include "result_sink.h"
+#include "sample_histogram.h"
+#include "sample_ring.h"
+#include "scope_trie.h"
+
+// Methods per synthetic application, 1 in IN_SCOPE_RATIO of them in scope
+#define BENCH_METHODS 100000
+#define IN_SCOPE_RATIO 10
+// Frames of each synthetic stack, the in scope frame is the last one
+#define BENCH_STACK_DEPTH 32
+#define BENCH_SIGNAL_ROUNDS 2000
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+static std::vector<jmethodID> methods;
+static MethodIdSet in_scope_methods;
+
+static void make_methods()
+{
+  methods.resize(BENCH_METHODS);
+  for (int i = 0; i < BENCH_METHODS; i++)
+  {
+    // jmethodIDs are pointers to word aligned slots
+    methods[i] = reinterpret_cast<jmethodID>((uintptr_t)(0x7f0000000000ULL + 8 * (uintptr_t)rand()));
+    if (i % IN_SCOPE_RATIO == 0)
+    {
+      in_scope_methods.insert(methods[i]);
+    }
+  }
+}
+
+// --- Signal handler
+
+struct BenchThread
+{
+  pthread_t thread;
+  agent_stats::ThreadStats stats;
+  SampleRing<JVMPI_CallFrame, SAMPLE_RING_SIZE> samples;
+  unsigned int seed;
+};
+
+static thread_local BenchThread *curr_bench_thread = NULL;
+static std::atomic_bool threads_running;
+static std::atomic_int threads_ready;
+
+static void handle(int signum, siginfo_t *info, void *context)
+{
+  BenchThread *bt = curr_bench_thread;
+  if (bt == NULL)
+    return;
+  agent_stats::HandlerTimer timer(bt->stats);
+
+  JVMPI_CallFrame frames[BENCH_STACK_DEPTH];
+  for (int i = 0; i < BENCH_STACK_DEPTH; i++)
+  {
+    bt->seed = bt->seed * 1103515245 + 12345;
+    frames[i].method_id = methods[(bt->seed >> 8) % BENCH_METHODS];
+    frames[i].lineno = i;
+  }
+  frames[BENCH_STACK_DEPTH - 1].method_id = methods[0];
+
+  MethodIdSet::Reader in_scope(in_scope_methods);
+  for (int i = 0; i < BENCH_STACK_DEPTH; i++)
+  {
+    if (in_scope.contains(frames[i].method_id))
+    {
+      bt->samples.push(frames[i]);
+      break;
+    }
+  }
+}
+
+static void *run_bench_thread(void *arg)
+{
+  curr_bench_thread = static_cast<BenchThread *>(arg);
+  threads_ready++;
+  volatile unsigned long work = 0;
+  while (threads_running)
+  {
+    work++;
+  }
+  curr_bench_thread = NULL;
+  return NULL;
+}
+
+static void bench_signal_handler(int num_threads)
+{
+  std::vector<BenchThread *> threads;
+  threads_running = true;
+  threads_ready = 0;
+  for (int i = 0; i < num_threads; i++)
+  {
+    BenchThread *bt = new BenchThread();
+    bt->seed = i + 1;
+    pthread_create(&bt->thread, NULL, run_bench_thread, bt);
+    threads.push_back(bt);
+  }
+  while (threads_ready < num_threads)
+    ;
+
+  // Signal every thread once per round, like the agent thread does
+  std::vector<JVMPI_CallFrame> drained;
+  auto start = bench_clock::now();
+  for (int round = 0; round < BENCH_SIGNAL_ROUNDS; round++)
+  {
+    for (auto i = threads.begin(); i != threads.end(); i++)
+    {
+      pthread_kill((*i)->thread, SIGPROF);
+    }
+    usleep(100);
+    if (round % 30 == 0)
+    {
+      for (auto i = threads.begin(); i != threads.end(); i++)
+      {
+        (*i)->samples.drain(drained);
+      }
+      drained.clear();
+    }
+  }
+  double signalling_ns = elapsed_ns(start);
+
+  threads_running = false;
+  agent_stats::Snapshot snapshot;
+  for (auto i = threads.begin(); i != threads.end(); i++)
+  {
+    pthread_join((*i)->thread, NULL);
+    (*i)->stats.add_to(snapshot);
+    snapshot.dropped_samples += (*i)->samples.dropped();
+    delete *i;
+  }
+  printf("  %2d threads: %8lu samples, mean %6.0fns, p50 %6ldns, p99 %6ldns in the handler, %5.1fms per round to signal\n",
+         num_threads, snapshot.samples, snapshot.samples == 0 ? 0.0 : (double)snapshot.handler_ns / snapshot.samples,
+         snapshot.handler_time.percentile(0.5), snapshot.handler_time.percentile(0.99),
+         signalling_ns / BENCH_SIGNAL_ROUNDS / 1e6);
+}
+
+// --- In scope lookup
+
+static void bench_in_scope_lookup()
+{
+  const int lookups = 10000000;
+  unsigned int seed = 1;
+  long found = 0;
+  auto start = bench_clock::now();
+  // As in the signal handler, one Reader for all the lookups
+  MethodIdSet::Reader in_scope(in_scope_methods);
+  for (int i = 0; i < lookups; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    found += in_scope.contains(methods[(seed >> 8) % BENCH_METHODS]);
+  }
+  double ns = elapsed_ns(start);
+  printf("  method id set: %.1fns per lookup (%ld of %d in scope)\n", ns / lookups, found, lookups);
+
+  ScopeTrie trie;
+  trie.add_search_scope("Lcom/example/app/");
+  trie.add_search_scope("Lorg/example/lib/core/");
+  trie.add_ignored_scope("Lcom/example/app/generated/");
+  const char *signatures[] = {"Lcom/example/app/Server;", "Lcom/example/app/generated/Proto;",
+                              "Ljava/util/concurrent/ConcurrentHashMap;", "Lorg/example/lib/core/Codec;"};
+  const int classifications = 4000000;
+  start = bench_clock::now();
+  for (int i = 0; i < classifications; i++)
+  {
+    found += trie.in_scope(signatures[i & 3]);
+  }
+  ns = elapsed_ns(start);
+  printf("  scope trie: %.1fns per class signature\n", ns / classifications);
+}
+
+// --- Experiment selection
+
+static void bench_experiment_selection(int distinct_frames)
+{
+  SampleHistogram histogram;
+  std::vector<JVMPI_CallFrame> frames(distinct_frames);
+  for (int i = 0; i < distinct_frames; i++)
+  {
+    frames[i].method_id = methods[i % BENCH_METHODS];
+    frames[i].lineno = i / BENCH_METHODS;
+  }
+  histogram.add(frames);
+
+  const int selections = 1000;
+  JVMPI_CallFrame frame;
+  auto start = bench_clock::now();
+  for (int i = 0; i < selections; i++)
+  {
+    histogram.select(0.1, frame);
+  }
+  double select_ns = elapsed_ns(start) / selections;
+
+  start = bench_clock::now();
+  histogram.add(frames);
+  histogram.decay(HISTOGRAM_DECAY_FACTOR, HISTOGRAM_MIN_WEIGHT);
+  double round_ns = elapsed_ns(start);
+  printf("  %7d frames: %8.0fns per selection, %6.2fms to add a round of samples and decay\n",
+         distinct_frames, select_ns, round_ns / 1e6);
+}
+
+// --- Output sink
+
+static void bench_result_sink(const std::string &format)
+{
+  const int records = 200000;
+  std::string path = "/tmp/jcoz-bench" + std::string(create_result_sink(format)->extension());
+  unlink(path.c_str());
+  ResultWriter writer;
+  if (!writer.open(path, create_result_sink(format)))
+  {
+    printf("  %s: unable to open %s\n", format.c_str(), path.c_str());
+    return;
+  }
+
+  ResultRecord record;
+  record.selected = "com.example.app.Server:120";
+  record.speedup = 0.35f;
+  record.duration = 1000000000L;
+  record.effective_duration = 650000000L;
+  record.progress_point = "Lcom/example/app/Server:200";
+  record.latency = false;
+  record.departures = 0;
+  record.in_flight = 0;
+  auto start = bench_clock::now();
+  for (int i = 0; i < records; i++)
+  {
+    record.experiment_id = i;
+    record.hits = i;
+    writer.write(record);
+  }
+  double enqueue_ns = elapsed_ns(start);
+  writer.close();
+  double total_ns = elapsed_ns(start);
+  printf("  %s: %.0fns per record on the agent thread, %.0f records/s written\n",
+         format.c_str(), enqueue_ns / records, records / (total_ns / 1e9));
+  unlink(path.c_str());
+}
+
+// --- Delays
+
+static void bench_delay(long nanoseconds)
+{
+  DelayEngine engine;
+  engine.calibrate();
+  const int delays = 2000;
+  long accounted = 0;
+  auto start = bench_clock::now();
+  for (int i = 0; i < delays; i++)
+  {
+    accounted += engine.delay(nanoseconds);
+  }
+  double actual = elapsed_ns(start);
+  printf("  %6ldns delays: %+.2f%% actual, %+.2f%% accounted vs requested (slack %ldns)\n",
+         nanoseconds, 100.0 * (actual / ((double)nanoseconds * delays) - 1),
+         100.0 * ((double)accounted / ((double)nanoseconds * delays) - 1), engine.slack());
+}
+
+// --- Delays of running threads
+//
+// Threads that spin without ever blocking or reaching a progress point, paid
+// for by the agent thread like Profiler::payRunningThreads does: the sample
+// handler marks a thread that owes MIN_SUSPEND_DELAY_NS, the agent thread
+// suspends it and keeps it stopped with DelayEngine::pay_suspended. JVMTI
+// suspension is stood in for by a signal handler waiting to be resumed.
+
+#define SUSPEND_TICKS 500
+// Ticks without new delays at the end, to let the threads catch up
+#define SUSPEND_DRAIN_TICKS 100
+#define SUSPEND_TICK_DELAY_NS 500000L
+
+struct SpinningThread
+{
+  SpinningThread()
+  {
+    sem_init(&suspended, 0, 0);
+    sem_init(&resumed, 0, 0);
+  }
+
+  ~SpinningThread()
+  {
+    sem_destroy(&suspended);
+    sem_destroy(&resumed);
+  }
+
+  pthread_t thread;
+  long local_delay = 0;
+  std::atomic<bool> owes_delay{false};
+  std::atomic<long> suspended_delay{0};
+  sem_t suspended;
+  sem_t resumed;
+};
+
+static std::atomic<long> spin_global_delay;
+static thread_local SpinningThread *curr_spinning_thread = NULL;
+
+static void handle_spin_sample(int signum, siginfo_t *info, void *context)
+{
+  SpinningThread *st = curr_spinning_thread;
+  if (st == NULL)
+    return;
+  st->local_delay += st->suspended_delay.exchange(0, std::memory_order_relaxed);
+  if (spin_global_delay - st->local_delay >= MIN_SUSPEND_DELAY_NS)
+    st->owes_delay.store(true, std::memory_order_relaxed);
+}
+
+static void handle_spin_suspend(int signum, siginfo_t *info, void *context)
+{
+  SpinningThread *st = curr_spinning_thread;
+  if (st == NULL)
+    return;
+  sem_post(&st->suspended);
+  while (sem_wait(&st->resumed) != 0 && errno == EINTR)
+    ;
+}
+
+static void *run_spinning_thread(void *arg)
+{
+  curr_spinning_thread = static_cast<SpinningThread *>(arg);
+  threads_ready++;
+  volatile unsigned long work = 0;
+  while (threads_running)
+  {
+    work++;
+  }
+  curr_spinning_thread = NULL;
+  return NULL;
+}
+
+// Returns false if a thread still owes a delay it should have been suspended for
+static bool bench_running_thread_delays(int num_threads)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = handle_spin_sample;
+  sigaction(SIGUSR1, &sa, NULL);
+  // A suspended thread takes no samples
+  sigaddset(&sa.sa_mask, SIGUSR1);
+  sa.sa_sigaction = handle_spin_suspend;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  spin_global_delay = 0;
+  std::vector<SpinningThread *> threads;
+  threads_running = true;
+  threads_ready = 0;
+  for (int i = 0; i < num_threads; i++)
+  {
+    SpinningThread *st = new SpinningThread();
+    pthread_create(&st->thread, NULL, run_spinning_thread, st);
+    threads.push_back(st);
+  }
+  while (threads_ready < num_threads)
+    ;
+
+  // Each tick another thread runs a line sped up, which every spinning thread owes
+  std::vector<DelayEngine::Debt> debts;
+  for (int tick = 0; tick < SUSPEND_TICKS + SUSPEND_DRAIN_TICKS; tick++)
+  {
+    DelayEngine::sleep(SUSPEND_TICK_DELAY_NS);
+    if (tick < SUSPEND_TICKS)
+      spin_global_delay += SUSPEND_TICK_DELAY_NS;
+    for (auto i = threads.begin(); i != threads.end(); i++)
+    {
+      pthread_kill((*i)->thread, SIGUSR1);
+    }
+
+    debts.clear();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+      SpinningThread *st = threads[i];
+      if (!st->owes_delay.exchange(false, std::memory_order_relaxed))
+        continue;
+      pthread_kill(st->thread, SIGUSR2);
+      while (sem_wait(&st->suspended) != 0 && errno == EINTR)
+        ;
+      long owed = spin_global_delay - st->local_delay - st->suspended_delay.load(std::memory_order_relaxed);
+      if (owed <= 0)
+      {
+        sem_post(&st->resumed);
+        continue;
+      }
+      debts.push_back({owed, i});
+    }
+    DelayEngine::pay_suspended(debts, [&threads](const DelayEngine::Debt &debt, long paid)
+                               {
+                                 threads[debt.index]->suspended_delay.fetch_add(paid, std::memory_order_relaxed);
+                                 sem_post(&threads[debt.index]->resumed); });
+  }
+
+  threads_running = false;
+  long max_lag = 0;
+  for (auto i = threads.begin(); i != threads.end(); i++)
+  {
+    pthread_join((*i)->thread, NULL);
+    long paid = (*i)->local_delay + (*i)->suspended_delay.load();
+    max_lag = std::max(max_lag, (long)spin_global_delay - paid);
+    delete *i;
+  }
+  // Less than MIN_SUSPEND_DELAY_NS is never paid by suspending the thread
+  bool converged = max_lag < MIN_SUSPEND_DELAY_NS;
+  printf("  %2d threads: %ldms inserted, at most %.2fms unpaid at the end (%s)\n",
+         num_threads, (long)spin_global_delay / 1000000, max_lag / 1e6,
+         converged ? "converged" : "NOT CONVERGED");
+  return converged;
+}
+
+int main()
+{
+  srand(1);
+  make_methods();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = handle;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  printf("Signal handler (without AsyncGetCallTrace, %d frames per stack):\n", BENCH_STACK_DEPTH);
+  int thread_counts[] = {1, 2, 4, 8, 16, 32};
+  for (int i = 0; i < 6; i++)
+  {
+    bench_signal_handler(thread_counts[i]);
+  }
+
+  printf("In scope lookup (%d methods):\n", BENCH_METHODS);
+  bench_in_scope_lookup();
+
+  printf("Experiment selection:\n");
+  bench_experiment_selection(1000);
+  bench_experiment_selection(10000);
+  bench_experiment_selection(100000);
+
+  printf("Output sink:\n");
+  bench_result_sink("csv");
+  bench_result_sink("binary");
+
+  printf("Delays:\n");
+  bench_delay(10000);
+  bench_delay(100000);
+  bench_delay(1000000);
+
+  printf("Delays of running threads (paid by suspending them):\n");
+  bool converged = true;
+  for (int i = 0; i < 3; i++)
+  {
+    converged = bench_running_thread_delays(thread_counts[i * 2]) && converged;
+  }
+  return converged ? 0 : 1;
+}
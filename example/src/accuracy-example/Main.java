@@ -0,0 +1,29 @@
+import model.*;
+
+/**
+ * Workloads whose causal profile is known, to check the accuracy of JCoz.
+ * Progress point: line 25 (one hit per iteration). See model/Work.java for
+ * the expected speedup of each line.
+ */
+public class Main {
+
+    public static void main(String[] args) throws InterruptedException {
+        String mode = args.length > 0 ? args[0] : "serial";
+        long iteration = 0;
+
+        while (true) {
+            if (mode.equals("parallel")) {
+                Thread slowThread = new Thread(() -> Work.slow());
+                Thread fastThread = new Thread(() -> Work.fast());
+                slowThread.start();
+                fastThread.start();
+                slowThread.join();
+                fastThread.join();
+            } else {
+                Work.serial();
+            }
+            iteration++;
+        }
+    }
+
+}
@@ -0,0 +1,46 @@
+package model;
+
+/**
+ * Ground truth of the accuracy workloads, with s the virtual speedup of a
+ * line. All the work is done on line 43 (spinA) and line 45 (spinB).
+ *
+ * serial (one thread): an iteration runs 3 units on line 43 and 7 units on
+ * line 45. Speeding up line 43 improves throughput by 1 / (1 - 0.3 s) - 1
+ * (at most 43%), line 45 by 1 / (1 - 0.7 s) - 1 (at most 233%).
+ *
+ * parallel (two threads, joined every iteration): one thread runs 10 units
+ * on line 43 while the other runs 5 units on line 45. Speeding up line 43
+ * improves throughput by 1 / max(1 - s, 0.5) - 1, i.e. linearly up to 100% at
+ * s = 0.5 and flat after. Speeding up line 45 has no effect at all.
+ */
+public class Work {
+
+    // Iterations of a spin loop in one unit of work, roughly 0.1ms
+    private static final int UNIT = 50000;
+
+    public static volatile long sink;
+
+    private Work() {
+    }
+
+    public static void serial() {
+        spinA(3 * UNIT);
+        spinB(7 * UNIT);
+    }
+
+    public static void slow() {
+        // Critical path of the parallel workload
+        spinA(10 * UNIT);
+    }
+
+    public static void fast() {
+        spinB(5 * UNIT);
+    }
+
+    // Each loop is kept on a single line, so all of its samples (and all of
+    // its virtual speedup) go to that line. The two loops are identical, so
+    // both lines cost the same per unit
+    private static void spinA(int n) { long x = sink; for (int i = 0; i < n; i++) { x = x * 6364136223846793005L + 1442695040888963407L; } sink = x; }
+
+    private static void spinB(int n) { long x = sink; for (int i = 0; i < n; i++) { x = x * 6364136223846793005L + 1442695040888963407L; } sink = x; }
+}
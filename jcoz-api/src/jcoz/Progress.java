@@ -0,0 +1,58 @@
+package jcoz;
+
+/**
+ * Progress points that are hit from application code instead of through a JVMTI breakpoint.
+ *
+ * A breakpoint forces the JIT to deoptimize the method it is set in, and every hit goes
+ * through a JVMTI event. The methods here are implemented by the JCoz agent, and a hit only
+ * increments a counter of the calling thread.
+ *
+ * Points are looked up by the name given to the agent's progress-point (or latency-point)
+ * option, e.g. progress-point=requests. Look the point up once and keep the id:
+ *
+ * <pre>
+ *     private static final int REQUESTS = Progress.register("requests");
+ *     ...
+ *     Progress.hit(REQUESTS);
+ * </pre>
+ *
+ * Without the agent attached (or for a name the agent was not given), register returns -1
+ * and hitting that id does nothing.
+ */
+public final class Progress {
+
+    private static final boolean AGENT_LOADED = isAgentLoaded();
+
+    private Progress() {
+    }
+
+    /**
+     * Returns the id of the progress point with the given name, or -1 if it is not being profiled.
+     */
+    public static int register(String name) {
+        return AGENT_LOADED ? registerNative(name) : -1;
+    }
+
+    /**
+     * Records a hit of the progress point with the given id.
+     */
+    public static void hit(int point) {
+        if (point >= 0) {
+            hitNative(point);
+        }
+    }
+
+    private static boolean isAgentLoaded() {
+        try {
+            registerNative("");
+            return true;
+        } catch (UnsatisfiedLinkError error) {
+            return false;
+        }
+    }
+
+    private static native int registerNative(String name);
+
+    private static native void hitNative(int point);
+
+}
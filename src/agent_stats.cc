@@ -0,0 +1,275 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "agent_stats.h"
+
+#include <stdio.h>
+#include <sstream>
+
+#include "spdlog/spdlog.h"
+
+namespace
+{
+  const char *const kLockNames[agent_stats::NUM_SPIN_LOCKS] = {
+      "user_threads", "class_prep", "method_id_set", "line_table", "class_name", "thread_registry", "session"};
+
+  const char *const kMemoryPoolNames[agent_stats::NUM_MEMORY_POOLS] = {
+      "in_scope_ids", "class_names", "line_tables", "sample_histogram", "bci_hits", "symbols", "call_frames", "method_state"};
+
+  std::atomic<unsigned long> contended_acquisitions[agent_stats::NUM_SPIN_LOCKS];
+  std::atomic<unsigned long> lock_spins[agent_stats::NUM_SPIN_LOCKS];
+  std::atomic<unsigned long> delays;
+  std::atomic<unsigned long> delay_requested_ns;
+  std::atomic<unsigned long> delay_actual_ns;
+  std::atomic<unsigned long> delay_overshoot[STATS_HISTOGRAM_BUCKETS];
+  std::atomic<unsigned long> evicted_methods;
+  std::atomic<unsigned long> memory_trims;
+  std::atomic<unsigned long> dropped_results;
+
+  inline int bucket(long nanoseconds)
+  {
+    if (nanoseconds <= 1)
+      return 0;
+    int index = 63 - __builtin_clzl((unsigned long)nanoseconds);
+    return index < STATS_HISTOGRAM_BUCKETS ? index : STATS_HISTOGRAM_BUCKETS - 1;
+  }
+
+  void write_histogram(std::ostream &out, const agent_stats::Histogram &histogram)
+  {
+    out << "{\"count\":" << histogram.count()
+        << ",\"p50_ns\":" << histogram.percentile(0.5)
+        << ",\"p99_ns\":" << histogram.percentile(0.99)
+        << ",\"max_ns\":" << histogram.percentile(1)
+        << ",\"buckets\":[";
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+      out << (i == 0 ? "" : ",") << histogram.buckets[i];
+    }
+    out << "]}";
+  }
+} // namespace
+
+namespace agent_stats
+{
+  unsigned long Histogram::count() const
+  {
+    unsigned long total = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+      total += buckets[i];
+    return total;
+  }
+
+  long Histogram::percentile(double fraction) const
+  {
+    unsigned long total = count();
+    if (total == 0)
+      return 0;
+    unsigned long seen = 0;
+    int last = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+      if (buckets[i] == 0)
+        continue;
+      seen += buckets[i];
+      last = i;
+      if (seen >= fraction * total)
+        break;
+    }
+    return 1L << (last + 1);
+  }
+
+  unsigned long Snapshot::total_memory_bytes() const
+  {
+    unsigned long total = 0;
+    for (int i = 0; i < NUM_MEMORY_POOLS; i++)
+      total += memory_bytes[i];
+    return total;
+  }
+
+  ThreadStats::ThreadStats()
+  {
+    samples_.store(0, std::memory_order_relaxed);
+    handler_ns_.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+      handler_time_[i].store(0, std::memory_order_relaxed);
+    for (int i = 0; i <= kNumCallTraceErrors; i++)
+      asgct_errors_[i].store(0, std::memory_order_relaxed);
+  }
+
+  void ThreadStats::record_handler(long nanoseconds)
+  {
+    bump(samples_, 1);
+    bump(handler_ns_, nanoseconds);
+    bump(handler_time_[bucket(nanoseconds)], 1);
+  }
+
+  void ThreadStats::record_asgct_error(int num_frames)
+  {
+    int index = -num_frames;
+    bump(asgct_errors_[index > 0 && index <= kNumCallTraceErrors ? index : 0], 1);
+  }
+
+  void ThreadStats::add_to(Snapshot &snapshot) const
+  {
+    snapshot.samples += samples_.load(std::memory_order_relaxed);
+    snapshot.handler_ns += handler_ns_.load(std::memory_order_relaxed);
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+      snapshot.handler_time.buckets[i] += handler_time_[i].load(std::memory_order_relaxed);
+    for (int i = 0; i <= kNumCallTraceErrors; i++)
+      snapshot.asgct_errors[i] += asgct_errors_[i].load(std::memory_order_relaxed);
+  }
+
+  void merge(Snapshot &snapshot, const Snapshot &other)
+  {
+    snapshot.samples += other.samples;
+    snapshot.handler_ns += other.handler_ns;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+      snapshot.handler_time.buckets[i] += other.handler_time.buckets[i];
+      snapshot.delay_overshoot.buckets[i] += other.delay_overshoot.buckets[i];
+    }
+    for (int i = 0; i <= kNumCallTraceErrors; i++)
+      snapshot.asgct_errors[i] += other.asgct_errors[i];
+    snapshot.dropped_samples += other.dropped_samples;
+    for (int i = 0; i < NUM_SPIN_LOCKS; i++)
+    {
+      snapshot.contended_acquisitions[i] += other.contended_acquisitions[i];
+      snapshot.lock_spins[i] += other.lock_spins[i];
+    }
+    snapshot.delays += other.delays;
+    snapshot.delay_requested_ns += other.delay_requested_ns;
+    snapshot.delay_actual_ns += other.delay_actual_ns;
+  }
+
+  void add_shared(Snapshot &snapshot)
+  {
+    for (int i = 0; i < NUM_SPIN_LOCKS; i++)
+    {
+      snapshot.contended_acquisitions[i] += contended_acquisitions[i].load(std::memory_order_relaxed);
+      snapshot.lock_spins[i] += lock_spins[i].load(std::memory_order_relaxed);
+    }
+    snapshot.delays += delays.load(std::memory_order_relaxed);
+    snapshot.delay_requested_ns += delay_requested_ns.load(std::memory_order_relaxed);
+    snapshot.delay_actual_ns += delay_actual_ns.load(std::memory_order_relaxed);
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+      snapshot.delay_overshoot.buckets[i] += delay_overshoot[i].load(std::memory_order_relaxed);
+    snapshot.evicted_methods += evicted_methods.load(std::memory_order_relaxed);
+    snapshot.memory_trims += memory_trims.load(std::memory_order_relaxed);
+    snapshot.dropped_results += dropped_results.load(std::memory_order_relaxed);
+  }
+
+  void record_spins(spin_lock_id lock, unsigned long spins)
+  {
+    contended_acquisitions[lock].fetch_add(1, std::memory_order_relaxed);
+    lock_spins[lock].fetch_add(spins, std::memory_order_relaxed);
+  }
+
+  void record_delay(long requested, long actual)
+  {
+    delays.fetch_add(1, std::memory_order_relaxed);
+    delay_requested_ns.fetch_add(requested, std::memory_order_relaxed);
+    delay_actual_ns.fetch_add(actual, std::memory_order_relaxed);
+    // A delay paid from earlier credit has no overshoot
+    delay_overshoot[bucket(actual - requested)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void record_evictions(unsigned long methods)
+  {
+    evicted_methods.fetch_add(methods, std::memory_order_relaxed);
+  }
+
+  void record_memory_trim()
+  {
+    memory_trims.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void record_dropped_results(unsigned long results)
+  {
+    dropped_results.fetch_add(results, std::memory_order_relaxed);
+  }
+
+  std::string format(const Snapshot &snapshot, long uptime_ms)
+  {
+    unsigned long asgct_errors = 0;
+    for (int i = 0; i <= kNumCallTraceErrors; i++)
+      asgct_errors += snapshot.asgct_errors[i];
+    unsigned long contended = 0;
+    unsigned long spins = 0;
+    for (int i = 0; i < NUM_SPIN_LOCKS; i++)
+    {
+      contended += snapshot.contended_acquisitions[i];
+      spins += snapshot.lock_spins[i];
+    }
+    long delay_overshoot_ns = (long)(snapshot.delay_actual_ns - snapshot.delay_requested_ns);
+    return fmt::format(
+        "Agent overhead after {}ms: {} samples taking {}ms in the handler (p50 {}ns, p99 {}ns), "
+        "{} AsyncGetCallTrace errors, {} dropped samples, {} contended lock acquisitions ({} spins), "
+        "{} delays overshooting by {}ns in total (p99 {}ns), {}KB in tables, {} methods of unloaded classes evicted, "
+        "{} results of unnamed methods dropped",
+        uptime_ms, snapshot.samples, snapshot.handler_ns / 1000000,
+        snapshot.handler_time.percentile(0.5), snapshot.handler_time.percentile(0.99),
+        asgct_errors, snapshot.dropped_samples, contended, spins,
+        snapshot.delays, delay_overshoot_ns, snapshot.delay_overshoot.percentile(0.99),
+        snapshot.total_memory_bytes() / 1024, snapshot.evicted_methods,
+        snapshot.dropped_results);
+  }
+
+  bool write_json(const std::string &path, const Snapshot &snapshot, long uptime_ms)
+  {
+    std::ostringstream out;
+    out << "{\"uptime_ms\":" << uptime_ms
+        << ",\"samples\":" << snapshot.samples
+        << ",\"handler_ns\":" << snapshot.handler_ns
+        << ",\"handler_time\":";
+    write_histogram(out, snapshot.handler_time);
+    out << ",\"asgct_errors\":[";
+    for (int i = 0; i <= kNumCallTraceErrors; i++)
+      out << (i == 0 ? "" : ",") << snapshot.asgct_errors[i];
+    out << "],\"dropped_samples\":" << snapshot.dropped_samples
+        << ",\"locks\":{";
+    for (int i = 0; i < NUM_SPIN_LOCKS; i++)
+    {
+      out << (i == 0 ? "" : ",") << "\"" << kLockNames[i] << "\":{\"contended\":"
+          << snapshot.contended_acquisitions[i] << ",\"spins\":" << snapshot.lock_spins[i] << "}";
+    }
+    out << "},\"dropped_results\":" << snapshot.dropped_results
+        << ",\"delays\":" << snapshot.delays
+        << ",\"delay_requested_ns\":" << snapshot.delay_requested_ns
+        << ",\"delay_actual_ns\":" << snapshot.delay_actual_ns
+        << ",\"delay_overshoot\":";
+    write_histogram(out, snapshot.delay_overshoot);
+    out << ",\"memory\":{\"total_bytes\":" << snapshot.total_memory_bytes()
+        << ",\"budget_bytes\":" << snapshot.memory_budget_bytes
+        << ",\"trims\":" << snapshot.memory_trims
+        << ",\"evicted_methods\":" << snapshot.evicted_methods
+        << ",\"pools\":{";
+    for (int i = 0; i < NUM_MEMORY_POOLS; i++)
+    {
+      out << (i == 0 ? "" : ",") << "\"" << kMemoryPoolNames[i] << "\":" << snapshot.memory_bytes[i];
+    }
+    out << "}}}\n";
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "w");
+    if (file == NULL)
+      return false;
+    std::string json = out.str();
+    bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+    written = fclose(file) == 0 && written;
+    return written && rename(tmp_path.c_str(), path.c_str()) == 0;
+  }
+} // namespace agent_stats
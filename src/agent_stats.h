@@ -0,0 +1,215 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_AGENT_STATS_H
+#define JCOZ_AGENT_STATS_H
+
+#include <atomic>
+#include <string>
+#include <time.h>
+
+#include "globals.h"
+
+// Measures what the agent itself costs the application: time spent in the
+// signal handler, AsyncGetCallTrace errors, samples dropped by full rings,
+// contention on the agent's spin locks, how far delays overshoot and how much
+// memory the agent's own tables take.
+//
+// Counters of the signal handler are kept per thread and only written by
+// their thread, so recording them is a plain load and store. Counters shared
+// by all threads are only touched on rare paths (a contended lock, a delay).
+// The agent thread sums everything into a Snapshot.
+namespace agent_stats
+{
+  enum spin_lock_id
+  {
+    _user_threads_lock,
+    _class_prep_lock,
+    _method_id_set_lock,
+    _line_table_lock,
+    _class_name_lock,
+    _thread_registry_lock,
+    _session_lock,
+    NUM_SPIN_LOCKS,
+  };
+
+  // Tables whose size is accounted against the memory-budget option
+  enum memory_pool_id
+  {
+    _in_scope_ids_memory,
+    _class_names_memory,
+    _line_tables_memory,
+    _sample_histogram_memory,
+    _bci_hits_memory,
+    _symbols_memory,
+    _call_frames_memory,
+    _method_state_memory,
+    NUM_MEMORY_POOLS,
+  };
+
+  // Bucket i counts durations below 2^(i+1) ns (and at least 2^i ns), the
+  // last bucket counts everything longer
+  struct Histogram
+  {
+    unsigned long buckets[STATS_HISTOGRAM_BUCKETS] = {};
+
+    unsigned long count() const;
+
+    // Upper bound (ns) of the bucket holding the given fraction of durations
+    long percentile(double fraction) const;
+  };
+
+  struct Snapshot
+  {
+    unsigned long samples = 0;
+    unsigned long handler_ns = 0;
+    Histogram handler_time;
+    // Indexed by the negated AsyncGetCallTrace error code, 0 for codes out of range
+    unsigned long asgct_errors[kNumCallTraceErrors + 1] = {};
+    unsigned long dropped_samples = 0;
+    unsigned long contended_acquisitions[NUM_SPIN_LOCKS] = {};
+    unsigned long lock_spins[NUM_SPIN_LOCKS] = {};
+    unsigned long delays = 0;
+    unsigned long delay_requested_ns = 0;
+    unsigned long delay_actual_ns = 0;
+    Histogram delay_overshoot;
+    // Filled in by the agent thread, not added up by `merge`
+    unsigned long memory_bytes[NUM_MEMORY_POOLS] = {};
+    unsigned long memory_budget_bytes = 0;
+    unsigned long evicted_methods = 0;
+    unsigned long memory_trims = 0;
+    unsigned long dropped_results = 0;
+
+    unsigned long total_memory_bytes() const;
+  };
+
+  class ThreadStats
+  {
+  public:
+    ThreadStats();
+
+    void record_handler(long nanoseconds);
+
+    void record_asgct_error(int num_frames);
+
+    // Adds this thread's counters to `snapshot`, may race with the owner
+    // thread, which only makes the snapshot slightly stale
+    void add_to(Snapshot &snapshot) const;
+
+  private:
+    static void bump(std::atomic<unsigned long> &counter, unsigned long value)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::atomic<unsigned long> samples_;
+    std::atomic<unsigned long> handler_ns_;
+    std::atomic<unsigned long> handler_time_[STATS_HISTOGRAM_BUCKETS];
+    std::atomic<unsigned long> asgct_errors_[kNumCallTraceErrors + 1];
+
+    DISALLOW_COPY_AND_ASSIGN(ThreadStats);
+  };
+
+  // Adds `other`, e.g. the counters of a thread that exited
+  void merge(Snapshot &snapshot, const Snapshot &other);
+
+  // Adds the counters shared by all threads
+  void add_shared(Snapshot &snapshot);
+
+  void record_spins(spin_lock_id lock, unsigned long spins);
+
+  void record_delay(long requested, long actual);
+
+  // jmethodIDs of unloaded classes dropped from the agent's tables
+  void record_evictions(unsigned long methods);
+
+  // Tables emptied because the memory-budget was exceeded
+  void record_memory_trim();
+
+  // Experiment results thrown out because their method could not be named
+  void record_dropped_results(unsigned long results);
+
+  // Approximate heap footprint of an unordered_map (or set) whose values own
+  // `value_bytes` more bytes each: nodes of one value and a next pointer, and buckets
+  template <typename Map>
+  inline unsigned long hash_map_bytes(const Map &map, unsigned long value_bytes = 0)
+  {
+    return map.size() * (sizeof(typename Map::value_type) + sizeof(void *) + value_bytes) +
+           map.bucket_count() * sizeof(void *);
+  }
+
+  // Heap bytes of a string, short strings are stored inline
+  inline unsigned long string_bytes(const std::string &str)
+  {
+    return str.capacity() > 15 ? str.capacity() + 1 : 0;
+  }
+
+  // Async-signal-safe (clock_gettime on CLOCK_MONOTONIC)
+  inline long now()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+  }
+
+  // Takes a spin lock word with __sync_bool_compare_and_swap, counting the
+  // failed attempts. Callers issue their own fences, as before
+  template <typename T, typename U>
+  inline void spin_lock(volatile T *lock, U owner, spin_lock_id id)
+  {
+    unsigned long spins = 0;
+    while (!__sync_bool_compare_and_swap(lock, (T)0, (T)owner))
+      spins++;
+    if (spins > 0)
+      record_spins(id, spins);
+  }
+
+  // Records the time spent in the signal handler by the calling thread,
+  // up to `stop()` or the end of the scope, whichever comes first
+  class HandlerTimer
+  {
+  public:
+    explicit HandlerTimer(ThreadStats &stats) : stats_(stats), start_(now()), stopped_(false) {}
+
+    ~HandlerTimer() { stop(); }
+
+    void stop()
+    {
+      if (!stopped_)
+      {
+        stats_.record_handler(now() - start_);
+        stopped_ = true;
+      }
+    }
+
+  private:
+    ThreadStats &stats_;
+    long start_;
+    bool stopped_;
+
+    DISALLOW_COPY_AND_ASSIGN(HandlerTimer);
+  };
+
+  // One line summary for the log
+  std::string format(const Snapshot &snapshot, long uptime_ms);
+
+  // Replaces `path` with the snapshot as a JSON object. Written to a
+  // temporary file first, so readers never see a partial file
+  bool write_json(const std::string &path, const Snapshot &snapshot, long uptime_ms);
+} // namespace agent_stats
+
+#endif // JCOZ_AGENT_STATS_H
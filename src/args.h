@@ -5,6 +5,7 @@
 #include <iostream>
 #include <iomanip>
 #include <ctime>
+#include <stdexcept>
 
 #include "spdlog/spdlog.h"
 
@@ -14,11 +15,33 @@ enum profiler_option
   _search_scopes,
   _ignored_scopes,
   _progress_point,
+  _latency_point,
   _end_to_end,
   _warmup,
   _fix_exp,
+  _confidence,
+  _line_samples,
+  _timer_sampling,
+  _fast_startup,
+  _sample_interval,
+  _stack_depth,
+  _duty_cycle,
+  _stats_file,
+  _memory_budget,
+  _session,
+  _coordinator,
+  _summary_file,
+  _control,
+  _paused,
+  _explore,
+  _parallel_lines,
+  _call_chain,
+  _granularity,
+  _threads,
+  _thread_groups,
   _logging_level,
   _output_file,
+  _output_format,
 };
 
 namespace agent_args
@@ -31,16 +54,60 @@ namespace agent_args
       return _ignored_scopes;
     if (option == "progress-point")
       return _progress_point;
+    if (option == "latency-point")
+      return _latency_point;
     if (option == "end-to-end")
       return _end_to_end;
     if (option == "warmup")
       return _warmup;
     if (option == "fix-exp")
       return _fix_exp;
+    if (option == "confidence")
+      return _confidence;
+    if (option == "line-samples")
+      return _line_samples;
+    if (option == "timer-sampling")
+      return _timer_sampling;
+    if (option == "fast-startup")
+      return _fast_startup;
+    if (option == "sample-interval")
+      return _sample_interval;
+    if (option == "stack-depth")
+      return _stack_depth;
+    if (option == "duty-cycle")
+      return _duty_cycle;
+    if (option == "stats-file")
+      return _stats_file;
+    if (option == "memory-budget")
+      return _memory_budget;
+    if (option == "session")
+      return _session;
+    if (option == "coordinator")
+      return _coordinator;
+    if (option == "summary-file")
+      return _summary_file;
+    if (option == "control")
+      return _control;
+    if (option == "paused")
+      return _paused;
+    if (option == "explore")
+      return _explore;
+    if (option == "parallel-lines")
+      return _parallel_lines;
+    if (option == "call-chain")
+      return _call_chain;
+    if (option == "granularity")
+      return _granularity;
+    if (option == "threads")
+      return _threads;
+    if (option == "thread-groups")
+      return _thread_groups;
     if (option == "logging-level")
       return _logging_level;
     if (option == "output-file")
       return _output_file;
+    if (option == "output-format")
+      return _output_format;
 
     return _unknown;
   }
@@ -51,21 +118,49 @@ namespace agent_args
         << "usage: java -agentpath:<absolute_path_to_agent>="
         << "pkg=<package_name>_"
         << "search=<package_name>|<another_package_name> (optional if pkg is specified)"
-        << "progress-point=<class:line_no>_"
+        << "progress-point=<class:line_no>|<another_class:line_no>_"
+        << "latency-point=<begin_class:line_no>,<end_class:line_no>|<another_pair> (optional)_"
         << "ignore=<package_name>|<another_package_name> (optional)"
         << "end-to-end (optional)_"
         << "fix-exp (optional)_"
+        << "confidence=<relative_ci_half_width> (optional - default off)_"
+        << "line-samples=<experiments_per_speedup> (optional - default unlimited)_"
+        << "timer-sampling (optional)_"
+        << "fast-startup (optional)_"
+        << "sample-interval=<microseconds> (optional - default 1000)_"
+        << "stack-depth=<frames> (optional - default 128)_"
+        << "duty-cycle=<experiments>,<idle_time_ms> (optional)_"
+        << "stats-file=<path> (optional)_"
+        << "memory-budget=<megabytes> (optional - default unlimited)_"
+        << "session=<path> (optional)_"
+        << "coordinator=<host>:<port> (optional)_"
+        << "summary-file=<path> (optional - default <output_file>.summary.csv)_"
+        << "control=<unix_socket_path> (optional)_"
+        << "paused (optional)_"
+        << "explore=<fraction_of_experiments> (optional - default 0)_"
+        << "parallel-lines=<lines_per_experiment> (optional - default 1)_"
+        << "call-chain=<in_scope_frames_per_sample> (optional - default 1)_"
+        << "granularity=<line|method|class|auto> (optional - default line)_"
+        << "threads=<name_pattern>|... (optional)_"
+        << "thread-groups=<group_pattern>|... (optional - default main)_"
         << "warmup=<warmup_time_ms> (optional - default 0 ms)"
         << "logging-level=<desired_logging_level> (optional - default info)"
-        << "output-file=<output_filename> (optional - default jcoz-output.csv)"
+        << "output-file=<output_filename> (optional - default jcoz-output.csv)_"
+        << "output-format=<csv|binary> (optional - default csv)"
         << "\n"
         << "progress-point class MUST follow JVM spec class signature conventions"
         << "e.g. java.lang.String has the signature Ljava/lang/String"
         << std::endl;
   }
 
+  // Set while parsing options of a live JVM (attach or control channel),
+  // which must not be exited because of a typo
+  static bool throw_errors = false;
+
   void report_error(const char *message)
   {
+    if (throw_errors)
+      throw std::invalid_argument(message);
     std::cerr << message << std::endl;
     print_usage();
     exit(1);
@@ -111,7 +206,7 @@ namespace agent_args
     return spdlog::level::off; // UNREACHABLE
   }
 
-  void set_output_file(std::string output_string_from_command_line)
+  void set_output_file(std::string output_string_from_command_line, const char *extension)
   {
     auto c_time = std::time(nullptr);
     auto current_time = *std::localtime(&c_time);
@@ -119,11 +214,11 @@ namespace agent_args
     auto position = output_string_from_command_line.find('.');
     if (position != std::string::npos)
     {
-      output_stringstream << output_string_from_command_line.substr(0, position) << std::put_time(&current_time, "-%d-%m-%Y-%H-%M-%S") << ".csv";
+      output_stringstream << output_string_from_command_line.substr(0, position) << std::put_time(&current_time, "-%d-%m-%Y-%H-%M-%S") << extension;
     }
     else
     {
-      output_stringstream << output_string_from_command_line << std::put_time(&current_time, "-%d-%m-%Y-%H-%M-%S") << ".csv";
+      output_stringstream << output_string_from_command_line << std::put_time(&current_time, "-%d-%m-%Y-%H-%M-%S") << extension;
     }
     kOutputFile = output_stringstream.str();
   }
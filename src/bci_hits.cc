@@ -1,34 +1,228 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
 #include "bci_hits.h"
 
-#include <sstream>
+#include <stdint.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "spdlog/spdlog.h"
 
-void bci_hits::add_hit(char *class_fqn, jmethodID method_id, jint line_number, jint bci)
+namespace
+{
+  struct HitEntry
+  {
+    // NULL for a free slot
+    jmethodID method_id;
+    // bci or line number, depending on the table
+    jint key;
+    jint line_number;
+    unsigned int hits;
+  };
+
+  // Open-addressing table with linear probing, kept at most half full
+  class HitTable
+  {
+  public:
+    explicit HitTable(size_t capacity) : slots_(capacity), count_(0), initial_capacity_(capacity) {}
+
+    // Inserts an entry without hits if there is none for the key
+    HitEntry &get(jmethodID method_id, jint key)
+    {
+      if ((count_ + 1) * 2 > slots_.size())
+      {
+        grow();
+      }
+      HitEntry &slot = slots_[probe(slots_, method_id, key)];
+      if (slot.method_id == NULL)
+      {
+        slot.method_id = method_id;
+        slot.key = key;
+        slot.hits = 0;
+        count_++;
+      }
+      return slot;
+    }
+
+    const HitEntry *find(jmethodID method_id, jint key) const
+    {
+      const HitEntry &slot = slots_[probe(slots_, method_id, key)];
+      return slot.method_id == NULL ? NULL : &slot;
+    }
+
+    const std::vector<HitEntry> &slots() const { return slots_; }
+
+    // Rebuilds the table without the entries of `methods`, shrunk to at most a quarter full
+    void remove_methods(const std::unordered_set<jmethodID> &methods)
+    {
+      size_t remaining = 0;
+      for (auto slot = slots_.begin(); slot != slots_.end(); slot++)
+      {
+        if (slot->method_id != NULL && methods.count(slot->method_id) == 0)
+        {
+          remaining++;
+        }
+      }
+      if (remaining == count_)
+      {
+        return;
+      }
+      size_t capacity = initial_capacity_;
+      while (remaining * 4 > capacity)
+      {
+        capacity <<= 1;
+      }
+      std::vector<HitEntry> rebuilt(capacity);
+      for (auto slot = slots_.begin(); slot != slots_.end(); slot++)
+      {
+        if (slot->method_id != NULL && methods.count(slot->method_id) == 0)
+        {
+          rebuilt[probe(rebuilt, slot->method_id, slot->key)] = *slot;
+        }
+      }
+      slots_.swap(rebuilt);
+      count_ = remaining;
+    }
+
+    size_t memory_bytes() const { return slots_.capacity() * sizeof(HitEntry); }
+
+    void clear()
+    {
+      std::vector<HitEntry>(initial_capacity_).swap(slots_);
+      count_ = 0;
+    }
+
+  private:
+    // Index of the slot of the key, or of the free slot it would go into
+    static size_t probe(const std::vector<HitEntry> &slots, jmethodID method_id, jint key)
+    {
+      // jmethodIDs are aligned pointers, so mix the bits before masking
+      uint64_t h = ((uint64_t)(uintptr_t)method_id ^ ((uint64_t)(uint32_t)key << 32)) * 0x9E3779B97F4A7C15ULL;
+      size_t mask = slots.size() - 1;
+      size_t i = (size_t)(h >> 17) & mask;
+      while (slots[i].method_id != NULL && (slots[i].method_id != method_id || slots[i].key != key))
+      {
+        i = (i + 1) & mask;
+      }
+      return i;
+    }
+
+    void grow()
+    {
+      std::vector<HitEntry> bigger(slots_.size() * 2);
+      for (auto slot = slots_.begin(); slot != slots_.end(); slot++)
+      {
+        if (slot->method_id != NULL)
+        {
+          bigger[probe(bigger, slot->method_id, slot->key)] = *slot;
+        }
+      }
+      slots_.swap(bigger);
+    }
+
+    std::vector<HitEntry> slots_;
+    size_t count_;
+    size_t initial_capacity_;
+  };
+
+  HitTable bci_table(BCI_HITS_INITIAL_CAPACITY);
+  HitTable line_table(BCI_HITS_INITIAL_CAPACITY);
+} // namespace
+
+void bci_hits::add_hit(jmethodID method_id, jint line_number, jint bci)
+{
+  HitEntry &bci_entry = bci_table.get(method_id, bci);
+  bci_entry.line_number = line_number;
+  bci_entry.hits++;
+
+  HitEntry &line_entry = line_table.get(method_id, line_number);
+  line_entry.line_number = line_number;
+  line_entry.hits++;
+}
+
+unsigned int bci_hits::line_hits(jmethodID method_id, jint line_number)
 {
-  _freqs[method_id][line_number][bci]++;
-  _declaring_classes[method_id] = class_fqn;
+  const HitEntry *entry = line_table.find(method_id, line_number);
+  return entry == NULL ? 0 : entry->hits;
 }
 
-std::vector<std::string> bci_hits::create_dump(jvmtiEnv *dealloc_jvmti)
+void bci_hits::dump(const std::function<std::string(jmethodID)> &method_name,
+                    const std::function<void(const std::string &)> &out,
+                    const std::unordered_set<jmethodID> *methods)
 {
-  std::vector<std::string> result;
-  result.emplace_back("Bytecode index hits:");
-  for (auto method_it = _freqs.begin(); method_it != _freqs.end(); ++method_it)
+  // Only the entries are sorted, the text is produced one line at a time
+  std::vector<const HitEntry *> entries;
+  std::unordered_map<jmethodID, std::string> names;
+  for (auto slot = bci_table.slots().begin(); slot != bci_table.slots().end(); slot++)
   {
-    char *class_fqn = _declaring_classes[method_it->first];
-    result.push_back(fmt::format("\tFor class {}:", class_fqn));
-    for (auto line_it = method_it->second.begin(); line_it != method_it->second.end(); ++line_it)
+    if (slot->method_id != NULL && (methods == NULL || methods->count(slot->method_id) > 0))
     {
-      jint line_number = line_it->first;
-      std::stringstream ss;
-      ss << "\t\t" << line_number << ": ";
-      for (auto bci_it = line_it->second.begin(); bci_it != line_it->second.end(); ++bci_it)
+      entries.push_back(&*slot);
+      if (names.find(slot->method_id) == names.end())
       {
-        ss << fmt::format("({}, {}); ", bci_it->first, bci_it->second);
+        names[slot->method_id] = method_name(slot->method_id);
       }
-      result.emplace_back(ss.str());
     }
-    dealloc_jvmti->Deallocate(reinterpret_cast<unsigned char *>(class_fqn));
   }
-  return result;
+  std::sort(entries.begin(), entries.end(), [&names](const HitEntry *a, const HitEntry *b) {
+    if (a->method_id != b->method_id && names[a->method_id] != names[b->method_id])
+      return names[a->method_id] < names[b->method_id];
+    if (a->method_id != b->method_id)
+      return (uintptr_t)a->method_id < (uintptr_t)b->method_id;
+    if (a->line_number != b->line_number)
+      return a->line_number < b->line_number;
+    return a->key < b->key;
+  });
+
+  out("Bytecode index hits:");
+  std::string line;
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const HitEntry *entry = entries[i];
+    if (i == 0 || entry->method_id != entries[i - 1]->method_id)
+    {
+      out(fmt::format("\tFor method {}:", names[entry->method_id]));
+    }
+    if (i == 0 || entry->method_id != entries[i - 1]->method_id || entry->line_number != entries[i - 1]->line_number)
+    {
+      line = fmt::format("\t\t{}: ", entry->line_number);
+    }
+    line += fmt::format("({}, {}); ", entry->key, entry->hits);
+    if (i + 1 == entries.size() || entry->method_id != entries[i + 1]->method_id || entry->line_number != entries[i + 1]->line_number)
+    {
+      out(line);
+    }
+  }
+}
+
+void bci_hits::remove_methods(const std::unordered_set<jmethodID> &methods)
+{
+  bci_table.remove_methods(methods);
+  line_table.remove_methods(methods);
+}
+
+size_t bci_hits::memory_bytes()
+{
+  return bci_table.memory_bytes() + line_table.memory_bytes();
+}
+
+void bci_hits::clear()
+{
+  bci_table.clear();
+  line_table.clear();
 }
@@ -1,23 +1,56 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
 #ifndef JCOZ_BCI_HITS_H
 #define JCOZ_BCI_HITS_H
 
 #include "globals.h"
-#include <vector>
-#include <map>
+#include <functional>
+#include <string>
+#include <unordered_set>
 
+// Number of experiments run on each bci (and on each source line).
+//
+// Hits are kept in flat open-addressing tables keyed on (jmethodID, bci) and
+// (jmethodID, line number), and methods are only named when the hits are
+// dumped, so a repeated hit neither allocates nor calls JVMTI. Only the agent
+// thread adds hits, so the tables need no lock.
 namespace bci_hits
 {
-  using hit_freq_t = std::map<jint, unsigned int>;
+  void add_hit(jmethodID method_id, jint line_number, jint bci);
+
+  // Experiments run on any bci of the line
+  unsigned int line_hits(jmethodID method_id, jint line_number);
+
+  // Writes the hits one line of text at a time, grouped by method and source
+  // line. `method_name` names the method of each group, and is called once per method.
+  // With `methods`, only the hits of those methods are written.
+  void dump(const std::function<std::string(jmethodID)> &method_name,
+            const std::function<void(const std::string &)> &out,
+            const std::unordered_set<jmethodID> *methods = NULL);
 
-  void add_hit(char *class_fqn, jmethodID method_id, jint line_number, jint bci);
+  // Forgets the hits of these methods (e.g. of unloaded classes)
+  void remove_methods(const std::unordered_set<jmethodID> &methods);
 
-  std::vector<std::string> create_dump(jvmtiEnv *dealloc_jvmti);
+  // Bytes of both tables
+  size_t memory_bytes();
 
-  namespace
-  {
-    std::map<jmethodID, std::map<jint, hit_freq_t>> _freqs;
-    std::map<jmethodID, char *> _declaring_classes;
-  }
+  // Also shrinks the tables back to BCI_HITS_INITIAL_CAPACITY
+  void clear();
 } // namespace bci_hits
 
 #endif // JCOZ_BCI_HITS_H
@@ -0,0 +1,113 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "class_name_table.h"
+#include "agent_stats.h"
+
+#include <atomic>
+
+void ClassNameTable::lock()
+{
+  agent_stats::spin_lock(&lock_, 1, agent_stats::_class_name_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void ClassNameTable::unlock()
+{
+  std::atomic_thread_fence(std::memory_order_release);
+  lock_ = 0;
+}
+
+void ClassNameTable::add(const char *class_name, jint method_count, jmethodID *methods)
+{
+  lock();
+  uint32_t id = names_.intern(class_name);
+  for (jint i = 0; i < method_count; i++)
+  {
+    method_names_[methods[i]] = id;
+  }
+  unlock();
+}
+
+bool ClassNameTable::lookup(jmethodID method_id, std::string &class_name)
+{
+  lock();
+  auto entry = method_names_.find(method_id);
+  bool found = entry != method_names_.end();
+  if (found)
+  {
+    class_name = names_.get(entry->second);
+  }
+  unlock();
+  return found;
+}
+
+void ClassNameTable::methods(std::vector<jmethodID> &methods)
+{
+  lock();
+  methods.reserve(methods.size() + method_names_.size());
+  for (auto entry = method_names_.begin(); entry != method_names_.end(); entry++)
+  {
+    methods.push_back(entry->first);
+  }
+  unlock();
+}
+
+void ClassNameTable::remove(const std::vector<jmethodID> &methods)
+{
+  lock();
+  for (jmethodID method_id : methods)
+  {
+    method_names_.erase(method_id);
+  }
+  // Interned names cannot be removed one by one, so the names still used are interned again
+  std::unordered_map<uint32_t, std::string> used;
+  for (auto entry = method_names_.begin(); entry != method_names_.end(); entry++)
+  {
+    used.emplace(entry->second, names_.get(entry->second));
+  }
+  if (used.size() < names_.size())
+  {
+    names_.clear();
+    std::unordered_map<uint32_t, uint32_t> new_ids;
+    for (auto name = used.begin(); name != used.end(); name++)
+    {
+      new_ids[name->first] = names_.intern(name->second.c_str());
+    }
+    for (auto entry = method_names_.begin(); entry != method_names_.end(); entry++)
+    {
+      entry->second = new_ids[entry->second];
+    }
+  }
+  unlock();
+}
+
+size_t ClassNameTable::memory_bytes()
+{
+  lock();
+  size_t bytes = agent_stats::hash_map_bytes(method_names_) + names_.memory_bytes();
+  unlock();
+  return bytes;
+}
+
+void ClassNameTable::clear()
+{
+  lock();
+  method_names_.clear();
+  names_.clear();
+  unlock();
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_CLASS_NAME_TABLE_H
+#define JCOZ_CLASS_NAME_TABLE_H
+
+#include <jvmti.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "globals.h"
+#include "intern_table.h"
+
+// Class name of each in scope method, recorded once when the class is
+// prepared, so reporting an experiment does not fetch (and clean) the class
+// signature from JVMTI again. Names are interned, so the methods of a class
+// share one copy.
+class ClassNameTable
+{
+public:
+  ClassNameTable() : lock_(0) {}
+
+  void add(const char *class_name, jint method_count, jmethodID *methods);
+
+  // Copies the class name of `method_id` into `class_name`, returns false if unknown
+  bool lookup(jmethodID method_id, std::string &class_name);
+
+  // Appends every method with a class name to `methods`
+  void methods(std::vector<jmethodID> &methods);
+
+  // Forgets the methods (of unloaded classes), and the names no method uses any more
+  void remove(const std::vector<jmethodID> &methods);
+
+  size_t memory_bytes();
+
+  void clear();
+
+private:
+  void lock();
+
+  void unlock();
+
+  volatile int lock_;
+  InternTable names_;
+  std::unordered_map<jmethodID, uint32_t> method_names_;
+
+  DISALLOW_COPY_AND_ASSIGN(ClassNameTable);
+};
+
+#endif // JCOZ_CLASS_NAME_TABLE_H
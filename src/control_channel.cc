@@ -0,0 +1,127 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "control_channel.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool ControlChannel::open(const std::string &path)
+{
+  struct sockaddr_un address;
+  if (path.size() >= sizeof(address.sun_path))
+  {
+    return false;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+  {
+    return false;
+  }
+
+  // A socket left behind by an earlier run would make bind fail
+  unlink(path.c_str());
+  mode_t old_mask = umask(0077);
+  bool bound = bind(fd_, (struct sockaddr *)&address, sizeof(address)) == 0;
+  umask(old_mask);
+  if (!bound || listen(fd_, 4) != 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  path_ = path;
+  closing_ = false;
+  return true;
+}
+
+void ControlChannel::serve(const Handler &handler)
+{
+  while (!closing_)
+  {
+    int connection = accept4(fd_, NULL, NULL, SOCK_CLOEXEC);
+    if (connection < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // The socket was shut down by close()
+      return;
+    }
+    serve_connection(connection, handler);
+    ::close(connection);
+  }
+}
+
+void ControlChannel::serve_connection(int connection, const Handler &handler)
+{
+  std::string buffer;
+  char chunk[512];
+  while (!closing_)
+  {
+    ssize_t received = read(connection, chunk, sizeof(chunk));
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return;
+    buffer.append(chunk, received);
+
+    size_t newline;
+    while ((newline = buffer.find('\n')) != std::string::npos)
+    {
+      std::string command = buffer.substr(0, newline);
+      buffer.erase(0, newline + 1);
+      if (!command.empty() && command[command.size() - 1] == '\r')
+        command.erase(command.size() - 1);
+      if (command.empty())
+        continue;
+
+      std::string reply = handler(command) + "\n";
+      size_t sent = 0;
+      while (sent < reply.size())
+      {
+        ssize_t result = write(connection, reply.data() + sent, reply.size() - sent);
+        if (result < 0 && errno == EINTR)
+          continue;
+        if (result <= 0)
+          return;
+        sent += result;
+      }
+    }
+  }
+}
+
+void ControlChannel::close()
+{
+  if (fd_ < 0)
+  {
+    return;
+  }
+  closing_ = true;
+  shutdown(fd_, SHUT_RDWR);
+  ::close(fd_);
+  fd_ = -1;
+  unlink(path_.c_str());
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_CONTROL_CHANNEL_H
+#define JCOZ_CONTROL_CHANNEL_H
+
+#include <functional>
+#include <string>
+
+#include "globals.h"
+
+// Unix domain socket that a live JVM's profiler is controlled through, e.g.
+//   echo stop | nc -U /tmp/jcoz.sock
+// Each line received is a command, answered with one line. Connections are
+// served one after another by the thread calling `serve`.
+class ControlChannel
+{
+public:
+  typedef std::function<std::string(const std::string &)> Handler;
+
+  ControlChannel() : fd_(-1), closing_(false) {}
+
+  ~ControlChannel() { close(); }
+
+  // Creates the socket, only accessible to the user running the JVM.
+  // Returns false if it cannot be created.
+  bool open(const std::string &path);
+
+  // Answers commands with `handler` until `close` is called
+  void serve(const Handler &handler);
+
+  // Unblocks `serve` and removes the socket
+  void close();
+
+private:
+  void serve_connection(int connection, const Handler &handler);
+
+  std::string path_;
+  int fd_;
+  volatile bool closing_;
+
+  DISALLOW_COPY_AND_ASSIGN(ControlChannel);
+};
+
+#endif // JCOZ_CONTROL_CHANNEL_H
@@ -0,0 +1,218 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "coordinator_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sstream>
+
+bool CoordinatorClient::configure(const std::string &address)
+{
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+  {
+    return false;
+  }
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+
+  // Resolved once, so retries on the agent thread never wait on DNS
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+  {
+    return false;
+  }
+  addresses_.clear();
+  for (struct addrinfo *resolved = addresses; resolved != NULL; resolved = resolved->ai_next)
+  {
+    Address entry;
+    entry.family = resolved->ai_family;
+    entry.socktype = resolved->ai_socktype;
+    entry.protocol = resolved->ai_protocol;
+    memcpy(&entry.addr, resolved->ai_addr, resolved->ai_addrlen);
+    entry.addr_len = resolved->ai_addrlen;
+    addresses_.push_back(entry);
+  }
+  freeaddrinfo(addresses);
+  return !addresses_.empty();
+}
+
+bool CoordinatorClient::connect()
+{
+  if (fd_ >= 0)
+  {
+    return true;
+  }
+  if (std::chrono::steady_clock::now() < retry_at_)
+  {
+    return false;
+  }
+  retry_at_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(COORDINATOR_RETRY_MS);
+
+  for (auto address = addresses_.begin(); address != addresses_.end() && fd_ < 0; address++)
+  {
+    int fd = socket(address->family, address->socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, address->protocol);
+    if (fd < 0)
+      continue;
+
+    // Connects without blocking, so an unreachable host costs at most the timeout
+    bool connected = ::connect(fd, (const struct sockaddr *)&address->addr, address->addr_len) == 0;
+    if (!connected && errno == EINPROGRESS)
+    {
+      struct pollfd poll_fd = {fd, POLLOUT, 0};
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      connected = poll(&poll_fd, 1, COORDINATOR_TIMEOUT_MS) == 1 &&
+                  getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0;
+    }
+    if (!connected)
+    {
+      ::close(fd);
+      continue;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    struct timeval timeout;
+    timeout.tv_sec = COORDINATOR_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (COORDINATOR_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    fd_ = fd;
+  }
+  buffer_.clear();
+  return fd_ >= 0;
+}
+
+bool CoordinatorClient::send(const std::string &request)
+{
+  size_t sent = 0;
+  while (sent < request.size())
+  {
+    // MSG_NOSIGNAL, a coordinator that went away must not kill the JVM with SIGPIPE
+    ssize_t result = ::send(fd_, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+    {
+      close();
+      return false;
+    }
+    sent += result;
+  }
+  return true;
+}
+
+bool CoordinatorClient::receive_line(std::string &line)
+{
+  size_t newline;
+  char chunk[512];
+  while ((newline = buffer_.find('\n')) == std::string::npos)
+  {
+    ssize_t received = read(fd_, chunk, sizeof(chunk));
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+    {
+      close();
+      return false;
+    }
+    buffer_.append(chunk, received);
+  }
+  line = buffer_.substr(0, newline);
+  buffer_.erase(0, newline + 1);
+  return true;
+}
+
+bool CoordinatorClient::claim(const std::vector<LineKey> &lines, std::vector<float> &speedups)
+{
+  if (!connect())
+  {
+    return false;
+  }
+
+  std::ostringstream request;
+  request << "claim";
+  for (auto line = lines.begin(); line != lines.end(); line++)
+  {
+    request << " " << line->class_name << " " << line->method << " " << line->lineno;
+  }
+  request << "\n";
+  std::string reply;
+  if (!send(request.str()) || !receive_line(reply))
+  {
+    return false;
+  }
+
+  std::istringstream fields(reply);
+  std::string word;
+  speedups.clear();
+  if (!(fields >> word) || word != "speedups")
+  {
+    close();
+    return false;
+  }
+  while (fields >> word)
+  {
+    char *end;
+    float speedup = word == "-" ? -1 : strtof(word.c_str(), &end);
+    if (word != "-" && (*end != '\0' || speedup < 0 || speedup > 1))
+    {
+      close();
+      return false;
+    }
+    speedups.push_back(speedup);
+  }
+  if (speedups.size() != lines.size())
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void CoordinatorClient::done(const LineKey &line, float speedup, long effective_duration, long points_hit)
+{
+  if (fd_ < 0)
+  {
+    // The claim went away with the connection
+    return;
+  }
+  std::ostringstream request;
+  request << "done " << line.class_name << " " << line.method << " " << line.lineno << " " << speedup << " "
+          << effective_duration << " " << points_hit << "\n";
+  send(request.str());
+}
+
+void CoordinatorClient::close()
+{
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JCOZ_COORDINATOR_CLIENT_H
+#define JCOZ_COORDINATOR_CLIENT_H
+
+#include <sys/socket.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "globals.h"
+
+// A source line, named as in a session file
+struct LineKey
+{
+  std::string class_name;
+  // Name and signature, e.g. run(I)V
+  std::string method;
+  int lineno;
+};
+
+// Connection of the agent thread to a coordinator (tools/coordinator.cc),
+// which hands out the lines and speedups of the experiments of many JVMs so
+// no two of them run the same line at the same time. Requests are single
+// lines of text over TCP:
+//
+//   claim <class> <method> <line> [<class> <method> <line>]...
+//     answered with "speedups <speedup or -> ...", - for a line that
+//     another JVM is running
+//   done <class> <method> <line> <speedup> <effective duration ns> <points hit>
+//     not answered, ends the claim on the line. A duration of 0 (the line
+//     was sped up together with others) adds no result
+//
+// Every request waits at most COORDINATOR_TIMEOUT_MS. A coordinator that
+// cannot be reached is tried again after COORDINATOR_RETRY_MS, until then
+// the agent selects experiments on its own.
+class CoordinatorClient
+{
+public:
+  CoordinatorClient() : fd_(-1) {}
+
+  ~CoordinatorClient() { close(); }
+
+  // `address` is host:port, returns false if it is not or if the host does
+  // not resolve. Resolves the host, the addresses are kept for every connect
+  bool configure(const std::string &address);
+
+  bool enabled() const { return !addresses_.empty(); }
+
+  // Sets the speedup of each line, negative for the lines to leave out.
+  // Returns false if the coordinator could not be asked.
+  bool claim(const std::vector<LineKey> &lines, std::vector<float> &speedups);
+
+  void done(const LineKey &line, float speedup, long effective_duration, long points_hit);
+
+  // Claims that are still open are dropped by the coordinator
+  void close();
+
+private:
+  bool connect();
+
+  bool send(const std::string &request);
+
+  bool receive_line(std::string &line);
+
+  struct Address
+  {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+  };
+
+  std::vector<Address> addresses_;
+  int fd_;
+  // Received but not yet returned by receive_line
+  std::string buffer_;
+  std::chrono::steady_clock::time_point retry_at_;
+
+  DISALLOW_COPY_AND_ASSIGN(CoordinatorClient);
+};
+
+#endif // JCOZ_COORDINATOR_CLIENT_H
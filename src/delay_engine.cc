@@ -0,0 +1,102 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "delay_engine.h"
+
+#include <errno.h>
+#include <algorithm>
+
+// Overshoot of this thread's previous delays not yet taken off a delay
+static thread_local long delay_credit = 0;
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+long DelayEngine::now()
+{
+  // CLOCK_MONOTONIC is read from the vDSO (the TSC on x86), no system call needed
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void DelayEngine::sleep_until(long deadline)
+{
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000000L;
+  ts.tv_nsec = deadline % 1000000000L;
+  // The deadline is absolute, so it stays the same if a signal interrupts the sleep
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+void DelayEngine::sleep(long nanoseconds)
+{
+  sleep_until(now() + nanoseconds);
+}
+
+void DelayEngine::calibrate()
+{
+  long overshoots[DELAY_CALIBRATION_ROUNDS];
+  for (int i = 0; i < DELAY_CALIBRATION_ROUNDS; i++)
+  {
+    long deadline = now() + DELAY_CALIBRATION_SLEEP_NS;
+    sleep_until(deadline);
+    overshoots[i] = std::max(0L, now() - deadline);
+  }
+
+  // Spin through the usual overshoot, rare outliers are left to the credit
+  std::sort(overshoots, overshoots + DELAY_CALIBRATION_ROUNDS);
+  slack_ = std::min(overshoots[DELAY_CALIBRATION_ROUNDS * 9 / 10], (long)MAX_DELAY_SPIN_NS);
+}
+
+long DelayEngine::delay(long nanoseconds)
+{
+  if (nanoseconds <= 0)
+  {
+    return 0;
+  }
+  if (delay_credit >= nanoseconds)
+  {
+    delay_credit -= nanoseconds;
+    return nanoseconds;
+  }
+
+  long target = nanoseconds - delay_credit;
+  long start = now();
+  long deadline = start + target;
+  if (target > slack_)
+  {
+    sleep_until(deadline - slack_);
+  }
+  while (now() < deadline)
+  {
+    cpu_relax();
+  }
+
+  // Overshoot beyond what the credit can hold (e.g. the thread was
+  // preempted) is accounted as delay right away
+  long overshoot = now() - deadline;
+  delay_credit = std::min(overshoot, (long)MAX_DELAY_CREDIT_NS);
+  return nanoseconds + (overshoot - delay_credit);
+}
@@ -0,0 +1,89 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_DELAY_ENGINE_H
+#define JCOZ_DELAY_ENGINE_H
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "globals.h"
+
+// Inserts the delays of virtual speedups. Sleeps until an absolute
+// CLOCK_MONOTONIC deadline minus the timer slack measured by `calibrate()`,
+// then spins for the rest, so short delays are not overshot by the kernel's
+// timer slack. Any overshoot that is left is kept (per thread) as credit and
+// taken off the next delay, so the accumulated delay of a thread follows the
+// delays it was asked for. Everything used by `delay()` is async-signal-safe.
+class DelayEngine
+{
+public:
+  DelayEngine() : slack_(MAX_DELAY_SPIN_NS) {}
+
+  // Measures how much sleeps overshoot their deadline on this machine
+  void calibrate();
+
+  // Delays the calling thread by `nanoseconds` and returns the delay to
+  // account for it, which is `nanoseconds` unless the thread was preempted
+  // for longer than the credit it has left
+  long delay(long nanoseconds);
+
+  // Sleeps for `nanoseconds` without spinning or credit, for the agent
+  // thread's sampling ticks, which are not delays and need no precision
+  static void sleep(long nanoseconds);
+
+  long slack() const { return slack_; }
+
+  // A thread the agent thread has suspended, see `pay_suspended()`
+  struct Debt
+  {
+    long owed;
+    // Of the thread in the caller's list
+    size_t index;
+  };
+
+  // Keeps suspended threads stopped for the delays they owe, for threads
+  // that never pay them themselves. They are resumed in the order of their
+  // debts, so paying all of them takes as long as the largest one, not the
+  // sum. `resume(debt, paid)` must resume the thread, `paid` is the time since
+  // this call (threads overshooting their debt are credited the overshoot)
+  template <class Resume>
+  static void pay_suspended(std::vector<Debt> &debts, Resume resume)
+  {
+    std::sort(debts.begin(), debts.end(), [](const Debt &a, const Debt &b)
+              { return a.owed < b.owed; });
+    long start = now();
+    for (const Debt &debt : debts)
+    {
+      sleep_until(start + debt.owed);
+      resume(debt, now() - start);
+    }
+  }
+
+private:
+  static long now();
+
+  static void sleep_until(long deadline);
+
+  // Time (ns) before a deadline at which sleeping stops and spinning starts
+  long slack_;
+
+  DISALLOW_COPY_AND_ASSIGN(DelayEngine);
+};
+
+#endif // JCOZ_DELAY_ENGINE_H
@@ -25,10 +25,15 @@
 #include <unistd.h>
 
 #include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 
 #include "globals.h"
 #include "profiler.h"
 #include "stacktraces.h"
+#include "control_channel.h"
+#include "agent_stats.h"
 
 static Profiler *prof;
 FILE *Globals::OutFile;
@@ -41,6 +46,23 @@ static volatile int class_prep_lock = 0;
 static bool acquireCreateLock();
 static void releaseCreateLock();
 
+// With fast-startup, classes are primed by a background thread. The queue
+// holds global references, deleted once the class has been primed
+static std::mutex priming_lock;
+static std::condition_variable priming_cond;
+static std::vector<jclass> priming_queue;
+static bool priming_stopped = false;
+static void queueForPriming(JNIEnv *jni_env, jclass klass);
+static void stopPriming();
+static bool priming_thread_started = false;
+// Started with the first run of the profiler, and kept across runs
+static bool resolver_thread_started = false;
+
+static ControlChannel control_channel;
+// Capabilities the agent was given, after an attach some are not available
+static jvmtiCapabilities granted_caps;
+static void startControlChannel(JNIEnv *jni_env);
+
 jvmtiError run_profiler(JNIEnv *jni);
 
 void JNICALL OnThreadStart(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
@@ -66,6 +88,52 @@ void JNICALL OnThreadEnd(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread)
   prof->removeUserThread(thread);
 }
 
+// Threads pay the delays they owe before they block on a monitor (or release
+// it in Object.wait), where they hold no JVM internal locks, like coz pays
+// delays before a thread can unblock others
+void JNICALL OnMonitorContendedEnter(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread, jobject object)
+{
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+
+  prof->preBlock();
+}
+
+// The monitor was released by the thread that owned it
+void JNICALL OnMonitorContendedEntered(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread, jobject object)
+{
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+
+  prof->postBlock(true);
+}
+
+void JNICALL OnMonitorWait(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread, jobject object, jlong timeout)
+{
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+  IMPLICITLY_USE(timeout);
+
+  prof->preBlock();
+}
+
+// Only a wait that did not time out was ended by another thread's notify
+void JNICALL OnMonitorWaited(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread, jobject object, jboolean timed_out)
+{
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+
+  prof->postBlock(!timed_out);
+}
+
 // This has to be here, or the VM turns off class loading events.
 // And AsyncGetCallTrace needs class loading events to be turned on!
 void JNICALL OnClassLoad(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread,
@@ -78,6 +146,37 @@ void JNICALL OnClassLoad(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread,
   IMPLICITLY_USE(klass);
 }
 
+// Enabled once profiling starts (see updateEventsEnabledState), so the classes
+// loaded before do not go through it. After that it is fired for every class
+// load, but only redefinitions (and retransformations) matter here: they can
+// change the line number tables of the class's methods.
+void JNICALL OnClassFileLoadHook(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jclass class_being_redefined,
+                                 jobject loader, const char *name, jobject protection_domain,
+                                 jint class_data_len, const unsigned char *class_data,
+                                 jint *new_class_data_len, unsigned char **new_class_data)
+{
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(loader);
+  IMPLICITLY_USE(name);
+  IMPLICITLY_USE(protection_domain);
+  IMPLICITLY_USE(class_data_len);
+  IMPLICITLY_USE(class_data);
+  IMPLICITLY_USE(new_class_data_len);
+  IMPLICITLY_USE(new_class_data);
+  if (class_being_redefined == NULL)
+  {
+    return;
+  }
+
+  jint method_count;
+  JvmtiScopedPtr<jmethodID> methods(jvmti_env);
+  if (jvmti_env->GetClassMethods(class_being_redefined, &method_count, methods.GetRef()) == JVMTI_ERROR_NONE)
+  {
+    // The new class is not applied yet, the cache waits for the tables to change
+    Profiler::getLineTables().invalidate_redefined(jvmti_env, method_count, methods.Get());
+  }
+}
+
 // Create a java thread -- currently used
 // to run profiler thread
 jthread create_thread(JNIEnv *jni_env)
@@ -112,10 +211,14 @@ jthread create_thread(JNIEnv *jni_env)
 static bool updateEventsEnabledState(jvmtiEnv *jvmti, jvmtiEventMode enabledState)
 {
   auto logger = prof->getLogger();
-  logger->debug("Setting CLASS_PREPARE to enabled");
+  logger->debug("Setting the CLASS_PREPARE and CLASS_FILE_LOAD_HOOK notification mode");
   JVMTI_ERROR_1(
       (jvmti->SetEventNotificationMode(enabledState, JVMTI_EVENT_CLASS_PREPARE, NULL)),
       false);
+  // Only needed for the line number tables cached while profiling
+  JVMTI_ERROR_1(
+      (jvmti->SetEventNotificationMode(enabledState, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL)),
+      false);
 
   return true;
 }
@@ -125,8 +228,7 @@ static bool acquireCreateLock()
   bool has_lock = class_prep_lock == pthread_self();
   if (!has_lock)
   {
-    while (!__sync_bool_compare_and_swap(&class_prep_lock, 0, pthread_self()))
-      ;
+    agent_stats::spin_lock(&class_prep_lock, pthread_self(), agent_stats::_class_prep_lock);
 
     std::atomic_thread_fence(std::memory_order_acquire);
   }
@@ -140,31 +242,6 @@ static void releaseCreateLock()
   std::atomic_thread_fence(std::memory_order_release);
 }
 
-bool is_class_fqn_prefix(const char *prefix, char *class_sig)
-{
-  // Assumed that class signature has format `L<name>;`,
-  // and that prefix does not have additional symbols.
-  // So to check that <name> itself has given prefix,
-  // we must skip the first symbol of the signature.
-  return strstr(class_sig, prefix) == class_sig + 1;
-}
-
-bool contains_class_fqn_prefix(std::vector<std::string> &elements, char *class_sig)
-{
-  // This predicate is a lambda function passed to std::find_if
-  auto predicate = [&class_sig](std::string &scope)
-  { 
-    return is_class_fqn_prefix(scope.c_str(), class_sig); 
-  };
-  return std::find_if(std::begin(elements), std::end(elements), predicate) != std::end(elements);
-}
-
-// TODO faster search (trie maybe)
-bool is_in_allowed_scope(char *class_sig)
-{
-  return !contains_class_fqn_prefix(Profiler::get_ignored_scopes(), class_sig) && contains_class_fqn_prefix(Profiler::get_search_scopes(), class_sig);
-}
-
 // Calls GetClassMethods on a given class to force the creation of
 // jmethodIDs of it.
 void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass)
@@ -175,6 +252,20 @@ void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass)
   }
   auto logger = prof->getLogger();
   logger->trace("In CreateJMethodIDsForClass start");
+  JvmtiScopedPtr<char> ksig(jvmti);
+  jvmtiError sig_error = jvmti->GetClassSignature(klass, ksig.GetRef(), NULL);
+  if (sig_error != JVMTI_ERROR_NONE)
+  {
+    logger->error("Failed to get the signature of a class with error {}", sig_error);
+    return;
+  }
+  // AsyncGetCallTrace reports frames of methods without a jmethodID as NULL,
+  // which is fine for classes that are never sped up or used as progress points
+  if (Profiler::isFastStartup() && !Profiler::needsMethodIDs(ksig.Get()))
+  {
+    return;
+  }
+
   bool releaseLock = acquireCreateLock();
   jint method_count;
   JvmtiScopedPtr<jmethodID> methods(jvmti);
@@ -182,43 +273,27 @@ void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass)
   logger->trace("Got class methods from the JVM");
   if (e != JVMTI_ERROR_NONE)
   {
-    JvmtiScopedPtr<char> ksig(jvmti);
-    JVMTI_ERROR((jvmti->GetClassSignature(klass, ksig.GetRef(), NULL)));
     logger->error("Failed to create method IDs for methods in class {} with error {}", ksig.Get(), e);
   }
   else
   {
-    JvmtiScopedPtr<char> ksig(jvmti);
-    jvmti->GetClassSignature(klass, ksig.GetRef(), NULL);
-
     logger->debug(
         "Creating JMethod IDs. [Class: {class}]",
         fmt::arg("class", ksig.Get()));
-    if (is_in_allowed_scope(ksig.Get()))
+    if (Profiler::isInScope(ksig.Get()))
     {
       Profiler::addInScopeMethods(method_count, methods.Get());
+      Profiler::addClassNames(ksig.Get(), method_count, methods.Get());
     }
 
-    // Initial check for progress point class
-    // This check matches a prefix. class name AA will match a progress point set with class A 
-    // (i.e. model/DummyClass and newmodel/DummyClass would both match)
-    const char *progress_class_c_str = prof->getProgressClass().c_str(); 
-    std::string klass_sig = std::string(ksig.Get());
-    if (strstr(klass_sig.c_str(), progress_class_c_str) == klass_sig.c_str())
+    // Sets the breakpoints of any progress points declared in this class
+    if (granted_caps.can_generate_breakpoint_events)
     {
-      logger->info("Setting progress point - initial check for correct class has passed");
-      // The progress_class_c_str is in the format "LMain"
-      // Whereas the klass_sig is in the format "LMain;"
-      // Therefore need to strip the ";" before the second check
-      // Since the initial check will occur hundreds/thousands of times - but the second check should only occur once or twice
-      // Having the second check with the extra step of ";" replacement is slightly more performant than doing the replace earlier
-      // and having a single check
-      klass_sig.replace(klass_sig.length() - 1, 1, "\0");
-      // Second check for progress point class
-      if (klass_sig.compare(progress_class_c_str) == 0) {
-        logger->info("Setting progress point - second check for correct class has passed");
-        prof->addProgressPoint(method_count, methods.Get());
-      } 
+      prof->addProgressPoints(ksig.Get(), method_count, methods.Get());
+      if (granted_caps.can_generate_frame_pop_events)
+      {
+        prof->addBlockingMethods(ksig.Get(), method_count, methods.Get());
+      }
     }
   }
   if (releaseLock)
@@ -233,7 +308,11 @@ void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread)
   IMPLICITLY_USE(thread);
   IMPLICITLY_USE(jni_env);
 
-  run_profiler(jni_env);
+  startControlChannel(jni_env);
+  if (!Profiler::isPaused())
+  {
+    run_profiler(jni_env);
+  }
 }
 
 void JNICALL OnClassPrepare(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
@@ -245,7 +324,109 @@ void JNICALL OnClassPrepare(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
   // that all of the methodIDs have been initialized internally, for
   // AsyncGetCallTrace.  I imagine it slows down class loading a mite,
   // but honestly, how fast does class loading have to be?
-  CreateJMethodIDsForClass(jvmti_env, klass);
+  // (Fast enough with bursts of thousands of classes: fast-startup moves it off the loading thread)
+  if (Profiler::isFastStartup())
+  {
+    queueForPriming(jni_env, klass);
+  }
+  else
+  {
+    CreateJMethodIDsForClass(jvmti_env, klass);
+  }
+}
+
+static void queueForPriming(JNIEnv *jni_env, jclass klass)
+{
+  jclass klass_ref = (jclass)jni_env->NewGlobalRef(klass);
+  std::lock_guard<std::mutex> guard(priming_lock);
+  priming_queue.push_back(klass_ref);
+  priming_cond.notify_one();
+}
+
+static void stopPriming()
+{
+  std::lock_guard<std::mutex> guard(priming_lock);
+  priming_stopped = true;
+  priming_cond.notify_one();
+}
+
+// Creates the jmethodIDs of queued classes in batches, off the threads that load them
+static void JNICALL runPrimingThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args)
+{
+  IMPLICITLY_USE(args);
+  // Like the agent thread, the priming thread must not be profiled
+  prof->removeUserThread(NULL);
+
+  std::vector<jclass> batch;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> guard(priming_lock);
+      priming_cond.wait(guard, []
+                        { return priming_stopped || !priming_queue.empty(); });
+      if (priming_stopped)
+      {
+        return;
+      }
+      batch.swap(priming_queue);
+    }
+
+    for (auto klass = batch.begin(); klass != batch.end(); klass++)
+    {
+      CreateJMethodIDsForClass(jvmti_env, *klass);
+      jni_env->DeleteGlobalRef(*klass);
+    }
+    prof->getLogger()->debug("Primed {} classes", batch.size());
+    batch.clear();
+  }
+}
+
+// HotSpot's ClassUnload extension event. Its parameters changed between JDK
+// versions (a jclass, later the class name) and it may be posted during a GC,
+// so only the fact that classes went away is recorded for the agent thread
+static void JNICALL OnClassUnload(jvmtiEnv *jvmti_env, ...)
+{
+  IMPLICITLY_USE(jvmti_env);
+  Profiler::noteClassUnload();
+}
+
+// Registers OnClassUnload if the JVM has the extension event, setting its
+// callback also enables it. Without it, unloaded methods are only swept
+// once the tables go over the memory-budget
+static void registerClassUnload(jvmtiEnv *jvmti)
+{
+  auto logger = prof->getLogger();
+  jint num_extensions;
+  jvmtiExtensionEventInfo *extensions;
+  if (jvmti->GetExtensionEvents(&num_extensions, &extensions) != JVMTI_ERROR_NONE)
+  {
+    logger->info("The JVM has no extension events, unloaded classes are only swept over the memory-budget");
+    return;
+  }
+
+  bool registered = false;
+  for (jint i = 0; i < num_extensions; i++)
+  {
+    if (!registered && strcmp(extensions[i].id, "com.sun.hotspot.events.ClassUnload") == 0)
+    {
+      jvmtiError error = jvmti->SetExtensionEventCallback(extensions[i].extension_event_index,
+                                                          (jvmtiExtensionEvent)&OnClassUnload);
+      registered = error == JVMTI_ERROR_NONE;
+      if (!registered)
+      {
+        logger->warn("Unable to register the ClassUnload event with error {}", error);
+      }
+    }
+    for (jint j = 0; j < extensions[i].param_count; j++)
+    {
+      jvmti->Deallocate((unsigned char *)extensions[i].params[j].name);
+    }
+    jvmti->Deallocate((unsigned char *)extensions[i].params);
+    jvmti->Deallocate((unsigned char *)extensions[i].short_description);
+    jvmti->Deallocate((unsigned char *)extensions[i].id);
+  }
+  jvmti->Deallocate((unsigned char *)extensions);
+  logger->debug("ClassUnload event {}", registered ? "registered" : "not available");
 }
 
 void JNICALL OnVMDeath(jvmtiEnv *jvmti_env, JNIEnv *jni_env)
@@ -254,55 +435,98 @@ void JNICALL OnVMDeath(jvmtiEnv *jvmti_env, JNIEnv *jni_env)
   IMPLICITLY_USE(jni_env);
 
   prof->getLogger()->info("On VM death. Stopping profiler...");
+  control_channel.close();
+  stopPriming();
   prof->Stop();
   updateEventsEnabledState(prof->getJVMTI(), JVMTI_DISABLE);
-  Profiler::clearProgressPoint();
+  Profiler::clearProgressPoints();
+  Profiler::clearClassNames();
 }
 
-static bool PrepareJvmti(jvmtiEnv *jvmti)
+// Chooses the capabilities to add into granted_caps. When loaded at startup
+// the agent needs all of them. After an attach the JVM may only offer some in
+// the live phase, the features that need the others are turned off.
+static bool ChooseCapabilities(jvmtiEnv *jvmti, bool attach)
 {
+  auto logger = prof->getLogger();
   // Set the list of permissions to do the various internal VM things
   // we want to do.
   jvmtiCapabilities caps;
 
   memset(&caps, 0, sizeof(caps));
-  caps.can_generate_all_class_hook_events = 1;
-
   caps.can_get_source_file_name = 1;
   caps.can_get_line_numbers = 1;
   caps.can_get_bytecodes = 1;
   caps.can_get_constant_pool = 1;
-  caps.can_generate_breakpoint_events = 1;
+
+  jvmtiCapabilities optional_caps;
+  memset(&optional_caps, 0, sizeof(optional_caps));
+  // Only makes a difference before the live phase
+  optional_caps.can_generate_all_class_hook_events = !attach;
+  optional_caps.can_generate_breakpoint_events = 1;
+  optional_caps.can_generate_monitor_events = 1;
+  optional_caps.can_generate_frame_pop_events = 1;
+  optional_caps.can_suspend = 1;
 
   jvmtiCapabilities all_caps;
   memset(&all_caps, 0, sizeof(all_caps));
   int error;
+  if ((error = jvmti->GetPotentialCapabilities(&all_caps)) != JVMTI_ERROR_NONE)
+  {
+    logger->critical("Could not get the potential JVMTI capabilities (error {})", error);
+    return false;
+  }
 
-  if (JVMTI_ERROR_NONE ==
-      (error = jvmti->GetPotentialCapabilities(&all_caps)))
-  {
-    // This makes sure that if we need a capability, it is one of the
-    // potential capabilities.  The technique isn't wonderful, but it
-    // This makes sure that if we need a capability, it is one of the
-    // potential capabilities.  The technique isn't wonderful, but it
-    // is compact and as likely to be compatible between versions as
-    // anything else.
-    char *has = reinterpret_cast<char *>(&all_caps);
-    const char *should_have = reinterpret_cast<const char *>(&caps);
-    for (int i = 0; i < sizeof(all_caps); i++)
+  // This makes sure that if we need a capability, it is one of the
+  // potential capabilities.  The technique isn't wonderful, but it
+  // is compact and as likely to be compatible between versions as
+  // anything else.
+  char *has = reinterpret_cast<char *>(&all_caps);
+  char *should_have = reinterpret_cast<char *>(&caps);
+  char *may_have = reinterpret_cast<char *>(&optional_caps);
+  for (int i = 0; i < sizeof(all_caps); i++)
+  {
+    if ((should_have[i] & has[i]) != should_have[i])
     {
-      if ((should_have[i] != 0) && (has[i] == 0))
-      {
-        return false;
-      }
+      logger->critical("The JVM does not offer the JVMTI capabilities to read line numbers and bytecodes");
+      return false;
     }
-
-    // This adds the capabilities.
-    if ((error = jvmti->AddCapabilities(&caps)) != JVMTI_ERROR_NONE)
+    // Outside of an attach the optional capabilities are needed as well
+    if (!attach && (may_have[i] & has[i]) != may_have[i])
     {
-      fprintf(stderr, "Failed to add capabilities with error %d\n", error);
+      logger->critical("The JVM does not offer the JVMTI capabilities for breakpoints, monitor and frame pop events");
       return false;
     }
+    should_have[i] |= may_have[i] & has[i];
+  }
+  granted_caps = caps;
+
+  if (!granted_caps.can_generate_breakpoint_events)
+  {
+    logger->warn("No breakpoints after attaching: progress points must use the jcoz.Progress API and LockSupport parks are not tracked");
+  }
+  if (!granted_caps.can_generate_monitor_events)
+  {
+    logger->warn("No monitor events after attaching: threads blocked on monitors are not credited");
+  }
+  if (!granted_caps.can_generate_frame_pop_events)
+  {
+    logger->warn("No frame pop events after attaching: LockSupport parks are not tracked");
+  }
+  if (!granted_caps.can_generate_frame_pop_events || !granted_caps.can_suspend)
+  {
+    logger->warn("No frame pop events or thread suspension after attaching: threads started before the attach are not profiled");
+  }
+  return true;
+}
+
+static bool PrepareJvmti(jvmtiEnv *jvmti)
+{
+  int error;
+  if ((error = jvmti->AddCapabilities(&granted_caps)) != JVMTI_ERROR_NONE)
+  {
+    prof->getLogger()->critical("Failed to add capabilities with error {}", error);
+    return false;
   }
   return true;
 }
@@ -322,36 +546,56 @@ static bool RegisterJvmti(jvmtiEnv *jvmti)
 
   callbacks->ClassLoad = &OnClassLoad;
   callbacks->ClassPrepare = &OnClassPrepare;
+  callbacks->ClassFileLoadHook = &OnClassFileLoadHook;
   callbacks->Breakpoint = &(Profiler::HandleBreakpoint);
+  callbacks->FramePop = &(Profiler::HandleFramePop);
+  callbacks->MonitorContendedEnter = &OnMonitorContendedEnter;
+  callbacks->MonitorContendedEntered = &OnMonitorContendedEntered;
+  callbacks->MonitorWait = &OnMonitorWait;
+  callbacks->MonitorWaited = &OnMonitorWaited;
 
   JVMTI_ERROR_1(
       (jvmti->SetEventCallbacks(callbacks, sizeof(jvmtiEventCallbacks))),
       false);
 
-  jvmtiEvent events[] = {JVMTI_EVENT_CLASS_LOAD, JVMTI_EVENT_BREAKPOINT,
-                         JVMTI_EVENT_THREAD_END, JVMTI_EVENT_THREAD_START,
-                         JVMTI_EVENT_VM_DEATH, JVMTI_EVENT_VM_INIT};
-
-  size_t num_events = sizeof(events) / sizeof(jvmtiEvent);
+  std::vector<jvmtiEvent> events = {JVMTI_EVENT_CLASS_LOAD, JVMTI_EVENT_THREAD_END, JVMTI_EVENT_THREAD_START,
+                                     JVMTI_EVENT_VM_DEATH, JVMTI_EVENT_VM_INIT};
+  // Only the events of the capabilities that were granted
+  if (granted_caps.can_generate_breakpoint_events)
+  {
+    events.push_back(JVMTI_EVENT_BREAKPOINT);
+  }
+  if (granted_caps.can_generate_monitor_events)
+  {
+    events.insert(events.end(), {JVMTI_EVENT_MONITOR_CONTENDED_ENTER, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED,
+                                 JVMTI_EVENT_MONITOR_WAIT, JVMTI_EVENT_MONITOR_WAITED});
+  }
+  if (granted_caps.can_generate_frame_pop_events)
+  {
+    events.push_back(JVMTI_EVENT_FRAME_POP);
+  }
 
   // Enable the callbacks to be triggered when the events occur.
   // Events are enumerated in jvmstatagent.h
   logger->debug("Setting event notification mode to JVMTI_ENABLE in Register Jvmti");
-  for (int i = 0; i < num_events; i++)
+  for (size_t i = 0; i < events.size(); i++)
   {
-    JVMTI_ERROR_1(
-        (jvmti->SetEventNotificationMode(JVMTI_ENABLE, events[i], NULL)),
-        false);
+    jvmtiError error = jvmti->SetEventNotificationMode(JVMTI_ENABLE, events[i], NULL);
+    if (error != JVMTI_ERROR_NONE)
+    {
+      logger->critical("Could not enable JVMTI event {} (error {})", (int)events[i], error);
+      return false;
+    }
   }
+  registerClassUnload(jvmti);
   logger->info("JVMTI successfully registered and event notifications successfully enabled");
 
   return true;
 }
 
-AGENTEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options,
-                                      void *reserved)
+// Sets up the agent, shared by Agent_OnLoad and Agent_OnAttach
+static jint InitAgent(JavaVM *vm, char *options, bool attach, jvmtiEnv **jvmti_out)
 {
-  IMPLICITLY_USE(reserved);
   int err;
   jvmtiEnv *jvmti;
 
@@ -359,33 +603,242 @@ AGENTEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options,
 
   if ((err = (vm->GetEnv(reinterpret_cast<void **>(&jvmti), JVMTI_VERSION))) != JNI_OK)
   {
-    return 1;
+    fprintf(stderr, "Could not get a JVMTI environment (error %d)\n", err);
+    return JNI_ERR;
   }
 
+  // Options are parsed before any callback is registered, so an attach with
+  // invalid options leaves the running JVM untouched. The capabilities are
+  // chosen first, the options that need missing ones are rejected
+  prof = new Profiler(jvmti);
+  if (!ChooseCapabilities(jvmti, attach))
+  {
+    return JNI_ERR;
+  }
+  Profiler::setBreakpointsAvailable(granted_caps.can_generate_breakpoint_events);
+  Profiler::setSuspendAvailable(granted_caps.can_suspend);
+  if (attach)
+  {
+    if (!prof->ParseAttachOptions(options))
+    {
+      return JNI_ERR;
+    }
+  }
+  else
+  {
+    prof->ParseOptions(options);
+  }
+  prof->setJVMTI(jvmti);
+
   if (!PrepareJvmti(jvmti))
   {
-    fprintf(stderr, "Failed to initialize JVMTI.  Continuing...\n");
-    return 0;
+    prof->getLogger()->critical("Failed to initialize JVMTI, the agent is not loaded");
+    return JNI_ERR;
   }
 
   if (!RegisterJvmti(jvmti))
   {
-    fprintf(stderr, "Failed to enable JVMTI events.  Continuing...\n");
+    prof->getLogger()->critical("Failed to enable JVMTI events, the agent is not loaded");
     // We fail hard here because we may have failed in the middle of
     // registering callbacks, which will leave the system in an
     // inconsistent state.
-    return 1;
+    return JNI_ERR;
   }
 
   Asgct::SetAsgct(Accessors::GetJvmFunction<ASGCTType>("AsyncGetCallTrace"));
 
-  prof = new Profiler(jvmti);
-  prof->ParseOptions(options);
-  prof->setJVMTI(jvmti);
-  prof->getLogger()->info("Successfully loaded agent.");
+  *jvmti_out = jvmti;
+  return 0;
+}
+
+AGENTEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options,
+                                      void *reserved)
+{
+  IMPLICITLY_USE(reserved);
+  jvmtiEnv *jvmti = NULL;
+  jint err = InitAgent(vm, options, false, &jvmti);
+  if (err == 0 && jvmti != NULL)
+  {
+    prof->getLogger()->info("Successfully loaded agent.");
+  }
+  return err;
+}
+
+// Threads that are already running never get a ThreadStart event. Ask for a
+// FramePop event on one of their frames, which registers them (see
+// Profiler::HandleFramePop) once it returns.
+static void registerRunningThreads(jvmtiEnv *jvmti, JNIEnv *jni_env)
+{
+  jint thread_count;
+  JvmtiScopedPtr<jthread> threads(jvmti);
+  if (jvmti->GetAllThreads(&thread_count, threads.GetRef()) != JVMTI_ERROR_NONE)
+  {
+    return;
+  }
+
+  jthread current;
+  jvmti->GetCurrentThread(&current);
+  for (jint i = 0; i < thread_count; i++)
+  {
+    jthread thread = threads.Get()[i];
+    if (jni_env->IsSameObject(thread, current) || jvmti->SuspendThread(thread) != JVMTI_ERROR_NONE)
+    {
+      continue;
+    }
+    // The top frames may be native (e.g. Unsafe.park), which cannot be popped
+    for (jint depth = 0; depth < 4; depth++)
+    {
+      if (jvmti->NotifyFramePop(thread, depth) == JVMTI_ERROR_NONE)
+      {
+        break;
+      }
+    }
+    jvmti->ResumeThread(thread);
+  }
+}
+
+// Loads the agent into a running JVM, e.g. with jcmd <pid> JVMTI.agent_load
+// <absolute_path_to_agent> <options>. As the VM is already initialised,
+// profiling starts right away (unless paused).
+AGENTEXPORT jint JNICALL Agent_OnAttach(JavaVM *vm, char *options,
+                                        void *reserved)
+{
+  IMPLICITLY_USE(reserved);
+  jvmtiEnv *jvmti = NULL;
+  jint err = InitAgent(vm, options, true, &jvmti);
+  if (err != 0 || jvmti == NULL)
+  {
+    return err;
+  }
+
+  JNIEnv *jni_env;
+  if (vm->GetEnv(reinterpret_cast<void **>(&jni_env), JNI_VERSION_1_6) != JNI_OK)
+  {
+    prof->getLogger()->critical("Could not get a JNI environment, the agent is not attached");
+    return JNI_ERR;
+  }
+  Accessors::SetCurrentJniEnv(jni_env);
+
+  Profiler::setAttached();
+  if (granted_caps.can_generate_frame_pop_events && granted_caps.can_suspend)
+  {
+    registerRunningThreads(jvmti, jni_env);
+  }
+  startControlChannel(jni_env);
+  if (!Profiler::isPaused())
+  {
+    run_profiler(jni_env);
+  }
+  prof->getLogger()->info("Successfully attached agent.");
   return 0;
 }
 
+static std::string handleControlCommand(JNIEnv *jni_env, const std::string &line)
+{
+  size_t space_index = line.find(' ');
+  std::string command = line.substr(0, space_index);
+  std::string argument = space_index == std::string::npos ? "" : line.substr(space_index + 1);
+  prof->getLogger()->info("Control command: {}", line);
+
+  if (command == "status")
+  {
+    return prof->isRunning() ? "running" : "stopped";
+  }
+  if (command == "start")
+  {
+    if (prof->isRunning())
+    {
+      return "error: already running";
+    }
+    jvmtiError err = run_profiler(jni_env);
+    return err == JVMTI_ERROR_NONE ? "ok" : fmt::format("error: could not start the agent thread ({})", err);
+  }
+  if (command == "stop")
+  {
+    if (!prof->isRunning())
+    {
+      return "error: not running";
+    }
+    prof->Stop();
+    // A stopped agent costs nothing: run_profiler enables the events again
+    // and sets the breakpoints of the loaded classes on start
+    updateEventsEnabledState(prof->getJVMTI(), JVMTI_DISABLE);
+    return "ok";
+  }
+  if (command == "flush")
+  {
+    Profiler::flushResults();
+    return "ok";
+  }
+  if (command == "set")
+  {
+    std::string error = Profiler::updateOptions(argument);
+    return error.empty() ? "ok" : "error: " + error;
+  }
+  return "error: unknown command " + command + " (status, start, stop, flush, set <options>)";
+}
+
+static void JNICALL runControlThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args)
+{
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(args);
+  // The control thread must not be profiled either
+  prof->removeUserThread(NULL);
+  control_channel.serve([jni_env](const std::string &line)
+                        { return handleControlCommand(jni_env, line); });
+}
+
+static void startControlChannel(JNIEnv *jni_env)
+{
+  const std::string &path = Profiler::getControlPath();
+  if (path.empty())
+  {
+    return;
+  }
+  if (!control_channel.open(path))
+  {
+    prof->getLogger()->error("Could not create the control socket {}", path);
+    return;
+  }
+
+  jthread control_thread = create_thread(jni_env);
+  jvmtiError err = prof->getJVMTI()->RunAgentThread(control_thread, &runControlThread, nullptr, 1);
+  if (err != JVMTI_ERROR_NONE)
+  {
+    prof->getLogger()->error("Could not start the control thread, error {}", err);
+    control_channel.close();
+    return;
+  }
+  prof->getLogger()->info("Listening for control commands on {}", path);
+}
+
+// Natives of the jcoz.Progress Java API (see jcoz-api/src/jcoz/Progress.java).
+// The JVM also searches agent libraries when linking native methods.
+extern "C" AGENTEXPORT jint JNICALL Java_jcoz_Progress_registerNative(JNIEnv *jni_env, jclass klass, jstring name)
+{
+  IMPLICITLY_USE(klass);
+  if (name == NULL)
+  {
+    return -1;
+  }
+
+  const char *name_chars = jni_env->GetStringUTFChars(name, NULL);
+  if (name_chars == NULL)
+  {
+    return -1;
+  }
+  jint point = Profiler::findProgressPoint(name_chars);
+  jni_env->ReleaseStringUTFChars(name, name_chars);
+  return point;
+}
+
+extern "C" AGENTEXPORT void JNICALL Java_jcoz_Progress_hitNative(JNIEnv *jni_env, jclass klass, jint point)
+{
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(klass);
+  Profiler::hitProgressPoint(point);
+}
+
 AGENTEXPORT void JNICALL Agent_OnUnload(JavaVM *vm)
 {
   IMPLICITLY_USE(vm);
@@ -403,13 +856,42 @@ jvmtiError run_profiler(JNIEnv *jni)
   updateEventsEnabledState(jvmti, JVMTI_ENABLE);
   jvmti->GetLoadedClasses(&loaded_classes_count, loaded_classes_ptr.GetRef());
   jclass *loaded_classes = loaded_classes_ptr.Get();
+  prof->getLogger()->debug("Within entry.cc::run_profiler - Loading {} classes", loaded_classes_count);
   for (int i = 0; i < loaded_classes_count; ++i)
   {
     jclass next_loaded_class = loaded_classes[i];
-    JvmtiScopedPtr<char> ksig(jvmti);
-    jvmti->GetClassSignature(next_loaded_class, ksig.GetRef(), nullptr);
-    prof->getLogger()->debug("Within entry.cc::run_profiler - Loading class {}", ksig.Get());
-    CreateJMethodIDsForClass(jvmti, next_loaded_class);
+    if (Profiler::isFastStartup())
+    {
+      queueForPriming(jni, next_loaded_class);
+    }
+    else
+    {
+      CreateJMethodIDsForClass(jvmti, next_loaded_class);
+    }
+  }
+
+  if (Profiler::isFastStartup() && !priming_thread_started)
+  {
+    priming_thread_started = true;
+    jthread priming_thread = create_thread(jni);
+    jvmtiError priming_error = jvmti->RunAgentThread(priming_thread, &runPrimingThread, nullptr, 1);
+    if (priming_error != JVMTI_ERROR_NONE)
+    {
+      prof->getLogger()->critical("Could not start the class priming thread, error {}. Exiting program.", priming_error);
+      exit(1);
+    }
+  }
+
+  if (!resolver_thread_started)
+  {
+    resolver_thread_started = true;
+    jthread resolver_thread = create_thread(jni);
+    jvmtiError resolver_error = jvmti->RunAgentThread(resolver_thread, &Profiler::runResolverThread, nullptr, 1);
+    if (resolver_error != JVMTI_ERROR_NONE)
+    {
+      prof->getLogger()->critical("Could not start the result resolver thread, error {}. Exiting program.", resolver_error);
+      exit(1);
+    }
   }
 
   jthread agent_thread = create_thread(jni);
@@ -24,6 +24,7 @@
 #include <jvmti.h>
 #include <jni.h>
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #ifdef __APPLE__
 #include <pthread.h>
@@ -40,10 +41,33 @@
 // If full path is not specified (e.g. "log.txt"), log file will be created in current directory
 // If full path is specified (e.g. "/home/ubuntu/log.txt"), file will be created in path specified
 #define PROFILER_LOG_FILE "profiler_log.txt"
+// The log file is rotated once it reaches this size (bytes), keeping
+// PROFILER_LOG_FILES older files (profiler_log.1.txt, ...)
+#define PROFILER_LOG_MAX_BYTES (10 * 1024 * 1024)
+#define PROFILER_LOG_FILES 3
 
 // File to which output data are written.
 static std::string kOutputFile;
 
+// Experiment results are written to the output file in batches at this interval (milliseconds)
+#define RESULTS_FLUSH_INTERVAL_MS 1000
+// The output file is fsync'ed at this interval (milliseconds)
+#define RESULTS_FSYNC_INTERVAL_MS 5000
+// Longest wait for the resolver thread to name the queued results when
+// flushing or stopping, the rest is written under raw method ids (milliseconds)
+#define SYMBOLIZER_FLUSH_TIMEOUT_MS 2000
+// The summary of the results (summary-file option) is saved at this interval (milliseconds)
+#define SUMMARY_INTERVAL_MS 10000
+// The session file (session option) is saved at this interval while profiling (milliseconds)
+#define SESSION_SAVE_INTERVAL_MS 60000
+// Longest wait for the coordinator (coordinator option) to connect or answer (milliseconds)
+#define COORDINATOR_TIMEOUT_MS 1000
+// A coordinator that could not be reached is not tried again for this long (milliseconds)
+#define COORDINATOR_RETRY_MS 10000
+// The coordinator gives a line to another JVM once the JVM that claimed it
+// has not reported it for this long (milliseconds), twice the longest experiment
+#define COORDINATOR_CLAIM_TIMEOUT_MS (2 * MAX_EXP_TIME)
+
 // --- Experiment Time Settings
 
 // Minimum experiment length in milliseconds
@@ -57,18 +81,106 @@ static std::string kOutputFile;
 #define HITS_TO_DEC_EXP_TIME 20
 // Each time the experiment time is increased, it is multiplied by this factor. Divided for decrease
 #define EXP_TIME_FACTOR 2
+// With the confidence option, experiments last at least this long (milliseconds) and at most MAX_EXP_TIME
+#define MIN_ADAPTIVE_EXP_TIME 500
+// With the confidence option, progress point hits are checked at this interval (milliseconds)
+#define CONFIDENCE_CHECK_INTERVAL_MS 50
+// z value of the confidence interval of the progress point rate (1.96 => 95% confidence)
+#define CONFIDENCE_Z 1.96
+
+// --- Delay Settings
+
+// Number of sleeps used to measure the timer slack of the machine at startup
+#define DELAY_CALIBRATION_ROUNDS 64
+// Length of each of these sleeps in nanoseconds
+#define DELAY_CALIBRATION_SLEEP_NS 50000
+// Maximum time in nanoseconds spent spinning at the end of a delay
+#define MAX_DELAY_SPIN_NS 200000
+// Maximum overshoot in nanoseconds carried over to the next delay of a thread
+#define MAX_DELAY_CREDIT_NS 1000000
+// Delay in nanoseconds a thread running Java code owes before the agent thread
+// suspends it to pay it, a JVMTI suspension costs tens of microseconds
+#define MIN_SUSPEND_DELAY_NS 1000000
+
+// Initial number of slots of the tables counting the experiments run on each bci
+// and each line. Must be a power of two, the tables grow when half full
+#define BCI_HITS_INITIAL_CAPACITY 4096
+
+// Maximum number of LockSupport methods whose calls are tracked as blocking
+#define MAX_BLOCKING_METHODS 16
+
+// --- Progress Point Settings
+
+// Maximum number of progress points (each half of a latency point counts as one)
+#define MAX_PROGRESS_POINTS 16
+
+// Maximum possible bytecode index (JVMS14, 4.7.3)
+#define MAX_BCI 65535
+
+// --- Experiment Selection Settings
+
+// Weight of every sampled frame in the selection histogram is multiplied by this after each experiment
+#define HISTOGRAM_DECAY_FACTOR 0.9
+// Frames whose weight decays below this are forgotten
+#define HISTOGRAM_MIN_WEIGHT 0.05
+// Number of frames tried (and dropped) per round if their line number table is unavailable
+#define MAX_FRAME_SELECTION_ATTEMPTS 10
+// Maximum number of lines that can be virtually sped up in the same experiment
+#define MAX_PARALLEL_LINES 8
+// Maximum number of methods of a class sped up together with granularity=class
+#define MAX_REGION_METHODS 256
+// With granularity=auto, experiments on a method before deciding whether to run line experiments in it
+#define DRILL_DOWN_MIN_EXPERIMENTS 20
+// With granularity=auto, lines of a method are profiled if speeding up the whole method by 100%
+// is estimated (by linear regression) to raise the throughput by at least this fraction
+#define DRILL_DOWN_MIN_EFFECT 0.05
+// Number of distinct speedups an experiment can use (0, 0.05, ..., 1.0)
+#define NUM_SPEEDUPS 21
 
 // --- Profiler Call Frame Settings
 
-// Maximum number JVMPI_CallFrame in static_call_frames - a shared and unsafe variable
-// Contents are copied to the variable local to profiler thread (Profiler.call_frames)
-#define NUM_STATIC_CALL_FRAMES 200
+// Number of JVMPI_CallFrame slots in each user thread's sample ring (must be a power of two)
+// The signal handler pushes in scope frames into the ring of the thread it interrupted,
+// and the agent thread drains every ring into Profiler.call_frames once per sampling round.
+// Sized for up to MAX_CALL_CHAIN_DEPTH frames per sample
+#define SAMPLE_RING_SIZE 1024
+// Slots per slab of the thread registry, slabs are allocated as threads start
+#define THREAD_SLAB_SIZE 64
+// Maximum number of slabs, so at most THREAD_SLAB_SIZE * MAX_THREAD_SLABS threads are profiled at once
+#define MAX_THREAD_SLABS 256
+// Cache line sized counters the readers of the in scope method set and of the
+// progress points count themselves in, each thread uses one of them
+#define READER_COUNT_STRIPES 64
+// Maximum number of in scope frames of one sample kept with the call-chain option
+#define MAX_CALL_CHAIN_DEPTH 16
+// Frames Profiler.call_frames has room for, it is shrunk back to this after
+// a round that needed more than 4 times as many
+#define CALL_FRAMES_RESERVE 2000
 
 // --- Profiler::Handle() Settings
 
 // Maximum number of frames to store from the stack traces sampled.
+// The stack-depth option walks fewer. With call-chain > 1 experiments match
+// caller frames too, so it must reach down to the call sites of interest
 static const int kMaxFramesToCapture = 128;
 
+// Number of log2 buckets of the agent's overhead histograms, the last one
+// counts everything from 2^(STATS_HISTOGRAM_BUCKETS - 1) ns (about 8ms)
+#define STATS_HISTOGRAM_BUCKETS 24
+// Interval (ms) at which the agent's overhead stats are logged and written to stats-file
+#define STATS_INTERVAL_MS 10000
+// Interval (ms) at which the agent thread drops the jmethodIDs of unloaded
+// classes (if any were unloaded) and checks the memory-budget option
+#define MEMORY_CHECK_INTERVAL_MS 1000
+// Sampled lines the histogram keeps however small the memory-budget is, so
+// lines can still be picked for experiments
+#define MIN_HISTOGRAM_FRAMES 1000
+
+// Smallest sample-interval accepted, in microseconds
+#define MIN_SAMPLE_INTERVAL_US 100
+// Longest uninterrupted sleep of the agent thread while duty-cycle idles, so Stop() is not delayed
+#define DUTY_CYCLE_SLEEP_SLICE_MS 100
+
 const int kNumCallTraceErrors = 10;
 
 // ----------------- Useful Macros -----------------
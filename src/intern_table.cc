@@ -0,0 +1,45 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "intern_table.h"
+#include "agent_stats.h"
+
+uint32_t InternTable::intern(const char *str)
+{
+  auto inserted = ids_.emplace(str, (uint32_t)strings_.size());
+  if (inserted.second)
+  {
+    strings_.push_back(&inserted.first->first);
+  }
+  return inserted.first->second;
+}
+
+size_t InternTable::memory_bytes() const
+{
+  size_t bytes = agent_stats::hash_map_bytes(ids_) + strings_.capacity() * sizeof(const std::string *);
+  for (const std::string *str : strings_)
+  {
+    bytes += agent_stats::string_bytes(*str);
+  }
+  return bytes;
+}
+
+void InternTable::clear()
+{
+  strings_.clear();
+  ids_.clear();
+}
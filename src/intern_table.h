@@ -0,0 +1,56 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_INTERN_TABLE_H
+#define JCOZ_INTERN_TABLE_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "globals.h"
+
+// Maps each distinct string to a small id, so tables can store a 4 byte id
+// instead of a copy of (or a pointer owned by someone else to) the string.
+// Not thread safe.
+class InternTable
+{
+public:
+  InternTable() {}
+
+  // Returns the id of `str`, adding it to the table if needed
+  uint32_t intern(const char *str);
+
+  const std::string &get(uint32_t id) const { return *strings_[id]; }
+
+  size_t size() const { return strings_.size(); }
+
+  // Approximate heap footprint of the table and its strings
+  size_t memory_bytes() const;
+
+  void clear();
+
+private:
+  std::unordered_map<std::string, uint32_t> ids_;
+  // Keys of `ids_`, indexed by id. Nodes of an unordered_map never move
+  std::vector<const std::string *> strings_;
+
+  DISALLOW_COPY_AND_ASSIGN(InternTable);
+};
+
+#endif // JCOZ_INTERN_TABLE_H
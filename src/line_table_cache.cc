@@ -0,0 +1,260 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "line_table_cache.h"
+#include "agent_stats.h"
+
+#include <algorithm>
+#include <atomic>
+
+jint MethodLineTable::line_for_bci(jint bci) const
+{
+  // First entry that starts after bci; the line before it contains bci
+  auto after = std::upper_bound(entries.begin(), entries.end(), (jlocation)bci,
+                                [](jlocation location, const jvmtiLineNumberEntry &entry)
+                                { return location < entry.start_location; });
+  if (after == entries.begin())
+  {
+    return -1;
+  }
+  return (after - 1)->line_number;
+}
+
+const std::vector<std::pair<jint, jint>> *MethodLineTable::ranges_for_line(jint line_number) const
+{
+  auto ranges = line_ranges.find(line_number);
+  if (ranges == line_ranges.end())
+  {
+    return NULL;
+  }
+  return &ranges->second;
+}
+
+bool MethodLineTable::same_entries(const MethodLineTable &other) const
+{
+  return available == other.available && entries.size() == other.entries.size() &&
+         std::equal(entries.begin(), entries.end(), other.entries.begin(),
+                    [](const jvmtiLineNumberEntry &lhs, const jvmtiLineNumberEntry &rhs)
+                    { return lhs.start_location == rhs.start_location && lhs.line_number == rhs.line_number; });
+}
+
+std::shared_ptr<const MethodLineTable> LineTableCache::build(jvmtiEnv *jvmti, jmethodID method_id)
+{
+  std::shared_ptr<MethodLineTable> table = std::make_shared<MethodLineTable>();
+
+  jint num_entries;
+  JvmtiScopedPtr<jvmtiLineNumberEntry> entries(jvmti);
+  if (jvmti->GetLineNumberTable(method_id, &num_entries, entries.GetRef()) != JVMTI_ERROR_NONE)
+  {
+    return table;
+  }
+
+  table->available = true;
+  table->entries.assign(entries.Get(), entries.Get() + num_entries);
+  // JVMTI does not promise any order
+  std::stable_sort(table->entries.begin(), table->entries.end(),
+                   [](const jvmtiLineNumberEntry &lhs, const jvmtiLineNumberEntry &rhs)
+                   { return lhs.start_location < rhs.start_location; });
+
+  for (size_t i = 0; i < table->entries.size(); i++)
+  {
+    jint start = (jint)table->entries[i].start_location;
+    jint end = (i + 1 < table->entries.size()) ? (jint)table->entries[i + 1].start_location : MAX_BCI + 1;
+    if (start < end)
+    {
+      table->line_ranges[table->entries[i].line_number].push_back(std::pair<jint, jint>(start, end));
+    }
+  }
+  return table;
+}
+
+void LineTableCache::lock()
+{
+  agent_stats::spin_lock(&lock_, 1, agent_stats::_line_table_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void LineTableCache::unlock()
+{
+  std::atomic_thread_fence(std::memory_order_release);
+  lock_ = 0;
+}
+
+std::shared_ptr<const MethodLineTable> LineTableCache::get(jvmtiEnv *jvmti, jmethodID method_id)
+{
+  lock();
+  auto redefined = redefined_.find(method_id);
+  if (redefined != redefined_.end())
+  {
+    std::shared_ptr<const MethodLineTable> before = redefined->second;
+    unlock();
+    std::shared_ptr<const MethodLineTable> table = build(jvmti, method_id);
+    if (table->same_entries(*before))
+    {
+      return table;
+    }
+    // The redefinition is applied, cached from the next lookup on
+    lock();
+    redefined = redefined_.find(method_id);
+    if (redefined != redefined_.end() && redefined->second == before)
+    {
+      redefined_.erase(redefined);
+    }
+    unlock();
+    return table;
+  }
+
+  Entry &entry = tables_[method_id];
+  if (entry.table)
+  {
+    std::shared_ptr<const MethodLineTable> table = entry.table;
+    unlock();
+    return table;
+  }
+  entry.building = true;
+  unsigned long generation = entry.generation;
+  unlock();
+
+  // Build outside the lock, JVMTI calls may block
+  std::shared_ptr<const MethodLineTable> table = build(jvmti, method_id);
+
+  lock();
+  // Not cached either if the cache was cleared meanwhile
+  auto built = tables_.find(method_id);
+  if (built == tables_.end())
+  {
+    unlock();
+    return table;
+  }
+  if (built->second.generation != generation)
+  {
+    // Invalidated while it was built, so it may be the table from before a
+    // redefinition. The caller can still use it once, the next get rebuilds it
+    if (!built->second.table)
+      tables_.erase(built);
+  }
+  else if (built->second.table)
+  {
+    // Another thread built it first
+    table = built->second.table;
+  }
+  else
+  {
+    built->second.table = table;
+    built->second.building = false;
+  }
+  unlock();
+  return table;
+}
+
+void LineTableCache::invalidate_locked(jmethodID method_id)
+{
+  auto cached = tables_.find(method_id);
+  if (cached == tables_.end())
+  {
+    return;
+  }
+  if (cached->second.building)
+  {
+    // Kept for its generation, so the build in flight is not cached
+    cached->second.table.reset();
+    cached->second.generation++;
+  }
+  else
+  {
+    tables_.erase(cached);
+  }
+}
+
+void LineTableCache::invalidate(jmethodID method_id)
+{
+  lock();
+  invalidate_locked(method_id);
+  redefined_.erase(method_id);
+  unlock();
+}
+
+void LineTableCache::invalidate(jint method_count, jmethodID *methods)
+{
+  lock();
+  for (int i = 0; i < method_count; i++)
+  {
+    invalidate_locked(methods[i]);
+    redefined_.erase(methods[i]);
+  }
+  unlock();
+}
+
+void LineTableCache::invalidate_redefined(jvmtiEnv *jvmti, jint method_count, jmethodID *methods)
+{
+  // Built outside the lock, JVMTI calls may block. The class is not
+  // redefined yet, so these are the tables a lookup must see change
+  std::vector<std::shared_ptr<const MethodLineTable>> before(method_count);
+  for (int i = 0; i < method_count; i++)
+  {
+    before[i] = build(jvmti, methods[i]);
+  }
+
+  lock();
+  for (int i = 0; i < method_count; i++)
+  {
+    invalidate_locked(methods[i]);
+    // After an earlier redefinition, the table to see change is the one of now
+    redefined_[methods[i]] = before[i];
+  }
+  unlock();
+}
+
+void LineTableCache::clear()
+{
+  lock();
+  // Swapped so the buckets are freed as well. Builds in flight find their
+  // entry gone and are not cached
+  std::unordered_map<jmethodID, Entry>().swap(tables_);
+  std::unordered_map<jmethodID, std::shared_ptr<const MethodLineTable>>().swap(redefined_);
+  unlock();
+}
+
+size_t LineTableCache::table_bytes(const MethodLineTable &table)
+{
+  // The table shares its allocation with the control block of the shared_ptr
+  size_t bytes = sizeof(MethodLineTable) + 2 * sizeof(long) +
+                 table.entries.capacity() * sizeof(jvmtiLineNumberEntry) +
+                 agent_stats::hash_map_bytes(table.line_ranges);
+  for (auto ranges = table.line_ranges.begin(); ranges != table.line_ranges.end(); ranges++)
+  {
+    bytes += ranges->second.capacity() * sizeof(std::pair<jint, jint>);
+  }
+  return bytes;
+}
+
+size_t LineTableCache::memory_bytes()
+{
+  lock();
+  size_t bytes = agent_stats::hash_map_bytes(tables_) + agent_stats::hash_map_bytes(redefined_);
+  for (auto cached = tables_.begin(); cached != tables_.end(); cached++)
+  {
+    if (cached->second.table)
+      bytes += table_bytes(*cached->second.table);
+  }
+  for (auto redefined = redefined_.begin(); redefined != redefined_.end(); redefined++)
+  {
+    bytes += table_bytes(*redefined->second);
+  }
+  unlock();
+  return bytes;
+}
@@ -0,0 +1,106 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_LINE_TABLE_CACHE_H
+#define JCOZ_LINE_TABLE_CACHE_H
+
+#include <jvmti.h>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "globals.h"
+
+// Line number table of one method, sorted by start location, together with
+// the bci ranges [first, second) that make up each source line.
+struct MethodLineTable
+{
+  // false if the JVM has no line numbers for the method (e.g. native methods)
+  bool available = false;
+  std::vector<jvmtiLineNumberEntry> entries;
+  std::unordered_map<jint, std::vector<std::pair<jint, jint>>> line_ranges;
+
+  // Returns the source line containing `bci`, or -1 if there is none
+  jint line_for_bci(jint bci) const;
+
+  // Returns the bci ranges of `line_number`, or NULL if the method has no such line
+  const std::vector<std::pair<jint, jint>> *ranges_for_line(jint line_number) const;
+
+  bool same_entries(const MethodLineTable &other) const;
+};
+
+// Per-jmethodID cache of line number tables, so that selecting an experiment
+// does not need a JVMTI round-trip (and allocation) every time. Tables are
+// built lazily and dropped when the class of the method is redefined.
+class LineTableCache
+{
+public:
+  LineTableCache() : lock_(0) {}
+
+  // Callers share ownership, so the table stays valid even if the method
+  // is invalidated while they use it
+  std::shared_ptr<const MethodLineTable> get(jvmtiEnv *jvmti, jmethodID method_id);
+
+  void invalidate(jmethodID method_id);
+
+  void invalidate(jint method_count, jmethodID *methods);
+
+  // Called from the ClassFileLoadHook of a redefinition, before the new
+  // class is applied. JVMTI has no event once it is applied, so the tables
+  // of the methods as they are now are kept, and a method's table is only
+  // cached again once it differs from that one (see `get()`)
+  void invalidate_redefined(jvmtiEnv *jvmti, jint method_count, jmethodID *methods);
+
+  void clear();
+
+  // Approximate heap footprint of the cached tables
+  size_t memory_bytes();
+
+private:
+  static std::shared_ptr<const MethodLineTable> build(jvmtiEnv *jvmti, jmethodID method_id);
+
+  static size_t table_bytes(const MethodLineTable &table);
+
+  void lock();
+  void unlock();
+
+  struct Entry
+  {
+    // NULL while the table is being built
+    std::shared_ptr<const MethodLineTable> table;
+    // Bumped by each invalidation, a build that started at an older
+    // generation raced an invalidation and is not cached
+    unsigned long generation = 0;
+    bool building = false;
+  };
+
+  void invalidate_locked(jmethodID method_id);
+
+  std::unordered_map<jmethodID, Entry> tables_;
+  // Tables of redefined methods from before the redefinition was applied.
+  // A method stays here, and its tables uncached, while its table is the
+  // same: the redefinition may not be applied yet, or it may not have
+  // changed the lines of the method, which costs a JVMTI call per lookup
+  // but is never stale
+  std::unordered_map<jmethodID, std::shared_ptr<const MethodLineTable>> redefined_;
+  volatile int lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(LineTableCache);
+};
+
+#endif // JCOZ_LINE_TABLE_CACHE_H
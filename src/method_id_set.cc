@@ -0,0 +1,258 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "method_id_set.h"
+#include "agent_stats.h"
+
+// Tables are grown once they are half full, which keeps probe sequences short
+#define MAX_LOAD_NUMERATOR 1
+#define MAX_LOAD_DENOMINATOR 2
+
+MethodIdSet::MethodIdSet(size_t initial_capacity) : writer_lock_(0)
+{
+  size_t capacity = 16;
+  while (capacity < initial_capacity)
+  {
+    capacity <<= 1;
+  }
+  initial_capacity_ = capacity;
+  table_.store(new_table(capacity), std::memory_order_release);
+}
+
+MethodIdSet::~MethodIdSet()
+{
+  retired_.push_back(table_.load(std::memory_order_acquire));
+  for (Table *table : retired_)
+  {
+    delete[] table->slots;
+    delete table;
+  }
+}
+
+MethodIdSet::Table *MethodIdSet::new_table(size_t capacity)
+{
+  Table *table = new Table();
+  table->capacity = capacity;
+  table->count = 0;
+  table->tombstones = 0;
+  table->slots = new std::atomic<void *>[capacity];
+  for (size_t i = 0; i < capacity; i++)
+  {
+    table->slots[i].store(nullptr, std::memory_order_relaxed);
+  }
+  return table;
+}
+
+void MethodIdSet::lock_writers()
+{
+  agent_stats::spin_lock(&writer_lock_, 1, agent_stats::_method_id_set_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void MethodIdSet::unlock_writers()
+{
+  std::atomic_thread_fence(std::memory_order_release);
+  writer_lock_ = 0;
+}
+
+bool MethodIdSet::insert_locked(void *method)
+{
+  // nullptr marks an empty slot, so it can never be a member
+  if (method == nullptr)
+  {
+    return false;
+  }
+
+  Table *table = table_.load(std::memory_order_relaxed);
+  // Tombstones lengthen probe sequences as much as entries do
+  if ((table->count + table->tombstones + 1) * MAX_LOAD_DENOMINATOR > table->capacity * MAX_LOAD_NUMERATOR)
+  {
+    rehash_locked((table->count + 1) * MAX_LOAD_DENOMINATOR > table->capacity * MAX_LOAD_NUMERATOR
+                      ? table->capacity * 2
+                      : table->capacity);
+    table = table_.load(std::memory_order_relaxed);
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t free_slot = table->capacity;
+  for (size_t i = hash(method) & mask;; i = (i + 1) & mask)
+  {
+    void *slot = table->slots[i].load(std::memory_order_relaxed);
+    if (slot == method)
+    {
+      return false;
+    }
+    if (slot == tombstone() && free_slot == table->capacity)
+    {
+      free_slot = i;
+    }
+    if (slot == nullptr)
+    {
+      if (free_slot == table->capacity)
+      {
+        free_slot = i;
+      }
+      else
+      {
+        table->tombstones--;
+      }
+      // Release so that a reader which sees the entry sees a fully written slot
+      table->slots[free_slot].store(method, std::memory_order_release);
+      table->count++;
+      return true;
+    }
+  }
+}
+
+void MethodIdSet::rehash_locked(size_t capacity)
+{
+  Table *old_table = table_.load(std::memory_order_relaxed);
+  Table *table = new_table(capacity);
+  size_t mask = table->capacity - 1;
+  for (size_t j = 0; j < old_table->capacity; j++)
+  {
+    void *method = old_table->slots[j].load(std::memory_order_relaxed);
+    if (method == nullptr || method == tombstone())
+    {
+      continue;
+    }
+    size_t i = hash(method) & mask;
+    while (table->slots[i].load(std::memory_order_relaxed) != nullptr)
+    {
+      i = (i + 1) & mask;
+    }
+    table->slots[i].store(method, std::memory_order_relaxed);
+    table->count++;
+  }
+
+  retire_locked(table);
+}
+
+void MethodIdSet::retire_locked(Table *table)
+{
+  Table *old_table = table_.load(std::memory_order_relaxed);
+  table_.store(table, std::memory_order_seq_cst);
+  retired_.push_back(old_table);
+  reclaim_locked();
+}
+
+void MethodIdSet::reclaim_locked()
+{
+  // A reader that enters after its stripe is loaded sees the table stored before it
+  if (retired_.empty() || readers_.any())
+  {
+    return;
+  }
+  for (Table *table : retired_)
+  {
+    delete[] table->slots;
+    delete table;
+  }
+  retired_.clear();
+}
+
+bool MethodIdSet::insert(void *method)
+{
+  lock_writers();
+  bool inserted = insert_locked(method);
+  unlock_writers();
+  return inserted;
+}
+
+void MethodIdSet::insert(jint method_count, jmethodID *methods)
+{
+  lock_writers();
+  for (int i = 0; i < method_count; i++)
+  {
+    insert_locked((void *)methods[i]);
+  }
+  unlock_writers();
+}
+
+size_t MethodIdSet::remove(const std::vector<jmethodID> &methods)
+{
+  lock_writers();
+  Table *table = table_.load(std::memory_order_relaxed);
+  size_t mask = table->capacity - 1;
+  size_t removed = 0;
+  for (jmethodID method : methods)
+  {
+    if (method == nullptr)
+    {
+      continue;
+    }
+    for (size_t i = hash(method) & mask;; i = (i + 1) & mask)
+    {
+      void *slot = table->slots[i].load(std::memory_order_relaxed);
+      if (slot == (void *)method)
+      {
+        table->slots[i].store(tombstone(), std::memory_order_release);
+        table->count--;
+        table->tombstones++;
+        removed++;
+        break;
+      }
+      if (slot == nullptr)
+      {
+        break;
+      }
+    }
+  }
+
+  if (table->tombstones * 4 > table->capacity)
+  {
+    // Shrinks the table as well, down to a quarter full
+    size_t capacity = initial_capacity_;
+    while (table->count * 4 > capacity)
+    {
+      capacity <<= 1;
+    }
+    rehash_locked(capacity);
+  }
+  unlock_writers();
+  return removed;
+}
+
+void MethodIdSet::clear()
+{
+  lock_writers();
+  Table *old_table = table_.load(std::memory_order_relaxed);
+  retire_locked(new_table(old_table->capacity));
+  unlock_writers();
+}
+
+bool MethodIdSet::reclaim()
+{
+  lock_writers();
+  reclaim_locked();
+  bool reclaimed = retired_.empty();
+  unlock_writers();
+  return reclaimed;
+}
+
+size_t MethodIdSet::memory_bytes()
+{
+  lock_writers();
+  Table *table = table_.load(std::memory_order_relaxed);
+  size_t bytes = sizeof(Table) + table->capacity * sizeof(std::atomic<void *>);
+  for (Table *retired : retired_)
+  {
+    bytes += sizeof(Table) + retired->capacity * sizeof(std::atomic<void *>);
+  }
+  unlock_writers();
+  return bytes;
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_METHOD_ID_SET_H
+#define JCOZ_METHOD_ID_SET_H
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "globals.h"
+#include "reader_counts.h"
+
+// Insert-mostly set of jmethodIDs, read from the SIGPROF handler.
+//
+// The set is an open-addressing table with linear probing over a flat array
+// of pointers, so a lookup touches one or two cache lines and never takes a
+// lock. Writers (class prepare callbacks) are serialized among themselves and
+// either publish a new entry into a free slot of the current table, or, when
+// the table gets too full, build a bigger table and publish it with a single
+// atomic store (RCU style). Removed entries (methods of unloaded classes)
+// leave a tombstone that lookups probe past, and the table is rebuilt once
+// tombstones take a quarter of it. Readers that still hold an old table keep
+// seeing a consistent - if slightly stale - snapshot, so retired tables are
+// only freed when no Reader is left.
+class MethodIdSet
+{
+  struct Table;
+
+public:
+  explicit MethodIdSet(size_t initial_capacity = 1024);
+
+  ~MethodIdSet();
+
+  // Holds on to the current table for a series of lookups (e.g. the frames
+  // of one sample), so the set counts one reader rather than one per lookup.
+  // Wait-free and async-signal-safe.
+  class Reader
+  {
+  public:
+    explicit Reader(const MethodIdSet &set) : set_(set)
+    {
+      // Sequentially consistent with the store of a new table in
+      // retire_locked(), so a reader counted as absent there cannot hold a retired table
+      stripe_ = set_.readers_.enter();
+      table_ = set_.table_.load(std::memory_order_seq_cst);
+    }
+
+    ~Reader() { set_.readers_.exit(stripe_); }
+
+    bool contains(const void *method) const
+    {
+      size_t mask = table_->capacity - 1;
+      for (size_t i = hash(method) & mask;; i = (i + 1) & mask)
+      {
+        const void *slot = table_->slots[i].load(std::memory_order_acquire);
+        if (slot == method)
+        {
+          return true;
+        }
+        if (slot == nullptr)
+        {
+          return false;
+        }
+      }
+    }
+
+  private:
+    const MethodIdSet &set_;
+    const Table *table_;
+    unsigned int stripe_;
+
+    DISALLOW_COPY_AND_ASSIGN(Reader);
+  };
+
+  // Wait-free and async-signal-safe.
+  bool contains(const void *method) const
+  {
+    Reader reader(*this);
+    return reader.contains(method);
+  }
+
+  // Returns false if the method was already in the set.
+  bool insert(void *method);
+
+  void insert(jint method_count, jmethodID *methods);
+
+  // Returns the number of methods that were in the set
+  size_t remove(const std::vector<jmethodID> &methods);
+
+  // Publishes an empty table; concurrent readers finish on the old one.
+  void clear();
+
+  // Frees the retired tables if no reader is using them, returns false if some are still kept
+  bool reclaim();
+
+  size_t size() const { return table_.load(std::memory_order_acquire)->count; }
+
+  // Bytes of the current table and of the retired tables not freed yet
+  size_t memory_bytes();
+
+private:
+  struct Table
+  {
+    size_t capacity;
+    size_t count;
+    size_t tombstones;
+    std::atomic<void *> *slots;
+  };
+
+  // Marks the slot of a removed method, never a valid jmethodID
+  static void *tombstone() { return (void *)(uintptr_t)1; }
+
+  static size_t hash(const void *method)
+  {
+    // jmethodIDs are aligned pointers, so mix the bits (Fibonacci hashing)
+    // before masking or the low slots would never be used.
+    uint64_t h = (uint64_t)(uintptr_t)method * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 17);
+  }
+
+  static Table *new_table(size_t capacity);
+
+  // Must hold writer_lock_.
+  bool insert_locked(void *method);
+  void rehash_locked(size_t capacity);
+  void retire_locked(Table *table);
+  void reclaim_locked();
+  void lock_writers();
+  void unlock_writers();
+
+  std::atomic<Table *> table_;
+  std::vector<Table *> retired_;
+  // Live Readers, counted from signal handlers
+  ReaderCounts readers_;
+  size_t initial_capacity_;
+  volatile int writer_lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(MethodIdSet);
+};
+
+#endif // JCOZ_METHOD_ID_SET_H
@@ -24,7 +24,9 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <vector>
 #include <set>
 #include <chrono>
@@ -40,10 +42,12 @@
 #include <string>
 #include <sstream>
 #include <iterator>
+#include <cmath>
 
 #include "globals.h"
 #include "bci_hits.h"
 #include "args.h"
+#include "delay_engine.h"
 
 #ifdef __APPLE__
 // See comment in Accessors class
@@ -52,11 +56,9 @@ pthread_key_t Accessors::key_;
 __thread JNIEnv *Accessors::env_;
 #endif
 
+// Default sample-interval, in nanoseconds
 #define SIGNAL_FREQ 1000000L
 
-// Maximum possible bytecode index (JVMS14, 4.7.3)
-#define MAX_BCI 65535
-
 typedef std::chrono::duration<long, std::milli> milliseconds_type;
 typedef std::chrono::duration<long, std::nano> nanoseconds_type;
 
@@ -64,18 +66,37 @@ ASGCTType Asgct::asgct_;
 
 thread_local struct UserThread *curr_ut;
 
+static const char *kLockSupportSignature = "Ljava/util/concurrent/locks/LockSupport;";
+
+DelayEngine delay_engine;
+
 // Initialize static Profiler variables here
-std::unordered_set<void *> Profiler::in_scope_ids;
-volatile bool Profiler::in_experiment = false;
-volatile pthread_t Profiler::in_scope_lock = 0;
-volatile int Profiler::frame_lock = 0;
+MethodIdSet Profiler::in_scope_ids;
+std::atomic<bool> Profiler::in_experiment(false);
 volatile int Profiler::user_threads_lock = 0;
 std::vector<JVMPI_CallFrame> Profiler::call_frames;
+SampleHistogram Profiler::sample_histogram;
+LineTableCache Profiler::line_tables;
+ResultWriter Profiler::result_writer;
+Symbolizer Profiler::symbolizer;
+ResultSummary Profiler::result_summary;
+std::string Profiler::summary_file;
+std::mutex Profiler::summary_lock;
+std::chrono::steady_clock::time_point Profiler::last_summary_save;
+double Profiler::explore_fraction = 0;
+int Profiler::parallel_lines = 1;
+int Profiler::call_chain_depth = 1;
+experiment_granularity Profiler::granularity = _line_granularity;
+std::vector<std::string> Profiler::thread_patterns;
+std::vector<std::string> Profiler::thread_group_patterns;
+std::unordered_map<jmethodID, RegionStats> Profiler::method_regions;
 struct Experiment Profiler::current_experiment;
-std::unordered_set<struct UserThread *> Profiler::user_threads;
+UserThreadRegistry Profiler::user_threads;
 jvmtiEnv *Profiler::jvmti;
 std::atomic<long> Profiler::global_delay(0);
-std::atomic_ulong Profiler::points_hit(0);
+std::atomic<long> Profiler::exited_points_hit[MAX_PROGRESS_POINTS];
+struct BlockingMethod Profiler::blocking_methods[MAX_BLOCKING_METHODS];
+std::atomic<int> Profiler::num_blocking_methods(0);
 std::atomic_bool Profiler::_running(false);
 volatile bool Profiler::end_to_end = false;
 pthread_t Profiler::agent_pthread;
@@ -89,20 +110,46 @@ bool Profiler::prof_ready = false;
 
 // Progress point stuff
 std::string Profiler::package;
-struct ProgressPoint *Profiler::progress_point = nullptr;
-std::string Profiler::progress_class;
+std::vector<struct ProgressPoint> Profiler::progress_points;
+RcuSnapshot<std::vector<struct ProgressPoint>> Profiler::published_points(new std::vector<struct ProgressPoint>());
 std::vector<std::string> Profiler::search_scopes;
 std::vector<std::string> Profiler::ignored_scopes;
-
-static std::atomic<int> call_index(0);
-static JVMPI_CallFrame static_call_frames[NUM_STATIC_CALL_FRAMES];
+ScopeTrie Profiler::scope_trie;
+ClassNameTable Profiler::class_names;
 
 bool Profiler::fix_exp = false;
+double Profiler::confidence = 0;
+int Profiler::line_samples = 0;
+std::map<std::pair<jmethodID, jint>, std::vector<SpeedupBin>> Profiler::line_speedups;
+bool Profiler::timer_sampling = false;
+long Profiler::sample_interval = SIGNAL_FREQ;
+int Profiler::stack_depth = kMaxFramesToCapture;
+int Profiler::duty_cycle_experiments = 0;
+long Profiler::duty_cycle_idle_ms = 0;
+volatile bool Profiler::sampling_paused = false;
+std::string Profiler::stats_file;
+std::string Profiler::session_file;
+Session Profiler::session;
+std::vector<SessionSeed> Profiler::session_seeds;
+volatile int Profiler::session_lock = 0;
+std::unordered_map<jmethodID, std::pair<std::string, std::string>> Profiler::session_methods;
+CoordinatorClient Profiler::coordinator;
+LineKey Profiler::coordinated_lines[MAX_PARALLEL_LINES];
+std::unordered_map<jmethodID, std::string> Profiler::method_keys;
+unsigned long Profiler::memory_budget = 0;
+std::atomic<unsigned long> Profiler::classes_unloaded(0);
+Session Profiler::unloaded_session;
+bool Profiler::fast_startup = false;
+std::string Profiler::control_path;
+bool Profiler::paused = false;
+bool Profiler::attached = false;
+bool Profiler::breakpoints_available = true;
+bool Profiler::suspend_available = true;
 
 nanoseconds_type startup_time;
 
-// Logger
-std::shared_ptr<spdlog::logger> Profiler::logger = spdlog::basic_logger_mt("basic_logger", PROFILER_LOG_FILE);
+// Logger, rotated so an agent left attached for weeks keeps a bounded log
+std::shared_ptr<spdlog::logger> Profiler::logger = spdlog::rotating_logger_mt("basic_logger", PROFILER_LOG_FILE, PROFILER_LOG_MAX_BYTES, PROFILER_LOG_FILES);
 
 void Profiler::ParseOptions(const char *options)
 {
@@ -119,12 +166,10 @@ void Profiler::ParseOptions(const char *options)
   std::stringstream ss(options_str);
   std::string item;
   std::vector<std::string> cmd_line_options;
-  progress_point = new ProgressPoint();
-  progress_point->lineno = -1;
-  progress_point->method_id = nullptr;
 
   bool isLoggingLevelSet = false;
-  bool isOutputFileSet = false;
+  std::string output_file_option;
+  std::string output_format = "csv";
 
   // split underscore delimited line into options
   // (we can't use semicolon because bash is dumb)
@@ -169,12 +214,30 @@ void Profiler::ParseOptions(const char *options)
 
     case _progress_point:
     {
-      size_t colon_index = value.find(':');
-      if (colon_index == std::string::npos)
-        agent_args::report_error("Missing progress point");
+      std::stringstream progress_points_stream(value);
+      while (std::getline(progress_points_stream, item, '|'))
+      {
+        parse_progress_point(item, _throughput_point);
+      }
+      break;
+    }
 
-      Profiler::progress_class = value.substr(0, colon_index);
-      progress_point->lineno = std::stoi(value.substr(colon_index + 1));
+    case _latency_point:
+    {
+      std::stringstream latency_points_stream(value);
+      while (std::getline(latency_points_stream, item, '|'))
+      {
+        size_t comma_index = item.find(',');
+        if (comma_index == std::string::npos)
+          agent_args::report_error("Latency point must be a begin and end point separated by ','");
+
+        std::string begin = item.substr(0, comma_index);
+        std::string end = item.substr(comma_index + 1);
+        parse_progress_point(begin, _latency_begin_point);
+        parse_progress_point(end, _latency_end_point);
+        progress_points[progress_points.size() - 2].pair_index = progress_points.size() - 1;
+        progress_points[progress_points.size() - 1].pair_index = progress_points.size() - 2;
+      }
       break;
     }
 
@@ -186,8 +249,11 @@ void Profiler::ParseOptions(const char *options)
     }
 
     case _output_file:
-      agent_args::set_output_file(value);
-      isOutputFileSet = true;
+      output_file_option = value;
+      break;
+
+    case _output_format:
+      output_format = value;
       break;
 
     case _end_to_end:
@@ -202,29 +268,236 @@ void Profiler::ParseOptions(const char *options)
     case _fix_exp:
       fix_exp = true;
       break;
+
+    case _confidence:
+      confidence = std::stod(value);
+      if (confidence <= 0 || confidence >= 1)
+        agent_args::report_error("confidence must be between 0 and 1");
+      break;
+
+    case _line_samples:
+      line_samples = std::stoi(value);
+      if (line_samples < 0)
+        agent_args::report_error("line-samples must not be negative");
+      break;
+
+    case _timer_sampling:
+      timer_sampling = true;
+      break;
+
+    case _fast_startup:
+      fast_startup = true;
+      break;
+
+    case _sample_interval:
+      sample_interval = std::stol(value) * 1000;
+      if (sample_interval < MIN_SAMPLE_INTERVAL_US * 1000)
+        agent_args::report_error(fmt::format("sample-interval must be at least {} microseconds", MIN_SAMPLE_INTERVAL_US).c_str());
+      break;
+
+    case _stack_depth:
+      stack_depth = std::stoi(value);
+      if (stack_depth < 1 || stack_depth > kMaxFramesToCapture)
+        agent_args::report_error(fmt::format("stack-depth must be between 1 and {}", kMaxFramesToCapture).c_str());
+      break;
+
+    case _duty_cycle:
+    {
+      size_t comma_index = value.find(',');
+      if (comma_index == std::string::npos)
+        agent_args::report_error("duty-cycle must be a number of experiments and an idle time separated by ','");
+      duty_cycle_experiments = std::stoi(value.substr(0, comma_index));
+      duty_cycle_idle_ms = std::stol(value.substr(comma_index + 1));
+      if (duty_cycle_experiments < 1 || duty_cycle_idle_ms < 0)
+        agent_args::report_error("duty-cycle needs at least one experiment and a non-negative idle time");
+      break;
+    }
+
+    case _stats_file:
+      stats_file = value;
+      break;
+
+    case _memory_budget:
+    {
+      long megabytes = std::stol(value);
+      if (megabytes < 0)
+        agent_args::report_error("memory-budget must not be negative");
+      memory_budget = megabytes > 0 ? (unsigned long)megabytes * 1024 * 1024 : 0;
+      break;
+    }
+
+    case _session:
+      session_file = value;
+      break;
+
+    case _coordinator:
+      if (!coordinator.configure(value))
+        agent_args::report_error("coordinator must be a host that resolves and a port, separated by ':'");
+      break;
+
+    case _summary_file:
+      summary_file = value;
+      break;
+
+    case _control:
+      control_path = value;
+      break;
+
+    case _paused:
+      paused = true;
+      break;
+
+    case _explore:
+      explore_fraction = std::stod(value);
+      if (explore_fraction < 0 || explore_fraction > 1)
+        agent_args::report_error("explore must be between 0 and 1");
+      break;
+
+    case _call_chain:
+      call_chain_depth = std::stoi(value);
+      if (call_chain_depth < 1 || call_chain_depth > MAX_CALL_CHAIN_DEPTH)
+        agent_args::report_error(fmt::format("call-chain must be between 1 and {}", MAX_CALL_CHAIN_DEPTH).c_str());
+      break;
+
+    case _threads:
+    {
+      std::stringstream threads_stream(value);
+      while (std::getline(threads_stream, item, '|'))
+      {
+        thread_patterns.push_back(item);
+      }
+      break;
+    }
+
+    case _thread_groups:
+    {
+      std::stringstream thread_groups_stream(value);
+      while (std::getline(thread_groups_stream, item, '|'))
+      {
+        thread_group_patterns.push_back(item);
+      }
+      break;
+    }
+
+    case _granularity:
+      if (value == "line")
+        granularity = _line_granularity;
+      else if (value == "method")
+        granularity = _method_granularity;
+      else if (value == "class")
+        granularity = _class_granularity;
+      else if (value == "auto")
+        granularity = _auto_granularity;
+      else
+        agent_args::report_error(fmt::format("Invalid granularity: {}", value).c_str());
+      break;
+
+    case _parallel_lines:
+      parallel_lines = std::stoi(value);
+      if (parallel_lines < 1 || parallel_lines > MAX_PARALLEL_LINES)
+        agent_args::report_error(fmt::format("parallel-lines must be between 1 and {}", MAX_PARALLEL_LINES).c_str());
+      break;
     }
   }
 
+  // Only the threads of the main group are profiled unless told otherwise
+  if (thread_patterns.empty() && thread_group_patterns.empty())
+  {
+    thread_group_patterns.push_back("main");
+  }
+
   if (!isLoggingLevelSet)
   {
     logger->info("Logging level not specified in options, default info level used");
   }
 
-  if (!isOutputFileSet)
+  // During an experiment every walked frame is matched against the sped up
+  // lines, so call sites deeper than stack-depth are never delayed
+  if (stack_depth < call_chain_depth)
+  {
+    agent_args::report_error(fmt::format("stack-depth ({}) must be at least call-chain ({})", stack_depth, call_chain_depth).c_str());
+  }
+  else if (call_chain_depth > 1 && stack_depth < kMaxFramesToCapture)
+  {
+    logger->warn("With call-chain={} and stack-depth={}, call sites deeper than {} frames are not sampled and not delayed in experiments",
+                 call_chain_depth, stack_depth, stack_depth);
+  }
+
+  ResultSink *sink = create_result_sink(output_format);
+  if (sink == NULL)
+  {
+    agent_args::report_error(fmt::format("Invalid output format: {}", output_format).c_str());
+  }
+
+  if (output_file_option.empty())
+  {
+    kOutputFile = std::string("jcoz-output") + sink->extension();
+  }
+  else
+  {
+    agent_args::set_output_file(output_file_option, sink->extension());
+  }
+
+  if (end_to_end)
+  {
+    // End-to-end runs have a single point, hit by Stop() when the program finishes
+    progress_points.clear();
+    struct ProgressPoint end_to_end_point;
+    end_to_end_point.name = "end-to-end";
+    progress_points.push_back(end_to_end_point);
+  }
+  publishProgressPoints();
+
+  if (summary_file.empty())
+  {
+    summary_file = ResultSummary::path_for(kOutputFile);
+  }
+  // The summary of results appended to an earlier run's covers both runs
+  struct stat output_stat;
+  bool appending = stat(kOutputFile.c_str(), &output_stat) == 0 && output_stat.st_size > 0;
+
+  // Writes the header (e.g. the column names of the .csv output file)
+  if (!result_writer.open(kOutputFile, sink))
+  {
+    agent_args::report_error(fmt::format("Unable to open output file: {}", kOutputFile).c_str());
+  }
+  if (!result_writer.moved_to().empty())
+  {
+    logger->warn("{} has other columns than this agent writes, it was moved to {}", kOutputFile, result_writer.moved_to());
+    appending = false;
+  }
+  if (appending && !result_summary.load(summary_file))
   {
-    kOutputFile = "jcoz-output.csv";
+    logger->warn("{} is not a summary file, it will be replaced by a summary of this run only", summary_file);
   }
+  last_summary_save = std::chrono::steady_clock::now();
+  symbolizer.init(jvmti, &Profiler::getClassName, &Profiler::write_named_results);
 
-  // Set up column names for .csv data output file
-  std::stringstream column_names;
-  column_names << "selectedClassLineNo" << "," << "speedup" << "," << "duration" << "," << "effectiveDuration" << "," << "progressPointHits" << "\n";
-  std::ofstream output_file;
-  output_file.open(kOutputFile.data(), std::ios_base::app);
-  output_file << column_names.rdbuf();
-  output_file.close();
+  if (!session_file.empty())
+  {
+    std::string error;
+    if (!session.load(session_file, error))
+    {
+      agent_args::report_error(error.c_str());
+    }
+    // Experiment ids go on from the last run, as its results may be in the same output file
+    current_experiment.id = session.experiment_id;
+    if (session.experiment_time > 0 && !fix_exp)
+    {
+      experiment_time = std::min(std::max(session.experiment_time, (unsigned long)MIN_EXP_TIME), (unsigned long)MAX_EXP_TIME);
+    }
+    logger->info("Resuming session {}: {} classes, experiment {}, experiment time {}ms", session_file,
+                 session.classes.size(), session.experiment_id, experiment_time);
+  }
 
   const char *const delim = ", ";
 
+  std::stringstream joint_progress_points;
+  for (auto i = progress_points.begin(); i != progress_points.end(); i++)
+  {
+    joint_progress_points << i->name << delim;
+  }
+
   std::stringstream joint_search_scopes;
   std::copy(search_scopes.begin(), search_scopes.end(), std::ostream_iterator<std::string>(joint_search_scopes, delim));
 
@@ -233,58 +506,220 @@ void Profiler::ParseOptions(const char *options)
             std::ostream_iterator<std::string>(joint_ignored_scopes, delim));
 
   logger->info("Profiler arguments:\n"
-               "\tprogress point: {}:{}\n"
+               "\tprogress points: {}\n"
                "\tsearch scopes: {}\n"
                "\tignored scopes: {}\n"
                "\twarmup: {}us\n"
                "\tend-to-end: {}\n"
                "\tfixed experiment duration: {}\n"
+               "\tconfidence: {}\n"
+               "\tline samples: {}\n"
+               "\ttimer sampling: {}\n"
+               "\tfast startup: {}\n"
+               "\texplore: {}\n"
+               "\tparallel lines: {}\n"
+               "\toutput file: {} ({})\n"
                "\tLogging level: {}",
-               progress_class, progress_point->lineno, joint_search_scopes.str(), joint_ignored_scopes.str(),
-               warmup_time, end_to_end, fix_exp, spdlog::level::to_string_view(logger->level()));
-  if (search_scopes.empty() || (!end_to_end && (progress_class.empty() || progress_point->lineno == -1)))
+               joint_progress_points.str(), joint_search_scopes.str(), joint_ignored_scopes.str(),
+               warmup_time, end_to_end, fix_exp, confidence, line_samples, timer_sampling, fast_startup, explore_fraction, parallel_lines, kOutputFile, output_format, spdlog::level::to_string_view(logger->level()));
+  if (search_scopes.empty() || progress_points.empty())
   {
     agent_args::report_error("Missing package, progress class, or progress point");
   }
+  if (confidence > 0 && (fix_exp || end_to_end))
+  {
+    agent_args::report_error("confidence cannot be combined with fix-exp or end-to-end");
+  }
 }
 
-/**
- * Wrapper function for sleeping
- */
-inline long jcoz_sleep(long nanoseconds)
+bool Profiler::ParseAttachOptions(const char *options)
 {
+  agent_args::throw_errors = true;
+  try
+  {
+    ParseOptions(options);
+  }
+  catch (const std::exception &e)
+  {
+    logger->error("Invalid agent options: {}", e.what());
+    agent_args::throw_errors = false;
+    return false;
+  }
+  agent_args::throw_errors = false;
+  return true;
+}
 
-  if (nanoseconds == 0L)
+std::string Profiler::updateOptions(const std::string &options)
+{
+  if (_running)
   {
-    return 0L;
+    return "stop profiling before changing options";
   }
 
-  struct timespec temp_rem, temp_req;
-  memset(&temp_rem, 0, sizeof(struct timespec));
-  memset(&temp_req, 0, sizeof(struct timespec));
-  temp_req.tv_nsec = nanoseconds;
+  std::vector<std::string> new_search_scopes;
+  std::vector<std::string> new_ignored_scopes;
+  std::vector<struct ProgressPoint> new_points;
+  bool scopes_changed = false;
+  bool points_changed = false;
+
+  // Parse into the new values first, so an invalid option changes nothing
+  std::vector<struct ProgressPoint> old_points;
+  old_points.swap(progress_points);
+  agent_args::throw_errors = true;
+  try
+  {
+    std::stringstream ss(options);
+    std::string item;
+    while (std::getline(ss, item, '_'))
+    {
+      size_t equal_index = item.find('=');
+      std::string option = item.substr(0, equal_index);
+      std::string value = equal_index == std::string::npos ? "" : item.substr(equal_index + 1);
+      std::stringstream values(value);
+      std::string element;
+      switch (agent_args::from_string(option))
+      {
+      case _search_scopes:
+        while (std::getline(values, element, '|'))
+        {
+          prepare_scope(element);
+          new_search_scopes.push_back(element);
+        }
+        scopes_changed = true;
+        break;
+
+      case _ignored_scopes:
+        while (std::getline(values, element, '|'))
+        {
+          prepare_scope(element);
+          new_ignored_scopes.push_back(element);
+        }
+        scopes_changed = true;
+        break;
 
-  auto start = std::chrono::high_resolution_clock::now();
+      case _progress_point:
+        while (std::getline(values, element, '|'))
+        {
+          parse_progress_point(element, _throughput_point);
+        }
+        points_changed = true;
+        break;
+
+      case _latency_point:
+        while (std::getline(values, element, '|'))
+        {
+          size_t comma_index = element.find(',');
+          if (comma_index == std::string::npos)
+            agent_args::report_error("Latency point must be a begin and end point separated by ','");
+          std::string begin = element.substr(0, comma_index);
+          std::string end = element.substr(comma_index + 1);
+          parse_progress_point(begin, _latency_begin_point);
+          parse_progress_point(end, _latency_end_point);
+          progress_points[progress_points.size() - 2].pair_index = progress_points.size() - 1;
+          progress_points[progress_points.size() - 1].pair_index = progress_points.size() - 2;
+        }
+        points_changed = true;
+        break;
+
+      default:
+        agent_args::report_error(fmt::format("Option cannot be changed at runtime: {}", option).c_str());
+      }
+    }
+    if (scopes_changed && new_search_scopes.empty())
+      agent_args::report_error("Missing package");
+  }
+  catch (const std::exception &e)
+  {
+    agent_args::throw_errors = false;
+    progress_points.swap(old_points);
+    return e.what();
+  }
+  agent_args::throw_errors = false;
+  new_points.swap(progress_points);
+  progress_points.swap(old_points);
+
+  if (points_changed && end_to_end)
+  {
+    return "progress points cannot change in end_to_end mode";
+  }
+  if (points_changed)
+  {
+    clearProgressPoints();
+    progress_points.swap(new_points);
+    publishProgressPoints();
+    logger->info("Progress points changed to {}", options);
+  }
+  if (scopes_changed)
+  {
+    search_scopes.clear();
+    ignored_scopes.clear();
+    scope_trie.clear();
+    for (auto scope = new_search_scopes.begin(); scope != new_search_scopes.end(); scope++)
+      add_search_scope(*scope);
+    for (auto scope = new_ignored_scopes.begin(); scope != new_ignored_scopes.end(); scope++)
+      add_ignored_scope(*scope);
+    logger->info("Scopes changed to {}", options);
+  }
+  return "";
+}
+
+void Profiler::parse_progress_point(std::string &value, progress_point_type type)
+{
+  if (progress_points.size() >= MAX_PROGRESS_POINTS)
+    agent_args::report_error(fmt::format("Too many progress points, at most {} are supported", MAX_PROGRESS_POINTS).c_str());
+
+  struct ProgressPoint point;
+  point.name = value;
+  point.type = type;
 
-  int err = -1;
-  do
+  // A name without a line number is a point hit through the jcoz.Progress API
+  size_t colon_index = value.find(':');
+  if (colon_index == std::string::npos)
   {
-    err = nanosleep(&temp_req, &temp_rem);
-    temp_req.tv_nsec = temp_rem.tv_nsec;
+    if (value.empty())
+      agent_args::report_error("Missing progress point");
+
+    point.api = true;
+    progress_points.push_back(point);
+    return;
+  }
+
+  if (!breakpoints_available)
+    agent_args::report_error(fmt::format("Progress point {} needs breakpoints, which this JVM does not offer after an attach; use jcoz.Progress instead", value).c_str());
 
-  } while (err == -1);
+  point.class_name = value.substr(0, colon_index);
+  try
+  {
+    point.lineno = std::stoi(value.substr(colon_index + 1));
+  }
+  catch (const std::logic_error &e)
+  {
+    point.lineno = -1;
+  }
+  if (point.class_name.empty() || point.lineno == -1)
+    agent_args::report_error("Missing progress class, or progress point");
 
-  auto end = std::chrono::high_resolution_clock::now();
-  nanoseconds_type total_sleep = (end - start);
+  progress_points.push_back(point);
+}
 
-  return total_sleep.count();
+/**
+ * Inserts a virtual speedup delay, returns the delay to account for it.
+ * The agent thread's ticks use DelayEngine::sleep, they must not spin
+ */
+inline long jcoz_sleep(long nanoseconds)
+{
+  return delay_engine.delay(nanoseconds);
 }
 
 void Profiler::init()
 {
-  progress_point = new ProgressPoint();
-  progress_point->lineno = -1;
-  progress_point->method_id = nullptr;
+  progress_points.clear();
+  publishProgressPoints();
+}
+
+void Profiler::publishProgressPoints()
+{
+  published_points.publish(new std::vector<struct ProgressPoint>(progress_points));
 }
 
 jvmtiEnv *Profiler::getJVMTI()
@@ -304,25 +739,49 @@ bool Profiler::isRunning()
 
 void Profiler::setProgressPoint(std::string class_name, jint line_no)
 {
-  this->progress_class = class_name;
-  this->progress_point->lineno = line_no;
+  struct ProgressPoint point;
+  point.name = fmt::format("{}:{}", class_name, line_no);
+  point.class_name = class_name;
+  point.lineno = line_no;
+  progress_points.push_back(point);
+  publishProgressPoints();
 }
 
-void Profiler::signal_user_threads()
+/**
+ * Sums the hits of every progress point over all user threads,
+ * including the threads that have already ended
+ */
+void Profiler::sum_points_hit(long *totals)
 {
-  while (!__sync_bool_compare_and_swap(&user_threads_lock, 0, 1))
-    ;
-  std::atomic_thread_fence(std::memory_order_acquire);
-  int thread_number = 0;
-  for (auto i = user_threads.begin(); i != user_threads.end(); i++)
+  // The counters of a slot outlive its threads, so summing every slot ever
+  // allocated needs no lock and neither misses nor double counts hits
+  for (int i = 0; i < MAX_PROGRESS_POINTS; i++)
   {
-    std::atomic_thread_fence(std::memory_order_acquire);
-    int error_code = pthread_kill((*i)->thread, SIGPROF);
-    thread_number += 1;
-    std::atomic_thread_fence(std::memory_order_release);
+    totals[i] = exited_points_hit[i].load(std::memory_order_relaxed);
   }
-  user_threads_lock = 0;
-  std::atomic_thread_fence(std::memory_order_release);
+  size_t num_points = progress_points.size();
+  user_threads.for_each_slot([totals, num_points](struct UserThread *ut)
+                             {
+                               for (size_t j = 0; j < num_points; j++)
+                               {
+                                 totals[j] += ut->points_hit[j].load(std::memory_order_relaxed);
+                               }
+                             });
+}
+
+void Profiler::signal_user_threads()
+{
+  // Each user thread is signalled by its own CPU time timer
+  if (timer_sampling)
+    return;
+
+  // A thread may exit right after its slot was seen as active. Its kernel
+  // thread id then no longer exists (tgkill fails), or in the unlikely case
+  // it was reused, the signal reaches a thread that is not a user thread and
+  // ignores it
+  pid_t pid = getpid();
+  user_threads.for_each_active([pid](struct UserThread *ut)
+                               { syscall(SYS_tgkill, pid, ut->tid, SIGPROF); });
 }
 
 /**
@@ -350,7 +809,8 @@ float Profiler::calculate_random_speedup()
 void Profiler::update_experiment_length()
 {
   // Fixed experiment length => no need to update experiment length
-  if (fix_exp)
+  // Confidence based length => every experiment ends on its own
+  if (fix_exp || confidence > 0)
     return;
 
   if (current_experiment.points_hit <= HITS_TO_INC_EXP_TIME)
@@ -373,436 +833,1614 @@ void Profiler::update_experiment_length()
 void Profiler::runExperiment(JNIEnv *jni_env)
 {
   logger->info("Running experiment");
-  in_experiment = true;
-  points_hit = 0;
+  long start_hits[MAX_PROGRESS_POINTS];
+  sum_points_hit(start_hits);
+  current_experiment.id++;
 
-  current_experiment.speedup = calculate_random_speedup();
-  current_experiment.delay =
-      (long)(current_experiment.speedup * SIGNAL_FREQ);
+  // Every line gets its own random speedup, independent of the other lines
+  current_experiment.method_filter = 0;
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    struct ExperimentLine &line = current_experiment.lines[i];
+    current_experiment.method_filter |= method_filter_bit(line.method_id);
+    for (int j = 0; j < line.num_methods; j++)
+    {
+      current_experiment.method_filter |= method_filter_bit(line.methods[j]);
+    }
+    line.speedup = line.assigned_speedup >= 0 ? line.assigned_speedup : calculate_random_speedup();
+    line.delay = (long)(line.speedup * sample_interval);
+  }
+  in_experiment.store(true, std::memory_order_release);
 
+  // With a confidence target the experiment runs until the progress point
+  // rate is known precisely enough. Hits are roughly Poisson, so the relative
+  // half-width of the rate's confidence interval after n hits is z / sqrt(n)
+  long target_hits = 0;
   milliseconds_type duration(experiment_time);
+  if (confidence > 0)
+  {
+    target_hits = (long)std::ceil(std::pow(CONFIDENCE_Z / confidence, 2));
+    duration = milliseconds_type(MAX_EXP_TIME);
+  }
   auto start = std::chrono::high_resolution_clock::now();
   auto end = start + duration;
+  auto min_end = start + milliseconds_type(MIN_ADAPTIVE_EXP_TIME);
+  long iterations = 0;
 
-  while (_running && ((end_to_end && (points_hit == 0)) || (std::chrono::high_resolution_clock::now() < end)))
+  long check_iterations = std::max(1L, CONFIDENCE_CHECK_INTERVAL_MS * 1000000L / sample_interval);
+
+  while (_running && ((end_to_end && (exited_points_hit[0] == start_hits[0])) || (std::chrono::high_resolution_clock::now() < end)))
   {
-    jcoz_sleep(SIGNAL_FREQ);
+    DelayEngine::sleep(sample_interval);
 
     signal_user_threads();
+    payRunningThreads(jni_env);
 
+    if (target_hits > 0 && ++iterations % check_iterations == 0 &&
+        std::chrono::high_resolution_clock::now() >= min_end && min_points_hit_since(start_hits) >= target_hits)
+    {
+      break;
+    }
   }
 
-  jcoz_sleep(SIGNAL_FREQ);
+  DelayEngine::sleep(sample_interval);
   // memory barrier to ensure that `in_experiment` is false before the user threads are signalled again
   std::atomic_thread_fence(std::memory_order_acquire);
   in_experiment = false;
   std::atomic_thread_fence(std::memory_order_release);
   signal_user_threads();
-  jcoz_sleep(SIGNAL_FREQ);
+  DelayEngine::sleep(sample_interval);
 
   // TODO this is to avoid calling up to a synchronized java method, resulting in a deadlock,
   //  this might still be a race condition with Stop()
   if (!_running)
   {
-    delete[] current_experiment.location_ranges;
+    // Other JVMs may run the claimed lines right away
+    report_coordinated_lines(false);
     return;
   }
 
   auto expEnd = std::chrono::high_resolution_clock::now();
+  long end_hits[MAX_PROGRESS_POINTS];
+  sum_points_hit(end_hits);
 
   current_experiment.delay = global_delay;
-  current_experiment.points_hit = points_hit;
-  points_hit = 0;
+  current_experiment.points_hit = LONG_MAX;
+  for (int i = 0; i < progress_points.size(); i++)
+  {
+    current_experiment.point_hits[i] = end_hits[i] - start_hits[i];
+    current_experiment.points_hit = std::min(current_experiment.points_hit, current_experiment.point_hits[i]);
+    if (progress_points[i].type == _latency_begin_point)
+    {
+      // Little's law needs the number of visits in flight between the two points
+      current_experiment.in_flight[i] = start_hits[i] - start_hits[progress_points[i].pair_index];
+    }
+  }
   current_experiment.duration = (expEnd - start).count();
   global_delay = 0;
-
-  char *sig = getClassFromMethodIDLocation(current_experiment.method_id);
-  // throw out bad samples
-  if (sig == NULL)
-    return;
-  cleanSignature(sig);
+  report_coordinated_lines(true);
 
   // Maybe update the experiment length
   Profiler::update_experiment_length();
 
-  bci_hits::add_hit(sig, current_experiment.method_id, current_experiment.lineno, current_experiment.bci);
+  // Results are recorded under the raw method id, the resolver thread names
+  // them (and logs them) without holding up the next experiment
+  std::vector<PendingResult> results(current_experiment.num_lines);
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    struct ExperimentLine &line = current_experiment.lines[i];
+    count_line_speedup(line);
+    update_region_stats(line);
 
-  // Log the run experiment results
-  logger->info(
-      "Ran experiment: [class: {class}:{line_no}] [speedup: {speedup}] [points hit: {points_hit}] [delay: {delay}] [duration: {duration}] [new exp time: {exp_time}]",
-      fmt::arg("exp_time", experiment_time), fmt::arg("speedup", current_experiment.speedup), fmt::arg("points_hit", current_experiment.points_hit),
-      fmt::arg("delay", current_experiment.delay), fmt::arg("duration", current_experiment.duration), fmt::arg("class", sig),
-      fmt::arg("line_no", current_experiment.lineno));
-  logger->flush();
-  // Append the experiment results to the output file
-  std::stringstream experiment_data;
-  long effectiveDuration = current_experiment.duration - current_experiment.delay;
-  experiment_data << sig << ":" << current_experiment.lineno << "," << current_experiment.speedup << "," << current_experiment.duration << "," << effectiveDuration << "," << current_experiment.points_hit << "\n";
-  std::ofstream output_file;
-  output_file.open(kOutputFile.data(), std::ios_base::app);
-  output_file << experiment_data.rdbuf();
-  output_file.close();
+    if (line.region == _line_region)
+    {
+      bci_hits::add_hit(line.method_id, line.lineno, line.bci);
+    }
 
-  delete[] current_experiment.location_ranges;
+    struct PendingResult &result = results[i];
+    result.experiment_id = current_experiment.id;
+    result.method_id = line.method_id;
+    switch (line.region)
+    {
+    case _method_region:
+      result.lineno = Symbolizer::kMethodRegionLine;
+      break;
+    case _class_region:
+      result.lineno = Symbolizer::kClassRegionLine;
+      break;
+    default:
+      result.lineno = line.lineno;
+    }
+    result.summary = fmt::format(
+        "[speedup: {speedup}] [points hit: {points_hit}] [delay: {delay}] [duration: {duration}] [new exp time: {exp_time}]",
+        fmt::arg("exp_time", experiment_time), fmt::arg("speedup", line.speedup),
+        fmt::arg("points_hit", current_experiment.points_hit), fmt::arg("delay", current_experiment.delay),
+        fmt::arg("duration", current_experiment.duration));
+    write_experiment_results(line, result.records);
+  }
+  symbolizer.submit(results);
 
-  logger->debug("Finished experiment, flushed logs, and deleted current location ranges.");
+  logger->debug("Finished experiment and flushed logs.");
 }
 
-// == and < operators for JVMPICallFrame - needed for sort and unique
-bool operator<(const JVMPI_CallFrame &lhs, const JVMPI_CallFrame &rhs)
+/**
+ * Returns the hits of the least hit progress point since `start_hits` was taken
+ */
+long Profiler::min_points_hit_since(const long *start_hits)
 {
-  if (lhs.method_id == rhs.method_id)
-  {
-    return lhs.lineno < rhs.lineno;
-  }
-  else
+  long curr_hits[MAX_PROGRESS_POINTS];
+  sum_points_hit(curr_hits);
+  long min_hits = LONG_MAX;
+  for (int i = 0; i < progress_points.size(); i++)
   {
-    return lhs.method_id < rhs.method_id;
+    min_hits = std::min(min_hits, curr_hits[i] - start_hits[i]);
   }
+  return min_hits;
 }
 
-bool operator==(const JVMPI_CallFrame &lhs, const JVMPI_CallFrame &rhs)
+void Profiler::count_line_speedup(const struct ExperimentLine &line)
 {
-  return lhs.method_id == rhs.method_id && lhs.lineno == rhs.lineno;
+  // With parallel-lines, the rate is that of all the lines sped up together
+  // (and the delay that of all of them), which is not a result of this line
+  // at its speedup alone. The records of the experiment share its id, so its
+  // lines can be told apart offline
+  if (current_experiment.num_lines != 1)
+    return;
+  long effective_duration = current_experiment.duration - current_experiment.delay;
+  if ((line_samples == 0 && session_file.empty()) || effective_duration <= 0)
+    return;
+
+  std::vector<SpeedupBin> &bins = line_speedups[std::make_pair(line.method_id, line.lineno)];
+  bins.resize(NUM_SPEEDUPS);
+  SpeedupBin &bin = bins[std::lround(line.speedup * (NUM_SPEEDUPS - 1))];
+  bin.experiments++;
+  bin.rate_sum += current_experiment.points_hit * 1e9 / effective_duration;
 }
 
-void JNICALL
-Profiler::runAgentThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args)
+/**
+ * A line is saturated once it ran `line_samples` experiments at every speedup,
+ * further experiments would hardly change its speedup curve
+ */
+bool Profiler::line_saturated(jmethodID method_id, jint lineno)
 {
-  srand(time(NULL));
-  global_delay = 0;
-  startup_time = std::chrono::high_resolution_clock::now().time_since_epoch();
-  agent_pthread = pthread_self();
-  while (!__sync_bool_compare_and_swap(&user_threads_lock, 0, 1))
-    ;
-  std::atomic_thread_fence(std::memory_order_acquire);
-  user_threads.erase(curr_ut);
-  curr_ut = NULL;
-  user_threads_lock = 0;
-  std::atomic_thread_fence(std::memory_order_release);
-  if (warmup_time != 0)
+  if (line_samples == 0)
+    return false;
+
+  auto bins = line_speedups.find(std::make_pair(method_id, lineno));
+  if (bins == line_speedups.end())
+    return false;
+  for (auto bin = bins->second.begin(); bin != bins->second.end(); bin++)
   {
-    std::this_thread::sleep_for(std::chrono::microseconds(warmup_time));
+    if (bin->experiments < line_samples)
+      return false;
   }
-  prof_ready = true;
+  return true;
+}
 
-  while (_running)
+/**
+ * Adds the results of one line (or region) of the current experiment to `records`,
+ * one record for each throughput point and one for each latency point pair
+ */
+void Profiler::write_experiment_results(struct ExperimentLine &line, std::vector<ResultRecord> &records)
+{
+  struct ResultRecord record;
+  record.experiment_id = current_experiment.id;
+  record.speedup = line.speedup;
+  record.duration = current_experiment.duration;
+  record.effective_duration = current_experiment.duration - current_experiment.delay;
+  for (int i = 0; i < progress_points.size(); i++)
   {
-    logger->debug("Starting new agent thread _running loop...");
-    // 30 * SIGNAL_FREQ with randomization should give us roughly
-    // the same number of iterations as doing 20 * SIGNAL_FREQ without
-    // randomization.
-    long total_needed_time = 30 * SIGNAL_FREQ;
-    long total_accrued_time = 0;
-    while (total_accrued_time < total_needed_time)
+    struct ProgressPoint &point = progress_points[i];
+    // The end of a latency point is reported on the record of its begin point
+    if (point.type == _latency_end_point)
+      continue;
+
+    record.hits = current_experiment.point_hits[i];
+    record.latency = point.type == _latency_begin_point;
+    if (record.latency)
     {
-      // Sleep some randomized time to avoid bias in the profiler.
-      long curr_sleep = 2 * SIGNAL_FREQ - (rand() % SIGNAL_FREQ);
-      jcoz_sleep(curr_sleep);
-      signal_user_threads();
-      total_accrued_time += curr_sleep;
-      logger->trace("Slept for {sleep_time} time. {remaining_time} Remaining.",
-                    fmt::arg("sleep_time", curr_sleep),
-                    fmt::arg("remaining_time", total_needed_time - total_accrued_time));
+      struct ProgressPoint &end_point = progress_points[point.pair_index];
+      record.progress_point = point.name + "-" + end_point.name;
+      record.departures = current_experiment.point_hits[point.pair_index];
+      record.in_flight = current_experiment.in_flight[i];
     }
-
-    // Copy shared and unsafe static_call_frames to variable
-    // that is local for the profiler thread, so it's enough
-    // to synchronize on copying here and clearing later.
-    // Any other code between these actions does not require
-    // to be locked, too, since this lock is intended
-    // to protect static_call_frames only.
-    while (!__sync_bool_compare_and_swap(&frame_lock, 0, 1))
-      ;
-    std::atomic_thread_fence(std::memory_order_acquire);
-    for (int i = 0; (i < call_index) && (i < NUM_STATIC_CALL_FRAMES); i++)
+    else
     {
-      call_frames.push_back(static_call_frames[i]);
+      record.progress_point = point.name;
+      record.departures = 0;
+      record.in_flight = 0;
     }
-    frame_lock = 0;
-    std::atomic_thread_fence(std::memory_order_release);
-
-    // Filter `call_frames` such that it only contains unique JVMPI_CallFrames
-    if (call_frames.size() > 0)
-    {
-      call_index = 0;
-      logger->trace("Profiler::runAgentThread() - Found {} call frames", call_frames.size());
-      std::sort(call_frames.begin(), call_frames.end());
-      auto last = std::unique(call_frames.begin(), call_frames.end());
-      call_frames.erase(last, call_frames.end());
-      logger->trace("Profiler::runAgentThread() - Found {} unique call frames", call_frames.size());
-      std::random_shuffle(call_frames.begin(), call_frames.end());
-      JVMPI_CallFrame exp_frame;
-      jint num_entries;
-      jvmtiLineNumberEntry *entries = NULL;
-      for (int i = 0; i < call_frames.size(); i++)
+    records.push_back(record);
+  }
+}
+
+void Profiler::write_named_results(std::vector<PendingResult> &results)
+{
+  std::vector<ResultRecord> records;
+  for (auto result = results.begin(); result != results.end(); result++)
+  {
+    logger->info("Ran experiment {}: [selected: {}] {}", result->experiment_id, result->name, result->summary);
+    records.insert(records.end(), result->records.begin(), result->records.end());
+  }
+  logger->flush();
+  result_writer.write(records);
+
+  std::lock_guard<std::mutex> guard(summary_lock);
+  result_summary.add(records);
+  if (std::chrono::steady_clock::now() - last_summary_save >= milliseconds_type(SUMMARY_INTERVAL_MS))
+  {
+    save_summary();
+  }
+}
+
+// Must be called with summary_lock held
+void Profiler::save_summary()
+{
+  if (!result_summary.save(summary_file))
+  {
+    logger->error("Unable to write summary file {} (errno {})", summary_file, errno);
+  }
+  last_summary_save = std::chrono::steady_clock::now();
+}
+
+void Profiler::flushResults()
+{
+  if (!symbolizer.flush(SYMBOLIZER_FLUSH_TIMEOUT_MS))
+  {
+    logger->warn("Results were not all named within {}ms, writing the rest under their method ids", SYMBOLIZER_FLUSH_TIMEOUT_MS);
+  }
+  result_writer.flush();
+}
+
+void JNICALL
+Profiler::runResolverThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args)
+{
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(args);
+  // Like the agent thread, the resolver thread must not be profiled
+  removeUserThread(NULL);
+  symbolizer.run(jni_env);
+}
+
+void JNICALL
+Profiler::runAgentThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args)
+{
+  srand(time(NULL));
+  global_delay = 0;
+  startup_time = std::chrono::high_resolution_clock::now().time_since_epoch();
+  agent_pthread = pthread_self();
+  // The agent thread must not sample itself
+  if (curr_ut != NULL)
+  {
+    struct UserThread *agent_ut = curr_ut;
+    stop_sampling_timer(agent_ut);
+    curr_ut = NULL;
+    agent_stats::spin_lock(&user_threads_lock, 1, agent_stats::_user_threads_lock);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    user_threads.release(agent_ut);
+    user_threads_lock = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  if (warmup_time != 0)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(warmup_time));
+  }
+  prof_ready = true;
+  int batch_experiments = 0;
+  auto last_stats = std::chrono::steady_clock::now();
+  auto last_session_save = last_stats;
+  auto last_memory_check = last_stats;
+
+  while (_running)
+  {
+    logger->debug("Starting new agent thread _running loop...");
+    if (std::chrono::steady_clock::now() - last_stats >= milliseconds_type(STATS_INTERVAL_MS))
+    {
+      emit_stats();
+      last_stats = std::chrono::steady_clock::now();
+    }
+    if (std::chrono::steady_clock::now() - last_memory_check >= milliseconds_type(MEMORY_CHECK_INTERVAL_MS))
+    {
+      maintain_memory();
+      last_memory_check = std::chrono::steady_clock::now();
+    }
+    if (!session_file.empty())
+    {
+      apply_session_seeds();
+      if (std::chrono::steady_clock::now() - last_session_save >= milliseconds_type(SESSION_SAVE_INTERVAL_MS))
       {
-        exp_frame = call_frames.at(i);
-        jvmtiError lineNumberError = jvmti->GetLineNumberTable(exp_frame.method_id, &num_entries, &entries);
-        if (lineNumberError == JVMTI_ERROR_NONE)
-        {
-          break;
-        }
-        else
-        {
-          jvmti->Deallocate((unsigned char *)entries);
-        }
+        save_session();
+        last_session_save = std::chrono::steady_clock::now();
       }
+    }
+    if (duty_cycle_experiments > 0 && batch_experiments >= duty_cycle_experiments)
+    {
+      pause_sampling();
+      batch_experiments = 0;
+    }
+
+    // 30 * sample_interval with randomization should give us roughly
+    // the same number of iterations as doing 20 * sample_interval without
+    // randomization.
+    long total_needed_time = 30 * sample_interval;
+    long total_accrued_time = 0;
+    while (total_accrued_time < total_needed_time)
+    {
+      // Sleep some randomized time to avoid bias in the profiler.
+      long curr_sleep = 2 * sample_interval - (rand() % sample_interval);
+      DelayEngine::sleep(curr_sleep);
+      signal_user_threads();
+      total_accrued_time += curr_sleep;
+      logger->trace("Slept for {sleep_time} time. {remaining_time} Remaining.",
+                    fmt::arg("sleep_time", curr_sleep),
+                    fmt::arg("remaining_time", total_needed_time - total_accrued_time));
+    }
+
+    // Move the frames sampled by every user thread during this round
+    // into `call_frames`, which is local to the profiler thread,
+    // and add them to the histogram kept across experiments.
+    collect_call_frames();
+    logger->trace("Profiler::runAgentThread() - Found {} call frames", call_frames.size());
+    sample_histogram.add(call_frames);
+    call_frames.clear();
+    // A burst of samples (e.g. many threads at once) must not keep its memory for the rest of the run
+    if (call_frames.capacity() > 4 * CALL_FRAMES_RESERVE)
+    {
+      std::vector<JVMPI_CallFrame>().swap(call_frames);
+      call_frames.reserve(CALL_FRAMES_RESERVE);
+    }
+
+    if (!sample_histogram.empty())
+    {
+      logger->trace("Profiler::runAgentThread() - Histogram has {} unique call frames", sample_histogram.size());
 
       // If we don't find anything in scope, try again
-      if (entries == NULL)
+      if (!select_experiment_lines(jni_env))
       {
-        // Clear call frames here before we return to the beginning of the while loop and sample for call frames again
-        // Previous comment ... TODO(dcv): Should we clear the call frames here?
-        logger->info("No in scope frames found. Clearing call frames and then trying again.");
-        call_frames.clear();
+        logger->info("No in scope frames with a line number table found. Sampling again.");
         continue;
       }
-      
-      logger->debug("Found in scope frames. Choosing a frame and running experiment...");
-      current_experiment.method_id = exp_frame.method_id;
-      current_experiment.bci = exp_frame.lineno;
-      jint start_line;
-      jint end_line; // exclusive
-      std::vector<std::pair<jint, jint>> location_ranges;
-
-      for (int i = 1; i <= num_entries; i++)
+
+      if (coordinator.enabled() && !coordinate_experiment_lines())
       {
-        if (i == num_entries || entries[i].start_location > exp_frame.lineno)
-        {
-          current_experiment.lineno = entries[i - 1].line_number;
-          break;
-        }
+        logger->debug("The selected lines are run by other JVMs. Sampling again.");
+        continue;
+      }
+
+      logger->debug("Found {} lines in scope. Running experiment...", current_experiment.num_lines);
+
+      runExperiment(jni_env);
+      batch_experiments++;
+
+      // Older samples count for less in the next selections
+      sample_histogram.decay(HISTOGRAM_DECAY_FACTOR, HISTOGRAM_MIN_WEIGHT);
+    }
+    else
+    {
+      logger->debug("No frames found in agent thread. Trying sampling loop again...");
+    }
+  }
+
+  logger->info("Profiler done running");
+  emit_stats();
+  profile_done = true;
+}
+
+agent_stats::Snapshot Profiler::collect_stats()
+{
+  agent_stats::Snapshot snapshot;
+  user_threads.for_each_slot([&snapshot](struct UserThread *ut)
+                             {
+                               ut->stats.add_to(snapshot);
+                               snapshot.dropped_samples += ut->samples.dropped();
+                             });
+  agent_stats::add_shared(snapshot);
+  add_memory_usage(snapshot);
+  return snapshot;
+}
+
+void Profiler::add_memory_usage(agent_stats::Snapshot &snapshot)
+{
+  snapshot.memory_budget_bytes = memory_budget;
+  snapshot.memory_bytes[agent_stats::_in_scope_ids_memory] = in_scope_ids.memory_bytes();
+  snapshot.memory_bytes[agent_stats::_class_names_memory] = class_names.memory_bytes();
+  snapshot.memory_bytes[agent_stats::_line_tables_memory] = line_tables.memory_bytes();
+  snapshot.memory_bytes[agent_stats::_sample_histogram_memory] = sample_histogram.memory_bytes();
+  snapshot.memory_bytes[agent_stats::_bci_hits_memory] = bci_hits::memory_bytes();
+  snapshot.memory_bytes[agent_stats::_symbols_memory] = symbolizer.cache_bytes();
+  snapshot.memory_bytes[agent_stats::_call_frames_memory] = call_frames.capacity() * sizeof(JVMPI_CallFrame);
+
+  // Nodes of a std::map hold three pointers and a color besides the value
+  unsigned long method_state = line_speedups.size() *
+                               (sizeof(decltype(line_speedups)::value_type) + 4 * sizeof(void *) + NUM_SPEEDUPS * sizeof(SpeedupBin));
+  method_state += agent_stats::hash_map_bytes(method_regions);
+  method_state += agent_stats::hash_map_bytes(method_keys);
+  for (auto key = method_keys.begin(); key != method_keys.end(); key++)
+    method_state += agent_stats::string_bytes(key->second);
+  method_state += agent_stats::hash_map_bytes(session_methods);
+  for (auto names = session_methods.begin(); names != session_methods.end(); names++)
+    method_state += agent_stats::string_bytes(names->second.first) + agent_stats::string_bytes(names->second.second);
+  snapshot.memory_bytes[agent_stats::_method_state_memory] = method_state;
+}
+
+/**
+ * Finds the in scope methods whose class was unloaded, by asking JVMTI about
+ * every one of them (a cleared jmethodID is reported as invalid), and drops
+ * them everywhere. Their bytecode index hits are logged and their session
+ * state kept first, their results were written when their experiments ended.
+ */
+size_t Profiler::evict_unloaded_methods()
+{
+  std::vector<jmethodID> methods;
+  class_names.methods(methods);
+  std::vector<jmethodID> stale;
+  for (auto method = methods.begin(); method != methods.end(); method++)
+  {
+    jint modifiers;
+    if (jvmti->GetMethodModifiers(*method, &modifiers) == JVMTI_ERROR_INVALID_METHODID)
+      stale.push_back(*method);
+  }
+  if (stale.empty())
+    return 0;
+
+  std::unordered_set<jmethodID> stale_set(stale.begin(), stale.end());
+  logger->info("Evicting {} methods of unloaded classes", stale.size());
+  // Results still queued are named from the cache before it forgets them
+  symbolizer.flush(SYMBOLIZER_FLUSH_TIMEOUT_MS);
+  log_bci_hits(&stale_set);
+  if (!session_file.empty())
+    add_session_state(unloaded_session, &stale_set);
+
+  in_scope_ids.remove(stale);
+  class_names.remove(stale);
+  line_tables.invalidate((jint)stale.size(), stale.data());
+  sample_histogram.remove_methods(stale_set);
+  bci_hits::remove_methods(stale_set);
+  symbolizer.evict(stale_set);
+  for (auto method = stale.begin(); method != stale.end(); method++)
+  {
+    method_regions.erase(*method);
+    method_keys.erase(*method);
+    session_methods.erase(*method);
+  }
+  for (auto line = line_speedups.begin(); line != line_speedups.end();)
+  {
+    if (stale_set.count(line->first.first) > 0)
+      line = line_speedups.erase(line);
+    else
+      line++;
+  }
+  agent_stats::record_evictions(stale.size());
+  return stale.size();
+}
+
+void Profiler::maintain_memory()
+{
+  // Tables replaced since the last check are freed once no signal handler reads them
+  in_scope_ids.reclaim();
+  published_points.reclaim();
+
+  static unsigned long swept_unloads = 0;
+  unsigned long unloads = classes_unloaded.load(std::memory_order_relaxed);
+  bool swept = unloads != swept_unloads;
+  if (swept)
+  {
+    swept_unloads = unloads;
+    evict_unloaded_methods();
+  }
+  if (memory_budget == 0)
+    return;
+
+  static bool over_budget_warned = false;
+  static auto last_budget_sweep = std::chrono::steady_clock::time_point();
+  agent_stats::Snapshot snapshot;
+  add_memory_usage(snapshot);
+  // Not every JVM posts ClassUnload, tables over budget may just hold stale
+  // methods. Sweeping asks JVMTI about every method, so not at every check
+  if (snapshot.total_memory_bytes() > memory_budget && !swept &&
+      std::chrono::steady_clock::now() - last_budget_sweep >= milliseconds_type(STATS_INTERVAL_MS))
+  {
+    last_budget_sweep = std::chrono::steady_clock::now();
+    if (evict_unloaded_methods() > 0)
+      add_memory_usage(snapshot);
+  }
+  if (snapshot.total_memory_bytes() <= memory_budget)
+  {
+    over_budget_warned = false;
+    return;
+  }
+
+  // Over budget, the tables that are rebuilt as needed (or only logged) and
+  // take more than a quarter of the budget are cut, the others are left alone
+  // so they are not emptied at every check when the rest does not fit
+  unsigned long share = memory_budget / 4;
+  if (snapshot.memory_bytes[agent_stats::_line_tables_memory] > share)
+  {
+    logger->debug("Over the memory budget, dropping {}KB of line number tables",
+                  snapshot.memory_bytes[agent_stats::_line_tables_memory] / 1024);
+    line_tables.clear();
+    agent_stats::record_memory_trim();
+  }
+  if (snapshot.memory_bytes[agent_stats::_sample_histogram_memory] > share && !sample_histogram.empty())
+  {
+    // Down to half its share, so it does not need trimming again right away
+    size_t frame_bytes = std::max<size_t>(snapshot.memory_bytes[agent_stats::_sample_histogram_memory] / sample_histogram.size(), 1);
+    size_t max_frames = std::max<size_t>(share / 2 / frame_bytes, MIN_HISTOGRAM_FRAMES);
+    logger->debug("Over the memory budget, keeping the {} heaviest of {} sampled lines",
+                  max_frames, sample_histogram.size());
+    sample_histogram.trim(max_frames);
+    agent_stats::record_memory_trim();
+  }
+  if (snapshot.memory_bytes[agent_stats::_bci_hits_memory] > share)
+  {
+    logger->debug("Over the memory budget, logging and dropping {}KB of bytecode index hits",
+                  snapshot.memory_bytes[agent_stats::_bci_hits_memory] / 1024);
+    log_bci_hits(NULL);
+    bci_hits::clear();
+    agent_stats::record_memory_trim();
+  }
+
+  add_memory_usage(snapshot);
+  if (snapshot.total_memory_bytes() > memory_budget && !over_budget_warned)
+  {
+    logger->warn("{}KB of tables are over the memory budget of {}KB, the rest is needed to profile the in scope methods",
+                 snapshot.total_memory_bytes() / 1024, memory_budget / 1024);
+    over_budget_warned = true;
+  }
+}
+
+void Profiler::emit_stats()
+{
+  agent_stats::Snapshot snapshot = collect_stats();
+  long uptime_ms = std::chrono::duration_cast<milliseconds_type>(
+                       std::chrono::high_resolution_clock::now().time_since_epoch() - startup_time)
+                       .count();
+  logger->info("{}", agent_stats::format(snapshot, uptime_ms));
+  if (!stats_file.empty() && !agent_stats::write_json(stats_file, snapshot, uptime_ms))
+  {
+    logger->error("Unable to write stats file {} (errno {})", stats_file, errno);
+  }
+}
+
+/**
+ * Selects the frame of the next experiment from the sample histogram and
+ * returns the (cached) line number table of its method. Frames whose line
+ * number table is not available are dropped from the histogram.
+ */
+std::shared_ptr<const MethodLineTable> Profiler::select_experiment_frame(JVMPI_CallFrame &exp_frame)
+{
+  for (int i = 0; i < MAX_FRAME_SELECTION_ATTEMPTS; i++)
+  {
+    if (!sample_histogram.select(explore_fraction, exp_frame))
+    {
+      break;
+    }
+
+    std::shared_ptr<const MethodLineTable> line_table = line_tables.get(jvmti, exp_frame.method_id);
+    if (line_table->available)
+    {
+      return line_table;
+    }
+    sample_histogram.remove(exp_frame);
+  }
+  return std::shared_ptr<const MethodLineTable>();
+}
+
+/**
+ * Selects up to `parallel_lines` distinct lines for the next experiment.
+ * Returns false if no line could be selected.
+ */
+bool Profiler::select_experiment_lines(JNIEnv *jni_env)
+{
+  current_experiment.num_lines = 0;
+  // Frames of lines that are already selected are drawn again, so allow a few more draws
+  for (int i = 0; i < parallel_lines * MAX_FRAME_SELECTION_ATTEMPTS && current_experiment.num_lines < parallel_lines; i++)
+  {
+    JVMPI_CallFrame exp_frame;
+    std::shared_ptr<const MethodLineTable> line_table = select_experiment_frame(exp_frame);
+    if (!line_table)
+    {
+      break;
+    }
+    switch (granularity)
+    {
+    case _line_granularity:
+      add_experiment_line(jni_env, exp_frame, *line_table);
+      break;
+    case _method_granularity:
+      add_experiment_method(exp_frame);
+      break;
+    case _class_granularity:
+      add_experiment_class(jni_env, exp_frame);
+      break;
+    case _auto_granularity:
+    {
+      auto region = method_regions.find(exp_frame.method_id);
+      if (region == method_regions.end() || region->second.state == _region_pending)
+      {
+        add_experiment_method(exp_frame);
+      }
+      else if (region->second.state == _region_significant)
+      {
+        add_experiment_line(jni_env, exp_frame, *line_table);
+      }
+      else
+      {
+        // Not even the whole method matters, so none of its lines does
+        sample_histogram.remove(exp_frame);
+      }
+      break;
+    }
+    }
+  }
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    current_experiment.lines[i].assigned_speedup = -1;
+    coordinated_lines[i].class_name.clear();
+  }
+  return current_experiment.num_lines > 0;
+}
+
+bool Profiler::coordinate_experiment_lines()
+{
+  std::vector<LineKey> keys;
+  std::vector<int> key_lines;
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    const struct ExperimentLine &line = current_experiment.lines[i];
+    // Whole methods and classes are left to each JVM
+    if (line.region != _line_region)
+      continue;
+    LineKey key;
+    if (!getClassName(line.method_id, key.class_name))
+      continue;
+    auto method_key = method_keys.find(line.method_id);
+    if (method_key == method_keys.end())
+    {
+      JvmtiScopedPtr<char> name(jvmti);
+      JvmtiScopedPtr<char> signature(jvmti);
+      if (jvmti->GetMethodName(line.method_id, name.GetRef(), signature.GetRef(), NULL) != JVMTI_ERROR_NONE)
+        continue;
+      method_key = method_keys.insert(std::make_pair(line.method_id, std::string(name.Get()) + signature.Get())).first;
+    }
+    key.method = method_key->second;
+    key.lineno = line.lineno;
+    keys.push_back(key);
+    key_lines.push_back(i);
+  }
+  std::vector<float> speedups;
+  if (keys.empty() || !coordinator.claim(keys, speedups))
+  {
+    logger->debug("Selecting experiment lines without the coordinator");
+    return true;
+  }
+
+  // Lines run by other JVMs are left out, the others keep their order
+  int kept = 0;
+  size_t next_key = 0;
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    bool claimed = next_key < key_lines.size() && key_lines[next_key] == i;
+    if (claimed && speedups[next_key] < 0)
+    {
+      next_key++;
+      continue;
+    }
+    if (kept != i)
+      current_experiment.lines[kept] = current_experiment.lines[i];
+    if (claimed)
+    {
+      current_experiment.lines[kept].assigned_speedup = speedups[next_key];
+      coordinated_lines[kept] = keys[next_key];
+      next_key++;
+    }
+    kept++;
+  }
+  current_experiment.num_lines = kept;
+  return kept > 0;
+}
+
+void Profiler::report_coordinated_lines(bool ran)
+{
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    if (!coordinated_lines[i].class_name.empty())
+    {
+      // Like count_line_speedup, only a line run on its own is binned by the
+      // coordinator, a duration of 0 just ends the claim
+      long effective_duration = ran && current_experiment.num_lines == 1 ? current_experiment.duration - current_experiment.delay : 0;
+      coordinator.done(coordinated_lines[i], current_experiment.lines[i].speedup, effective_duration,
+                       current_experiment.points_hit);
+      coordinated_lines[i].class_name.clear();
+    }
+  }
+}
+
+/**
+ * Adds the source line containing `exp_frame` to the lines of the current
+ * experiment, and marks the bcis of that line in the line's bitmap.
+ * Returns false if the line is unknown or already part of the experiment.
+ */
+bool Profiler::add_experiment_line(JNIEnv *jni_env, JVMPI_CallFrame &exp_frame, const MethodLineTable &line_table)
+{
+  IMPLICITLY_USE(jni_env);
+  jint lineno = line_table.line_for_bci(exp_frame.lineno);
+  const std::vector<std::pair<jint, jint>> *ranges = line_table.ranges_for_line(lineno);
+  if (ranges == NULL)
+  {
+    logger->debug("No line found for bci {} of the selected frame", exp_frame.lineno);
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    const struct ExperimentLine &other = current_experiment.lines[i];
+    // Regions of an experiment must be disjoint
+    if (other.method_id == exp_frame.method_id && (other.lineno == lineno || other.region != _line_region))
+    {
+      return false;
+    }
+  }
+
+  if (line_saturated(exp_frame.method_id, lineno))
+  {
+    logger->debug("Line {} has enough experiments at every speedup", lineno);
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+
+  struct ExperimentLine &line = current_experiment.lines[current_experiment.num_lines];
+  line.region = _line_region;
+  line.method_id = exp_frame.method_id;
+  line.bci = exp_frame.lineno;
+  line.lineno = lineno;
+  line.num_methods = 0;
+  memset(line.bci_bitmap, 0, sizeof(line.bci_bitmap));
+  for (auto range = ranges->begin(); range != ranges->end(); range++)
+  {
+    for (jint bci = std::max(range->first, 0); bci < range->second && bci <= MAX_BCI; bci++)
+    {
+      line.bci_bitmap[bci >> 6] |= 1ULL << (bci & 63);
+    }
+  }
+  current_experiment.num_lines++;
+  return true;
+}
+
+/**
+ * Adds the whole method of the selected frame to the current experiment
+ */
+bool Profiler::add_experiment_method(JVMPI_CallFrame &exp_frame)
+{
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    if (current_experiment.lines[i].method_id == exp_frame.method_id)
+    {
+      return false;
+    }
+  }
+
+  if (line_saturated(exp_frame.method_id, -1))
+  {
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+
+  struct ExperimentLine &line = current_experiment.lines[current_experiment.num_lines];
+  line.region = _method_region;
+  line.method_id = exp_frame.method_id;
+  line.bci = exp_frame.lineno;
+  line.lineno = -1;
+  line.num_methods = 0;
+  current_experiment.num_lines++;
+  return true;
+}
+
+/**
+ * Adds all the methods of the class declaring the selected frame's method to
+ * the current experiment
+ */
+bool Profiler::add_experiment_class(JNIEnv *jni_env, JVMPI_CallFrame &exp_frame)
+{
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    const struct ExperimentLine &other = current_experiment.lines[i];
+    if (std::binary_search(other.methods, other.methods + other.num_methods, exp_frame.method_id))
+    {
+      return false;
+    }
+  }
+
+  jclass klass;
+  if (jvmti->GetMethodDeclaringClass(exp_frame.method_id, &klass) != JVMTI_ERROR_NONE)
+  {
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+  jint method_count;
+  JvmtiScopedPtr<jmethodID> methods(jvmti);
+  jvmtiError err = jvmti->GetClassMethods(klass, &method_count, methods.GetRef());
+  jni_env->DeleteLocalRef(klass);
+  if (err != JVMTI_ERROR_NONE)
+  {
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+
+  struct ExperimentLine &line = current_experiment.lines[current_experiment.num_lines];
+  line.num_methods = 0;
+  for (jint i = 0; i < method_count && line.num_methods < MAX_REGION_METHODS; i++)
+  {
+    line.methods[line.num_methods++] = methods.Get()[i];
+  }
+  if (line.num_methods == 0)
+  {
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+  // The sampled method is always part of its class region, even in a class
+  // with more than MAX_REGION_METHODS methods
+  if (std::find(line.methods, line.methods + line.num_methods, exp_frame.method_id) == line.methods + line.num_methods)
+  {
+    line.methods[line.num_methods - 1] = exp_frame.method_id;
+  }
+  std::sort(line.methods, line.methods + line.num_methods);
+
+  // Keyed on the first method, which is the same for every frame of the class
+  if (line_saturated(line.methods[0], -2))
+  {
+    sample_histogram.remove(exp_frame);
+    return false;
+  }
+  line.region = _class_region;
+  line.method_id = line.methods[0];
+  line.bci = exp_frame.lineno;
+  line.lineno = -2;
+  current_experiment.num_lines++;
+  return true;
+}
+
+/**
+ * Adds the result of the current experiment to the regression of a method
+ * region, and decides whether its lines are profiled once it ran enough
+ * experiments
+ */
+void Profiler::update_region_stats(const struct ExperimentLine &line)
+{
+  long effective_duration = current_experiment.duration - current_experiment.delay;
+  if (line.region != _method_region || effective_duration <= 0)
+    return;
+
+  RegionStats &stats = method_regions[line.method_id];
+  double x = line.speedup;
+  double y = (double)current_experiment.points_hit / effective_duration;
+  stats.experiments++;
+  stats.sum_x += x;
+  stats.sum_y += y;
+  stats.sum_xx += x * x;
+  stats.sum_xy += x * y;
+  classify_region(line.method_id, stats);
+}
+
+void Profiler::classify_region(jmethodID method_id, RegionStats &stats)
+{
+  if (stats.state != _region_pending || stats.experiments < DRILL_DOWN_MIN_EXPERIMENTS)
+    return;
+
+  double n = stats.experiments;
+  double variance = stats.sum_xx - stats.sum_x * stats.sum_x / n;
+  if (variance <= 0)
+    return;
+  double slope = (stats.sum_xy - stats.sum_x * stats.sum_y / n) / variance;
+  double intercept = (stats.sum_y - slope * stats.sum_x) / n;
+  // Throughput gained by a 100% speedup, relative to no speedup
+  double effect = intercept > 0 ? slope / intercept : 0;
+  stats.state = effect >= DRILL_DOWN_MIN_EFFECT ? _region_significant : _region_insignificant;
+  logger->info("Method {} has an estimated effect of {:.3f}: {}", (void *)method_id, effect,
+               stats.state == _region_significant ? "profiling its lines" : "not profiling its lines");
+}
+
+void Profiler::collect_call_frames()
+{
+  // Rings of exited threads are drained as well, consecutive owners of a
+  // slot are its (one at a time) producers
+  user_threads.for_each_slot([](struct UserThread *ut)
+                             { ut->samples.drain(call_frames); });
+}
+
+// Matches `text` against `pattern`, in which `*` matches any (possibly empty) sequence of characters
+static bool pattern_matches(const char *pattern, const char *text)
+{
+  const char *star = NULL;
+  const char *star_text = NULL;
+  while (*text != '\0')
+  {
+    if (*pattern == '*')
+    {
+      star = pattern++;
+      star_text = text;
+    }
+    else if (*pattern == *text)
+    {
+      pattern++;
+      text++;
+    }
+    else if (star != NULL)
+    {
+      pattern = star + 1;
+      text = ++star_text;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  while (*pattern == '*')
+    pattern++;
+  return *pattern == '\0';
+}
+
+static bool any_pattern_matches(const std::vector<std::string> &patterns, const char *text)
+{
+  for (auto pattern = patterns.begin(); pattern != patterns.end(); pattern++)
+  {
+    if (pattern_matches(pattern->c_str(), text))
+      return true;
+  }
+  return false;
+}
+
+enum thread_decision
+{
+  _thread_undecided,
+  _thread_included,
+  _thread_excluded,
+};
+
+// A thread is added on its ThreadStart event and may be tried again when it
+// pops a frame after an attach, its name and group are only looked up once
+static thread_local thread_decision curr_thread_decision = _thread_undecided;
+
+bool Profiler::thread_included(jthread thread)
+{
+  if (curr_thread_decision != _thread_undecided)
+  {
+    return curr_thread_decision == _thread_included;
+  }
+
+  jvmtiThreadInfo info;
+  jvmtiError err = jvmti->GetThreadInfo(thread, &info);
+  if (err != JVMTI_ERROR_NONE)
+  {
+    if (err == JVMTI_ERROR_WRONG_PHASE)
+    {
+      return false;
+    }
+    else
+    {
+      logger->critical("JVMTI::GetThreadInfo returned unhandled JVMTIError. Exiting program.");
+      exit(1);
+    }
+  }
+  JvmtiScopedPtr<char> thread_name(jvmti, info.name);
+  JNIEnv *jni_env = Accessors::CurrentJniEnv();
+
+  bool included = info.name != NULL && any_pattern_matches(thread_patterns, info.name);
+  if (!included && !thread_group_patterns.empty() && info.thread_group != NULL)
+  {
+    jvmtiThreadGroupInfo thread_grp;
+    err = jvmti->GetThreadGroupInfo(info.thread_group, &thread_grp);
+    if (err != JVMTI_ERROR_NONE && err != JVMTI_ERROR_WRONG_PHASE)
+    {
+      logger->critical("JVMTI::GetThreadGroupInfo returned unhandled JVMTIError. Exiting program.");
+      exit(1);
+    }
+    if (err == JVMTI_ERROR_NONE)
+    {
+      JvmtiScopedPtr<char> group_name(jvmti, thread_grp.name);
+      included = thread_grp.name != NULL && any_pattern_matches(thread_group_patterns, thread_grp.name);
+      if (jni_env != NULL && thread_grp.parent != NULL)
+        jni_env->DeleteLocalRef(thread_grp.parent);
+    }
+  }
+
+  // The local references returned by GetThreadInfo would otherwise only be
+  // freed when the event callback returns
+  if (jni_env != NULL)
+  {
+    if (info.thread_group != NULL)
+      jni_env->DeleteLocalRef(info.thread_group);
+    if (info.context_class_loader != NULL)
+      jni_env->DeleteLocalRef(info.context_class_loader);
+  }
+
+  logger->debug("Thread {} is {}", info.name == NULL ? "<unnamed>" : info.name, included ? "profiled" : "not profiled");
+  curr_thread_decision = included ? _thread_included : _thread_excluded;
+  return included;
+}
+
+/**
+ * Sleeps for the idle phase of the duty cycle. No thread is signalled and the
+ * sampling timers are disarmed, so profiling costs nothing until it resumes.
+ * The histogram is kept, older samples keep decaying with every experiment.
+ */
+void Profiler::pause_sampling()
+{
+  logger->debug("Pausing sampling for {}ms", duty_cycle_idle_ms);
+  agent_stats::spin_lock(&user_threads_lock, 1, agent_stats::_user_threads_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  sampling_paused = true;
+  user_threads.for_each_active([](struct UserThread *ut)
+                               { arm_sampling_timer(ut, 0); });
+  user_threads_lock = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // Sleep in slices so Stop() does not wait for the whole idle phase
+  auto end = std::chrono::steady_clock::now() + milliseconds_type(duty_cycle_idle_ms);
+  while (_running && std::chrono::steady_clock::now() < end)
+  {
+    std::this_thread::sleep_for(std::min(milliseconds_type(DUTY_CYCLE_SLEEP_SLICE_MS),
+                                         std::chrono::duration_cast<milliseconds_type>(end - std::chrono::steady_clock::now())));
+  }
+  resume_sampling();
+}
+
+void Profiler::resume_sampling()
+{
+  agent_stats::spin_lock(&user_threads_lock, 1, agent_stats::_user_threads_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  sampling_paused = false;
+  user_threads.for_each_active([](struct UserThread *ut)
+                               { arm_sampling_timer(ut, sample_interval); });
+  user_threads_lock = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  logger->debug("Resumed sampling");
+}
+
+/**
+ * Sets the period of the sampling timer of a thread, 0 disarms it.
+ */
+void Profiler::arm_sampling_timer(struct UserThread *user_thread, long interval)
+{
+  if (!user_thread->has_sampling_timer)
+  {
+    return;
+  }
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_interval.tv_sec = interval / 1000000000L;
+  spec.it_interval.tv_nsec = interval % 1000000000L;
+  spec.it_value = spec.it_interval;
+  if (timer_settime(user_thread->sampling_timer, 0, &spec, NULL) != 0)
+  {
+    logger->error("Unable to set sampling timer of user thread (errno {})", errno);
+  }
+}
+
+/**
+ * Arms a timer on the CPU time of the calling thread that delivers SIGPROF to
+ * that thread every sample_interval nanoseconds, so threads sample themselves
+ * and blocked threads are never signalled. The timer stays disarmed while
+ * sampling is paused. Called with the user threads lock held, so it cannot
+ * miss a pause or resume.
+ */
+void Profiler::start_sampling_timer(struct UserThread *user_thread)
+{
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+#ifndef sigev_notify_thread_id
+  sev._sigev_un._tid = syscall(SYS_gettid);
+#else
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+#endif
+
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &user_thread->sampling_timer) != 0)
+  {
+    logger->error("Unable to create sampling timer for user thread (errno {}). Thread will not be sampled", errno);
+    return;
+  }
+
+  user_thread->has_sampling_timer = true;
+  if (!sampling_paused)
+  {
+    arm_sampling_timer(user_thread, sample_interval);
+  }
+}
+
+void Profiler::stop_sampling_timer(struct UserThread *user_thread)
+{
+  if (user_thread->has_sampling_timer)
+  {
+    timer_delete(user_thread->sampling_timer);
+    user_thread->has_sampling_timer = false;
+  }
+}
+
+void Profiler::addUserThread(jthread thread)
+{
+  if (thread_included(thread))
+  {
+    logger->debug("Adding user thread");
+    struct UserThread *ut = user_threads.acquire();
+    if (ut == NULL)
+    {
+      logger->warn("More than {} user threads, thread will not be profiled", THREAD_SLAB_SIZE * MAX_THREAD_SLABS);
+      curr_ut = NULL;
+      return;
+    }
+    // A reused slot keeps its counters, samples and stats
+    ut->thread = pthread_self();
+    ut->tid = syscall(SYS_gettid);
+    ut->local_delay = global_delay;
+    ut->paying_delay = false;
+    ut->block_delay = 0;
+    ut->block_experiment = -1;
+    ut->owes_delay.store(false, std::memory_order_relaxed);
+    ut->suspended_delay.store(0, std::memory_order_relaxed);
+    JNIEnv *jni_env = Accessors::CurrentJniEnv();
+    ut->java_thread = jni_env != NULL && thread != NULL ? (jthread)jni_env->NewGlobalRef(thread) : NULL;
+    ut->has_sampling_timer = false;
+
+    // user threads lock
+    agent_stats::spin_lock(&user_threads_lock, 1, agent_stats::_user_threads_lock);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (timer_sampling)
+    {
+      start_sampling_timer(ut);
+    }
+    user_threads.publish(ut);
+    user_threads_lock = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    curr_ut = ut;
+  }
+  else
+  {
+    curr_ut = NULL;
+  }
+}
+
+void Profiler::removeUserThread(jthread thread)
+{
+  if (curr_ut != NULL)
+  {
+    logger->debug("Removing user thread");
+    stop_sampling_timer(curr_ut);
+
+    payOwedDelay();
+
+    // Frames and progress point hits the agent thread has not collected yet
+    // stay in the slot, the agent thread collects them from every slot
+    struct UserThread *exited_ut = curr_ut;
+    curr_ut = NULL;
+    agent_stats::spin_lock(&user_threads_lock, 1, agent_stats::_user_threads_lock);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    user_threads.release(exited_ut);
+    // Under the lock, so the agent thread never takes a reference to it after this
+    if (exited_ut->java_thread != NULL)
+    {
+      Accessors::CurrentJniEnv()->DeleteGlobalRef(exited_ut->java_thread);
+      exited_ut->java_thread = NULL;
+    }
+    user_threads_lock = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+}
+
+/**
+ * Sleeps for the delay inserted into other threads that the current thread
+ * has not been delayed by yet, or, if the current thread is ahead, makes the
+ * other threads owe its extra delay
+ */
+void Profiler::payOwedDelay()
+{
+  struct UserThread *ut = curr_ut;
+  if (ut == NULL || ut->paying_delay || !in_experiment)
+  {
+    return;
+  }
+  ut->paying_delay = true;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+
+  ut->local_delay += ut->suspended_delay.exchange(0, std::memory_order_relaxed);
+  ut->owes_delay.store(false, std::memory_order_relaxed);
+  long sleep_diff = global_delay - ut->local_delay;
+  if (sleep_diff > 0)
+  {
+    long start = agent_stats::now();
+    ut->local_delay += jcoz_sleep(sleep_diff);
+    agent_stats::record_delay(sleep_diff, agent_stats::now() - start);
+  }
+  else
+  {
+    global_delay += std::labs(sleep_diff);
+  }
+
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  ut->paying_delay = false;
+}
+
+/**
+ * JVMTI suspends a thread where it holds no JVM internal locks and does not
+ * hold up a safepoint, so a thread kept suspended pays its delay as safely
+ * as in a JVMTI event. A thread suspended while in native code only stops
+ * when it returns to Java, it is credited the delay all the same
+ */
+void Profiler::payRunningThreads(JNIEnv *jni_env)
+{
+  if (!suspend_available)
+  {
+    return;
+  }
+
+  struct Debtor
+  {
+    struct UserThread *ut;
+    unsigned int generation;
+    jthread thread;
+  };
+  // Only used by the agent thread, kept to save the allocations
+  static std::vector<Debtor> debtors;
+  static std::vector<DelayEngine::Debt> debts;
+  debtors.clear();
+  debts.clear();
+
+  agent_stats::spin_lock(&user_threads_lock, 1, agent_stats::_user_threads_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  user_threads.for_each_active([jni_env](struct UserThread *ut)
+                               {
+                                 if (ut->java_thread != NULL && ut->owes_delay.exchange(false, std::memory_order_relaxed))
+                                 {
+                                   debtors.push_back({ut, ut->generation.load(std::memory_order_acquire),
+                                                      (jthread)jni_env->NewLocalRef(ut->java_thread)});
+                                 } });
+  user_threads_lock = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (size_t i = 0; i < debtors.size(); i++)
+  {
+    Debtor &debtor = debtors[i];
+    if (debtor.thread == NULL || jvmti->SuspendThread(debtor.thread) != JVMTI_ERROR_NONE)
+    {
+      continue;
+    }
+    // Read while it is suspended. Its slot may belong to another thread by
+    // now, or it may be paying in a JVMTI event it was suspended in
+    struct UserThread *ut = debtor.ut;
+    long owed = global_delay - ut->local_delay - ut->suspended_delay.load(std::memory_order_relaxed);
+    if (ut->generation.load(std::memory_order_acquire) != debtor.generation || ut->paying_delay || owed <= 0)
+    {
+      jvmti->ResumeThread(debtor.thread);
+      continue;
+    }
+    debts.push_back({owed, i});
+  }
+
+  DelayEngine::pay_suspended(debts, [](const DelayEngine::Debt &debt, long paid)
+                             {
+                               // Credited before it runs again, while its slot is still its own
+                               debtors[debt.index].ut->suspended_delay.fetch_add(paid, std::memory_order_relaxed);
+                               jvmti->ResumeThread(debtors[debt.index].thread);
+                               agent_stats::record_delay(debt.owed, paid); });
+
+  for (auto debtor = debtors.begin(); debtor != debtors.end(); debtor++)
+  {
+    if (debtor->thread != NULL)
+    {
+      jni_env->DeleteLocalRef(debtor->thread);
+    }
+  }
+}
+
+void Profiler::preBlock()
+{
+  payOwedDelay();
+  struct UserThread *ut = curr_ut;
+  if (ut == NULL)
+  {
+    return;
+  }
+  ut->block_experiment = in_experiment ? current_experiment.id : -1;
+  ut->block_delay = global_delay;
+}
+
+void Profiler::postBlock(bool woken)
+{
+  struct UserThread *ut = curr_ut;
+  if (ut == NULL || !in_experiment)
+  {
+    return;
+  }
+
+  // After a timeout, the delays inserted meanwhile are still owed
+  if (woken && ut->block_experiment == current_experiment.id)
+  {
+    ut->local_delay += global_delay - ut->block_delay;
+  }
+  else if (woken)
+  {
+    // Blocked since before this experiment started, so all of its delay was inserted meanwhile
+    ut->local_delay = global_delay;
+  }
+  // Still in the JVMTI event that ended the block
+  payOwedDelay();
+}
+
+/**
+ * Returns the line of the current experiment that contains `curr_frame`, or NULL
+ */
+inline const struct ExperimentLine *Profiler::experimentLine(JVMPI_CallFrame &curr_frame)
+{
+  // Native frames have a negative lineno
+  jint bci = curr_frame.lineno;
+  if (bci < 0 || !(current_experiment.method_filter & method_filter_bit(curr_frame.method_id)))
+  {
+    return NULL;
+  }
+
+  for (int i = 0; i < current_experiment.num_lines; i++)
+  {
+    const struct ExperimentLine &line = current_experiment.lines[i];
+    switch (line.region)
+    {
+    case _line_region:
+      if (curr_frame.method_id == line.method_id && bci <= MAX_BCI && ((line.bci_bitmap[bci >> 6] >> (bci & 63)) & 1))
+        return &line;
+      break;
+    case _method_region:
+      if (curr_frame.method_id == line.method_id)
+        return &line;
+      break;
+    case _class_region:
+      if (std::binary_search(line.methods, line.methods + line.num_methods, curr_frame.method_id))
+        return &line;
+      break;
+    }
+  }
+  return NULL;
+}
+
+bool inline Profiler::frameInScope(const MethodIdSet::Reader &in_scope, JVMPI_CallFrame &curr_frame)
+{
+  return in_scope.contains((void *)curr_frame.method_id);
+}
+
+void Profiler::addInScopeMethods(jint method_count, jmethodID *methods)
+{
+  logger->debug("Adding {:d} in scope methods\n", method_count);
+  in_scope_ids.insert(method_count, methods);
+}
+
+void Profiler::clearInScopeMethods()
+{
+  logger->debug("Clearing current in scope methods.");
+  in_scope_ids.clear();
+}
+
+/**
+ * Sets a breakpoint for every progress point declared in the class with the
+ * signature `class_sig` (format `LMain;`) that has not been set yet
+ */
+void Profiler::addProgressPoints(char *class_sig, jint method_count, jmethodID *methods)
+{
+  if (end_to_end)
+  {
+    return;
+  }
+
+  for (int p = 0; p < progress_points.size(); p++)
+  {
+    struct ProgressPoint &point = progress_points[p];
+    // Only ever set each progress point once
+    if (point.api || point.method_id != nullptr)
+    {
+      continue;
+    }
+
+    if (!is_progress_class(point, class_sig))
+    {
+      continue;
+    }
+    logger->debug("Setting progress point {} - class matches", point.name);
+
+    for (int i = 0; i < method_count && point.method_id == nullptr; i++)
+    {
+      jint entry_count;
+      JvmtiScopedPtr<jvmtiLineNumberEntry> entries(jvmti);
+      jvmtiError err = jvmti->GetLineNumberTable(methods[i], &entry_count, entries.GetRef());
+      if (err != JVMTI_ERROR_NONE)
+      {
+        printf("Error getting line number entry table in addProgressPoints. Error: %d\n", err);
+
+        continue;
       }
 
-      for (int i = 0; i < num_entries; i++)
+      for (int j = 0; j < entry_count; j++)
       {
-        if (entries[i].line_number == current_experiment.lineno)
+        jvmtiLineNumberEntry curr_entry = entries.Get()[j];
+        jint curr_lineno = curr_entry.line_number;
+        if (curr_lineno == point.lineno)
         {
-          if (i < num_entries - 1)
-          {
-            location_ranges.push_back(
-                std::pair<jint, jint>(entries[i].start_location,
-                                      entries[i + 1].start_location));
-          }
-          else
-          {
-            location_ranges.push_back(
-                std::pair<jint, jint>(entries[i].start_location,
-                                      MAX_BCI + 1));
-          }
+          point.location = curr_entry.start_location;
+          point.method_id = methods[i];
+          // HandleBreakpoint matches on the published copy
+          publishProgressPoints();
+          jvmti->SetBreakpoint(methods[i], point.location);
+          logger->info("Progress point {} set", point.name);
+          break;
         }
       }
-
-      current_experiment.num_ranges = location_ranges.size();
-      current_experiment.location_ranges =
-          new std::pair<jint, jint>[location_ranges.size()];
-      for (int i = 0; i < location_ranges.size(); i++)
-      {
-        current_experiment.location_ranges[i] = location_ranges[i];
-      }
-      call_index = 0;
-
-      runExperiment(jni_env);
-
-      call_frames.clear();
-
-      // Synchronize on clearing shared static_call_frames
-      while (!__sync_bool_compare_and_swap(&frame_lock, 0, 1))
-        ;
-      std::atomic_thread_fence(std::memory_order_acquire);
-      memset(static_call_frames, 0, NUM_STATIC_CALL_FRAMES * sizeof(JVMPI_CallFrame));
-      frame_lock = 0;
-      std::atomic_thread_fence(std::memory_order_release);
-
-      jvmti->Deallocate((unsigned char *)entries);
-      logger->trace("Finished clearing frames and deallocating entries...");
-    }
-    else
-    {
-      logger->debug("No frames found in agent thread. Trying sampling loop again...");
     }
-  }
 
-  logger->info("Profiler done running");
-  profile_done = true;
-}
-
-bool Profiler::thread_in_main(jthread thread)
-{
-  jvmtiThreadInfo info;
-  jvmtiError err = jvmti->GetThreadInfo(thread, &info);
-  if (err != JVMTI_ERROR_NONE)
-  {
-    if (err == JVMTI_ERROR_WRONG_PHASE)
-    {
-      return false;
-    }
-    else
+    if (point.method_id == nullptr)
     {
-      logger->critical("JVMTI::GetThreadInfo returned unhandled JVMTIError. Exiting program.");
+      logger->critical("Progress point {} not set - check that correct line number has been passed on cli. Exiting program", point.name);
       exit(1);
     }
   }
+}
 
-  jvmtiThreadGroupInfo thread_grp;
-  err = jvmti->GetThreadGroupInfo(info.thread_group, &thread_grp);
-  if (err != JVMTI_ERROR_NONE)
+int Profiler::findProgressPoint(jmethodID method_id, jlocation location)
+{
+  RcuSnapshot<std::vector<struct ProgressPoint>>::Reader points(published_points);
+  for (int i = 0; i < points->size(); i++)
   {
-    if (err == JVMTI_ERROR_WRONG_PHASE)
-    {
-      return false;
-    }
-    else
+    if ((*points)[i].method_id == method_id && (*points)[i].location == location)
     {
-      logger->critical("JVMTI::GetThreadGroupInfo returned unhandled JVMTIError. Exiting program.");
-      exit(1);
+      return i;
     }
   }
+  return -1;
+}
 
-  return !strcmp(thread_grp.name, "main");
+bool Profiler::is_progress_class(const struct ProgressPoint &point, const char *class_sig)
+{
+  // The class name is in the format "LMain" whereas the signature is in the format "LMain;"
+  size_t class_name_len = point.class_name.length();
+  return strncmp(class_sig, point.class_name.c_str(), class_name_len) == 0 && strcmp(class_sig + class_name_len, ";") == 0;
 }
 
-void Profiler::addUserThread(jthread thread)
+bool Profiler::needsMethodIDs(const char *class_sig)
 {
-  if (thread_in_main(thread))
+  if (isInScope(class_sig) || strcmp(class_sig, kLockSupportSignature) == 0)
   {
-    logger->debug("Adding user thread");
-    curr_ut = new struct UserThread();
-    curr_ut->thread = pthread_self();
-    curr_ut->local_delay = global_delay;
-    curr_ut->java_thread = thread;
-    curr_ut->points_hit = 0;
-
-    // user threads lock
-    while (!__sync_bool_compare_and_swap(&user_threads_lock, 0, 1))
-      ;
-    std::atomic_thread_fence(std::memory_order_acquire);
-    user_threads.insert(curr_ut);
-    user_threads_lock = 0;
-    std::atomic_thread_fence(std::memory_order_release);
+    return true;
   }
-  else
+  for (auto point = progress_points.begin(); point != progress_points.end(); point++)
   {
-    curr_ut = NULL;
+    if (!point->api && point->method_id == nullptr && is_progress_class(*point, class_sig))
+    {
+      return true;
+    }
   }
+  return false;
 }
 
-void Profiler::removeUserThread(jthread thread)
+void Profiler::addBlockingMethods(char *class_sig, jint method_count, jmethodID *methods)
 {
-  if (curr_ut != NULL)
+  if (strcmp(class_sig, kLockSupportSignature) != 0)
   {
-    logger->debug("Removing user thread");
-    points_hit += curr_ut->points_hit;
-    curr_ut->points_hit = 0;
+    return;
+  }
+
+  for (int i = 0; i < method_count && num_blocking_methods < MAX_BLOCKING_METHODS; i++)
+  {
+    // The class may be seen both when it is prepared and among the loaded classes,
+    // and again when profiling is restarted after its breakpoints were cleared
+    const struct BlockingMethod *known = findBlockingMethod(methods[i]);
+    if (known != NULL)
+    {
+      if (!known->breakpoint_set && jvmti->SetBreakpoint(methods[i], 0) == JVMTI_ERROR_NONE)
+      {
+        blocking_methods[known - blocking_methods].breakpoint_set = true;
+      }
+      continue;
+    }
+
+    JvmtiScopedPtr<char> name(jvmti);
+    if (jvmti->GetMethodName(methods[i], name.GetRef(), NULL, NULL) != JVMTI_ERROR_NONE)
+    {
+      continue;
+    }
 
-    long sleep_time = global_delay - curr_ut->local_delay;
-    if (sleep_time > 0)
+    struct BlockingMethod &method = blocking_methods[num_blocking_methods];
+    method.method_id = methods[i];
+    if (strcmp(name.Get(), "park") == 0)
+    {
+      method.type = _park_method;
+    }
+    else if (strcmp(name.Get(), "parkNanos") == 0 || strcmp(name.Get(), "parkUntil") == 0)
+    {
+      method.type = _timed_park_method;
+    }
+    else if (strcmp(name.Get(), "unpark") == 0)
     {
-      jcoz_sleep(std::max(0L, sleep_time));
+      method.type = _unpark_method;
     }
     else
     {
-      global_delay += std::labs(sleep_time);
+      continue;
     }
 
-    // user threads lock
-    while (!__sync_bool_compare_and_swap(&user_threads_lock, 0, 1))
-      ;
-    std::atomic_thread_fence(std::memory_order_acquire);
-    user_threads.erase(curr_ut);
-    user_threads_lock = 0;
-    std::atomic_thread_fence(std::memory_order_release);
-
-    delete curr_ut;
+    // Publish the method before its breakpoint can fire
+    method.breakpoint_set = false;
+    num_blocking_methods++;
+    if (jvmti->SetBreakpoint(methods[i], 0) != JVMTI_ERROR_NONE)
+    {
+      logger->warn("Could not set a breakpoint in LockSupport.{}, its calls are not tracked as blocking", name.Get());
+      continue;
+    }
+    method.breakpoint_set = true;
   }
 }
 
-bool inline Profiler::inExperiment(JVMPI_CallFrame &curr_frame)
+void Profiler::clearBlockingMethods()
 {
-  if (curr_frame.method_id != current_experiment.method_id)
-  {
-    return false;
-  }
-
-  for (int i = 0; i < current_experiment.num_ranges; i++)
+  // The methods stay known, LockSupport is never unloaded
+  int count = num_blocking_methods;
+  for (int i = 0; i < count; i++)
   {
-    if (curr_frame.lineno >= current_experiment.location_ranges[i].first && curr_frame.lineno < current_experiment.location_ranges[i].second)
+    if (blocking_methods[i].breakpoint_set)
     {
-      return true;
+      jvmti->ClearBreakpoint(blocking_methods[i].method_id, 0);
+      blocking_methods[i].breakpoint_set = false;
     }
   }
-  return false;
-}
-
-bool inline Profiler::frameInScope(JVMPI_CallFrame &curr_frame)
-{
-  return in_scope_ids.count((void *)curr_frame.method_id) > 0;
 }
 
-void Profiler::addInScopeMethods(jint method_count, jmethodID *methods)
+const struct BlockingMethod *Profiler::findBlockingMethod(jmethodID method_id)
 {
-  logger->debug("Adding {:d} in scope methods\n", method_count);
-  while (!__sync_bool_compare_and_swap(&in_scope_lock, 0, pthread_self()))
-    ;
-  std::atomic_thread_fence(std::memory_order_acquire);
-  for (int i = 0; i < method_count; i++)
+  int count = num_blocking_methods;
+  for (int i = 0; i < count; i++)
   {
-    void *method = (void *)methods[i];
-    logger->trace("Adding in scope method {}\n", method);
-    in_scope_ids.insert(method);
+    if (blocking_methods[i].method_id == method_id)
+    {
+      return &blocking_methods[i];
+    }
   }
-  in_scope_lock = 0;
-  std::atomic_thread_fence(std::memory_order_release);
-}
-
-void Profiler::clearInScopeMethods()
-{
-  logger->debug("Clearing current in scope methods.");
-  while (!__sync_bool_compare_and_swap(&in_scope_lock, 0, pthread_self()))
-    ;
-  in_scope_ids.clear();
-  in_scope_lock = 0;
+  return NULL;
 }
 
-void Profiler::addProgressPoint(jint method_count, jmethodID *methods)
+int Profiler::findProgressPoint(const char *name)
 {
-  logger->debug("Within Profiler::addProgressPoint");
-  // Only ever set progress point once
-  if (end_to_end || ((progress_point->method_id) != nullptr))
+  RcuSnapshot<std::vector<struct ProgressPoint>>::Reader points(published_points);
+  for (int i = 0; i < points->size(); i++)
   {
-    logger->debug("Progress point has already been set - returning from Profiler::addProgressPoint");
-    return;
+    if ((*points)[i].api && (*points)[i].name == name)
+    {
+      return i;
+    }
   }
+  return -1;
+}
 
-  for (int i = 0; i < method_count; i++)
+void Profiler::hitProgressPoint(int index)
+{
   {
-    jint entry_count;
-    JvmtiScopedPtr<jvmtiLineNumberEntry> entries(jvmti);
-    jvmtiError err = jvmti->GetLineNumberTable(methods[i], &entry_count, entries.GetRef());
-    if (err != JVMTI_ERROR_NONE)
+    RcuSnapshot<std::vector<struct ProgressPoint>>::Reader points(published_points);
+    if (index < 0 || index >= points->size())
     {
-      printf("Error getting line number entry table in addProgressPoint. Error: %d\n", err);
-
-      continue;
+      return;
     }
+  }
+  // Reached from a Breakpoint event or a JNI call, where the thread is in
+  // native code: it holds no JVM internal locks and does not hold up a
+  // safepoint, so this is where threads that never block pay their delays
+  payOwedDelay();
 
-    for (int j = 0; j < entry_count; j++)
-    {
-      jvmtiLineNumberEntry curr_entry = entries.Get()[j];
-      jint curr_lineno = curr_entry.line_number;
-      if (curr_lineno == (progress_point->lineno))
-      {
-        progress_point->method_id = methods[i];
-        progress_point->location = curr_entry.start_location;
-        jvmti->SetBreakpoint(progress_point->method_id, progress_point->location);
-        logger->info("Progress point set");
-        return;
-      }
-    }
+  if (curr_ut != NULL)
+  {
+    // Only this thread writes its counters, so a plain load and store is
+    // enough (no locked instruction); the agent thread only reads them
+    std::atomic<long> &counter = curr_ut->points_hit[index];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+  else
+  {
+    exited_points_hit[index].fetch_add(1, std::memory_order_relaxed);
   }
-  logger->critical("Progress point not set - check that correct line number has been passed on cli. Exiting program");
-  exit(1);
 }
 
 void Profiler::setJNI(JNIEnv *jni)
@@ -818,11 +2456,13 @@ void Profiler::prepare_scope(std::string &scope)
 void Profiler::add_search_scope(std::string &scope)
 {
   search_scopes.push_back(scope);
+  scope_trie.add_search_scope(scope);
 }
 
 void Profiler::add_ignored_scope(std::string &scope)
 {
   ignored_scopes.push_back(scope);
+  scope_trie.add_ignored_scope(scope);
 }
 
 void Profiler::Handle(int signum, siginfo_t *info, void *context)
@@ -842,27 +2482,27 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context)
     return;
   }
 
-  JVMPI_CallTrace trace;
-  JVMPI_CallFrame frames[kMaxFramesToCapture];
-  // We have to set every byte to 0 instead of just initializing the
-  // individual fields, because the structs might be padded, and we
-  // use memcmp on it later.  We can't use memset, because it isn't
-  // async-safe.
-  char *base = reinterpret_cast<char *>(frames);
-  for (char *p = base;
-       p < base + sizeof(JVMPI_CallFrame) * kMaxFramesToCapture; p++)
+  if (curr_ut == NULL)
   {
-    *p = 0;
+    logger->debug("Profiler::Handle - Thread is not a user thread; signal not handled");
+    return;
   }
 
+  agent_stats::HandlerTimer timer(curr_ut->stats);
+
+  JVMPI_CallTrace trace;
+  // Not zeroed: AsyncGetCallTrace fills in the first num_frames frames,
+  // which are the only ones read, and frames are compared field by field
+  JVMPI_CallFrame frames[kMaxFramesToCapture];
   trace.frames = frames;
   trace.env_id = env;
 
   ASGCTType asgct = Asgct::GetAsgct();
-  (*asgct)(&trace, kMaxFramesToCapture, context);
+  (*asgct)(&trace, stack_depth, context);
 
   if (trace.num_frames < 0)
   {
+    curr_ut->stats.record_asgct_error(trace.num_frames);
     int idx = -trace.num_frames;
     if (idx > kNumCallTraceErrors)
     {
@@ -871,73 +2511,75 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context)
     }
   }
 
-  if (!in_experiment)
+  if (!in_experiment.load(std::memory_order_acquire))
   {
-    // lock in scope
     curr_ut->local_delay = 0;
-    bool has_lock = in_scope_lock == pthread_self();
-    if (!has_lock)
-    {
-      while (!__sync_bool_compare_and_swap(&in_scope_lock, 0,
-                                           pthread_self()))
-        ;
-    }
-    std::atomic_thread_fence(std::memory_order_acquire);
-    for (int i = 0; i < trace.num_frames; i++)
+    curr_ut->suspended_delay.store(0, std::memory_order_relaxed);
+    // in_scope_ids is read without a lock, methods added concurrently
+    // by class prepare callbacks become visible on a later sample.
+    // With call_chain_depth > 1 the callers are kept as well, so the line
+    // of a call site can be sped up (i.e. the whole call made faster)
+    MethodIdSet::Reader in_scope(in_scope_ids);
+    // Read once, it may be changed through the control channel
+    int max_kept = std::min(call_chain_depth, MAX_CALL_CHAIN_DEPTH);
+    const JVMPI_CallFrame *kept_frames[MAX_CALL_CHAIN_DEPTH];
+    int kept = 0;
+    for (int i = 0; i < trace.num_frames && kept < max_kept; i++)
     {
       JVMPI_CallFrame &curr_frame = trace.frames[i];
-      if (frameInScope(curr_frame))
+      if (!frameInScope(in_scope, curr_frame))
       {
-        // lock frame lock
-        while (!__sync_bool_compare_and_swap(&frame_lock, 0, 1))
-          ;
-        std::atomic_thread_fence(std::memory_order_acquire);
-        int index = call_index.fetch_add(1);
-        if (index < NUM_STATIC_CALL_FRAMES)
-        {
-          static_call_frames[index] = curr_frame;
-        }
-        frame_lock = 0;
-        std::atomic_thread_fence(std::memory_order_release);
-        break;
+        continue;
+      }
+      // A recursive call counts once per sample. Only the kept frames are
+      // compared, so this is bounded by the call chain depth
+      bool repeated = false;
+      for (int j = 0; j < kept && !repeated; j++)
+      {
+        repeated = kept_frames[j]->method_id == curr_frame.method_id && kept_frames[j]->lineno == curr_frame.lineno;
+      }
+      if (!repeated)
+      {
+        // Only this thread writes to its ring, so no lock is needed
+        curr_ut->samples.push(curr_frame);
+        kept_frames[kept++] = &curr_frame;
       }
     }
-    if (!has_lock)
-    {
-      in_scope_lock = 0;
-    }
-    std::atomic_thread_fence(std::memory_order_release);
   }
   else
   {
-    curr_ut->num_signals_received++;
+    // Every frame is tested, so a line that is a call site is also matched
+    // while its callee runs (the method filter rejects most frames at once)
     for (int i = 0; i < trace.num_frames; i++)
     {
       JVMPI_CallFrame &curr_frame = trace.frames[i];
-      if (inExperiment(curr_frame))
+      const struct ExperimentLine *line = experimentLine(curr_frame);
+      if (line != NULL)
       {
-        curr_ut->local_delay += current_experiment.delay;
+        curr_ut->local_delay += line->delay;
         break;
       }
     }
-
-    if (curr_ut->num_signals_received == 10)
+    // The delay is not paid here: the signal may have interrupted the thread
+    // in the VM or in compiled code that a safepoint waits for, and finding
+    // Java frames does not tell those apart. It stays owed until a JVMTI
+    // event or a progress point pays it (see payOwedDelay), or, if the thread
+    // runs Java code, until the agent thread suspends it (see payRunningThreads).
+    // Only lock-free atomics are used, which are async-signal-safe
+    if (!curr_ut->paying_delay)
     {
-      long sleep_diff = global_delay - curr_ut->local_delay;
-      if (sleep_diff > 0)
+      curr_ut->local_delay += curr_ut->suspended_delay.exchange(0, std::memory_order_relaxed);
+      long owed = global_delay - curr_ut->local_delay;
+      if (owed < 0)
       {
-        curr_ut->local_delay += jcoz_sleep(sleep_diff);
+        // Ahead of the other threads, which now owe its extra delay
+        global_delay += -owed;
       }
-      else
+      else if (owed >= MIN_SUSPEND_DELAY_NS && trace.num_frames > 0)
       {
-        global_delay += std::labs(sleep_diff);
+        curr_ut->owes_delay.store(true, std::memory_order_relaxed);
       }
-
-      curr_ut->num_signals_received = 0;
     }
-
-    points_hit += curr_ut->points_hit;
-    curr_ut->points_hit = 0;
   }
 }
 
@@ -963,11 +2605,184 @@ struct sigaction SignalHandler::SetAction(
 void Profiler::Start()
 {
   logger->info("Starting profiler ...");
+  // Profiling may be restarted through the control channel after Stop()
+  profile_done = false;
+  if (!result_writer.reopen())
+  {
+    logger->error("Unable to open output file: {}", kOutputFile);
+  }
+  else if (!result_writer.moved_to().empty())
+  {
+    logger->warn("{} has other columns than this agent writes, it was moved to {}", kOutputFile, result_writer.moved_to());
+  }
+  delay_engine.calibrate();
+  logger->info("Measured timer slack: {}ns", delay_engine.slack());
   action_for_sigprof_ = handler_.SetAction(&Profiler::Handle);
-  call_frames.reserve(2000);
+  call_frames.reserve(CALL_FRAMES_RESERVE);
   _running = true;
 }
 
+void Profiler::addClassNames(const char *class_sig, jint method_count, jmethodID *methods)
+{
+  std::string class_name(class_sig);
+  cleanSignature(&class_name[0]);
+  class_names.add(class_name.c_str(), method_count, methods);
+  seedSessionMethods(class_name, method_count, methods);
+}
+
+/**
+ * Queues the session state of the methods of a class that was just
+ * prepared. Only classes with state are named method by method.
+ */
+void Profiler::seedSessionMethods(const std::string &class_name, jint method_count, jmethodID *methods)
+{
+  if (session.classes.find(class_name) == session.classes.end())
+    return;
+
+  std::vector<SessionSeed> seeds;
+  for (int i = 0; i < method_count; i++)
+  {
+    JvmtiScopedPtr<char> name(jvmti);
+    JvmtiScopedPtr<char> signature(jvmti);
+    if (jvmti->GetMethodName(methods[i], name.GetRef(), signature.GetRef(), NULL) != JVMTI_ERROR_NONE)
+      continue;
+    struct SessionSeed seed;
+    seed.method_id = methods[i];
+    seed.class_name = class_name;
+    seed.method = std::string(name.Get()) + signature.Get();
+    seed.state = session.find(class_name, seed.method);
+    if (seed.state != NULL)
+      seeds.push_back(seed);
+  }
+
+  agent_stats::spin_lock(&session_lock, 1, agent_stats::_session_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  session_seeds.insert(session_seeds.end(), seeds.begin(), seeds.end());
+  session_lock = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+/**
+ * Adds the queued session state to the experiments of this run, on the agent thread
+ */
+void Profiler::apply_session_seeds()
+{
+  std::vector<SessionSeed> seeds;
+  agent_stats::spin_lock(&session_lock, 1, agent_stats::_session_lock);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  seeds.swap(session_seeds);
+  session_lock = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (auto seed = seeds.begin(); seed != seeds.end(); seed++)
+  {
+    session_methods[seed->method_id] = std::make_pair(seed->class_name, seed->method);
+    for (auto line = seed->state->lines.begin(); line != seed->state->lines.end(); line++)
+    {
+      std::vector<SpeedupBin> &bins = line_speedups[std::make_pair(seed->method_id, (jint)line->first)];
+      bins.resize(NUM_SPEEDUPS);
+      for (size_t i = 0; i < line->second.size() && i < bins.size(); i++)
+      {
+        bins[i].experiments += line->second[i].experiments;
+        bins[i].rate_sum += line->second[i].rate_sum;
+      }
+    }
+    if (seed->state->has_region)
+    {
+      const SessionRegion &region = seed->state->region;
+      RegionStats &stats = method_regions[seed->method_id];
+      stats.experiments += region.experiments;
+      stats.sum_x += region.sum_x;
+      stats.sum_y += region.sum_y;
+      stats.sum_xx += region.sum_xx;
+      stats.sum_xy += region.sum_xy;
+      classify_region(seed->method_id, stats);
+    }
+  }
+}
+
+/**
+ * Writes the loaded session updated with the experiments of this run.
+ * Methods are named from the session or the symbolizer cache, never from JVMTI.
+ */
+void Profiler::save_session()
+{
+  Session saved = session;
+  saved.experiment_time = experiment_time;
+  saved.experiment_id = current_experiment.id;
+  // Live methods come last, so a class loaded again keeps its latest state
+  for (auto klass = unloaded_session.classes.begin(); klass != unloaded_session.classes.end(); klass++)
+  {
+    for (auto method = klass->second.begin(); method != klass->second.end(); method++)
+      saved.classes[klass->first][method->first] = method->second;
+  }
+  add_session_state(saved, NULL);
+
+  if (!saved.save(session_file))
+  {
+    logger->error("Unable to write session file {} (errno {})", session_file, errno);
+  }
+}
+
+void Profiler::add_session_state(Session &target, const std::unordered_set<jmethodID> *methods)
+{
+  // The entry of a method in `target`, NULL if the method has no name yet or is not wanted
+  auto entry_of = [&target, methods](jmethodID method_id) -> SessionMethod *
+  {
+    if (methods != NULL && methods->count(method_id) == 0)
+      return NULL;
+    auto known = session_methods.find(method_id);
+    if (known != session_methods.end())
+      return &target.classes[known->second.first][known->second.second];
+    MethodSymbols symbols;
+    if (!symbolizer.cached(method_id, symbols) || !symbols.valid || symbols.method_name.empty())
+      return NULL;
+    return &target.classes[symbols.class_name][symbols.method_name + symbols.signature];
+  };
+
+  // The state of this run includes what was applied from the session
+  for (auto line = line_speedups.begin(); line != line_speedups.end(); line++)
+  {
+    // Class regions are keyed on their first jmethodID, which means nothing to the next JVM
+    if (line->first.second < -1)
+      continue;
+    SessionMethod *entry = entry_of(line->first.first);
+    if (entry != NULL)
+      entry->lines[line->first.second] = line->second;
+  }
+  for (auto region = method_regions.begin(); region != method_regions.end(); region++)
+  {
+    SessionMethod *entry = entry_of(region->first);
+    if (entry == NULL)
+      continue;
+    entry->has_region = true;
+    entry->region.experiments = region->second.experiments;
+    entry->region.sum_x = region->second.sum_x;
+    entry->region.sum_y = region->second.sum_y;
+    entry->region.sum_xx = region->second.sum_xx;
+    entry->region.sum_xy = region->second.sum_xy;
+  }
+}
+
+bool Profiler::getClassName(jmethodID method_id, std::string &class_name)
+{
+  if (class_names.lookup(method_id, class_name))
+  {
+    return true;
+  }
+
+  // Not recorded when its class was prepared, ask the JVM
+  char *sig = getClassFromMethodIDLocation(method_id);
+  if (sig == NULL)
+  {
+    return false;
+  }
+  JvmtiScopedPtr<char> sig_ptr(jvmti, sig);
+  cleanSignature(sig);
+  class_name = sig;
+  return true;
+}
+
 char *Profiler::getClassFromMethodIDLocation(jmethodID id)
 {
   jclass clazz;
@@ -1016,14 +2831,18 @@ void Profiler::cleanSignature(char *sig)
   }
 }
 
-void Profiler::clearProgressPoint()
+void Profiler::clearProgressPoints()
 {
-  if (!end_to_end && (progress_point->method_id != nullptr))
+  for (auto i = progress_points.begin(); i != progress_points.end(); i++)
   {
-    logger->info("Clearing progress point");
-    jvmti->ClearBreakpoint(progress_point->method_id, progress_point->location);
-    progress_point->method_id = nullptr;
+    if (i->method_id != nullptr)
+    {
+      logger->info("Clearing progress point {}", i->name);
+      jvmti->ClearBreakpoint(i->method_id, i->location);
+      i->method_id = nullptr;
+    }
   }
+  publishProgressPoints();
 }
 
 void Profiler::Stop()
@@ -1036,7 +2855,7 @@ void Profiler::Stop()
   {
     if (end_to_end)
     {
-      points_hit++;
+      exited_points_hit[0]++;
     }
 
     _running = false;
@@ -1047,17 +2866,57 @@ void Profiler::Stop()
 
     logger->info("Profiler finished current cycle...");
   }
+  // Also reached when the control channel stops profiling, so a stopped
+  // agent leaves no breakpoint behind (they are set again on start)
+  clearBlockingMethods();
+  clearProgressPoints();
+  // Redefinitions are not seen while stopped, the tables are read again on start
+  line_tables.clear();
+
+  // Bounded, so a JVM that is going away cannot hold up its exit
+  if (!symbolizer.flush(SYMBOLIZER_FLUSH_TIMEOUT_MS))
+  {
+    logger->warn("Results were not all named within {}ms, writing the rest under their method ids", SYMBOLIZER_FLUSH_TIMEOUT_MS);
+  }
+  result_writer.close();
+  {
+    std::lock_guard<std::mutex> guard(summary_lock);
+    save_summary();
+  }
+  // Lines still claimed by an experiment cut short are freed for the other JVMs
+  coordinator.close();
 
-  std::vector<std::string> hits = bci_hits::create_dump(jvmti);
-  for (std::string &hit : hits)
+  // After the flush, so the methods of the last experiments are named
+  if (!session_file.empty())
   {
-    logger->info("{}", hit);
+    apply_session_seeds();
+    save_session();
   }
+
+  log_bci_hits(NULL);
+  bci_hits::clear();
+  symbolizer.clear_cache();
   clearInScopeMethods();
   signal(SIGPROF, SIG_IGN);
   logger->flush();
 }
 
+void Profiler::log_bci_hits(const std::unordered_set<jmethodID> *methods)
+{
+  // Every method with hits was named for the results, so this needs no JVMTI
+  bci_hits::dump([](jmethodID method_id)
+                 {
+                   MethodSymbols symbols;
+                   if (!symbolizer.cached(method_id, symbols) || !symbols.valid)
+                     return fmt::format("<method {}>", (void *)method_id);
+                   std::string name = Symbolizer::region_name(symbols, Symbolizer::kMethodRegionLine);
+                   return symbols.source_file.empty() ? name : fmt::format("{} ({})", name, symbols.source_file);
+                 },
+                 [](const std::string &hit)
+                 { logger->info("{}", hit); },
+                 methods);
+}
+
 void Profiler::setJVMTI(jvmtiEnv *jvmti_env)
 {
   jvmti = jvmti_env;
@@ -1071,5 +2930,57 @@ Profiler::HandleBreakpoint(
     jmethodID method_id,
     jlocation location)
 {
-  curr_ut->points_hit += in_experiment;
+  int index = findProgressPoint(method_id, location);
+  if (index >= 0)
+  {
+    hitProgressPoint(index);
+    return;
+  }
+
+  const struct BlockingMethod *method = findBlockingMethod(method_id);
+  if (method == NULL || location != 0)
+  {
+    return;
+  }
+  if (method->type == _unpark_method)
+  {
+    // Pay before the parked thread can run, like paying before a monitor is released
+    payOwedDelay();
+  }
+  else if (curr_ut != NULL && in_experiment)
+  {
+    // Parks outside of experiments are not tracked, they would cost a FramePop
+    // event each while nothing is delayed
+    preBlock();
+    // HandleFramePop is called when the park call returns
+    jvmti->NotifyFramePop(thread, 0);
+  }
+}
+
+void JNICALL
+Profiler::HandleFramePop(
+    jvmtiEnv *jvmti,
+    JNIEnv *jni_env,
+    jthread thread,
+    jmethodID method_id,
+    jboolean was_popped_by_exception)
+{
+  // Threads from before the agent attached never had a ThreadStart event.
+  // Only try once, threads outside the main group stay unregistered
+  static thread_local bool registration_attempted = false;
+  if (attached && curr_ut == NULL && !registration_attempted)
+  {
+    registration_attempted = true;
+    // The signal handler and addUserThread need it, as after a ThreadStart event
+    Accessors::SetCurrentJniEnv(jni_env);
+    addUserThread(thread);
+  }
+
+  const struct BlockingMethod *method = findBlockingMethod(method_id);
+  if (method == NULL)
+  {
+    return;
+  }
+  // A timed park may have timed out, rather than being unparked by another thread
+  postBlock(method->type == _park_method);
 }
\ No newline at end of file
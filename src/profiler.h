@@ -20,6 +20,7 @@
  */
 
 #include <signal.h>
+#include <time.h>
 #include <jvmti.h>
 #include <unordered_set>
 #include <unordered_map>
@@ -29,44 +30,206 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 
 #include "globals.h"
 #include "stacktraces.h"
+#include "sample_ring.h"
+#include "method_id_set.h"
+#include "rcu_snapshot.h"
+#include "sample_histogram.h"
+#include "line_table_cache.h"
+#include "result_sink.h"
+#include "scope_trie.h"
+#include "class_name_table.h"
 #include "spdlog/spdlog.h"
+#include "agent_stats.h"
+#include "thread_registry.h"
+#include "symbolizer.h"
+#include "session.h"
+#include "coordinator_client.h"
+#include "result_summary.h"
 #ifdef SPDLOG_VERSION
 #include "spdlog/sinks/basic_file_sink.h"
+#include "spdlog/sinks/rotating_file_sink.h"
 #endif
 
 #ifndef PROFILER_H
 #define PROFILER_H
 
-struct Experiment
+enum region_type
 {
-  long points_hit = 0;
+  _line_region,
+  _method_region,
+  _class_region,
+};
+
+// One of the (disjoint) lines, or whole methods or classes, virtually sped
+// up by an experiment
+struct ExperimentLine
+{
+  region_type region;
   float speedup;
+  // Set by the coordinator, negative to draw a random speedup
+  float assigned_speedup;
+  // Delay added per sample in this line
   long delay;
-  long duration = 0;
+  // The sampled method, -1 as lineno if the region is not a line
   jmethodID method_id;
   jint lineno;
   jint bci;
-  std::pair<jint, jint> *location_ranges;
-  int num_ranges;
+  // Class regions only, the methods of the class, sorted
+  int num_methods;
+  jmethodID methods[MAX_REGION_METHODS];
+  // Bit i is set if bci i belongs to the line. A fixed array rather than
+  // an allocation, so the signal handler never sees freed memory
+  uint64_t bci_bitmap[(MAX_BCI + 1) / 64];
+};
+
+struct Experiment
+{
+  // Identifies the experiment in the output, shared by the records of all its lines
+  long id = 0;
+  // Hits of the least hit progress point, used to update the experiment length
+  long points_hit = 0;
+  // Hits of each progress point during the experiment
+  long point_hits[MAX_PROGRESS_POINTS];
+  // Visits to each latency point that were in flight when the experiment started
+  long in_flight[MAX_PROGRESS_POINTS];
+  // Total delay inserted during the experiment
+  long delay;
+  long duration = 0;
+  // Each line is sped up independently of the others (orthogonal design), so
+  // the effect of one line can be estimated from all the experiments it was in
+  int num_lines = 0;
+  struct ExperimentLine lines[MAX_PARALLEL_LINES];
+  // Bit method_filter_bit(m) is set for the method m of every line, so the
+  // signal handler skips most frames of a stack with a single test
+  uint64_t method_filter = 0;
 };
 
-struct UserThread
+inline uint64_t method_filter_bit(jmethodID method_id)
+{
+  return 1ULL << (((uint64_t)(uintptr_t)method_id * 0x9E3779B97F4A7C15ULL) >> 58);
+}
+
+// A slot of the thread registry, reused by the threads that start after its
+// thread exited. Cache line aligned, so the slots of two threads never share
+// a line
+struct alignas(64) UserThread
 {
   pthread_t thread;
+  // Kernel thread id, which (unlike a pthread_t) can be signalled after the
+  // thread exited without undefined behaviour
+  pid_t tid;
   long local_delay = 0;
-  long points_hit = 0;
-  unsigned int num_signals_received = 0;
+  // Hits of each progress point by the threads that owned this slot. Only the
+  // owner increments them and the agent thread sums them, so the increments
+  // are uncontended. Never reset, so no hit is lost when a thread exits
+  std::atomic<long> points_hit[MAX_PROGRESS_POINTS];
+  // Set while the thread pays its delay, so an event raised meanwhile does not pay it again
+  volatile bool paying_delay = false;
+  // global_delay when the thread last blocked, and the experiment it blocked
+  // in (-1 if it blocked outside an experiment)
+  long block_delay = 0;
+  long block_experiment = -1;
+  // Set by the signal handler once the thread owes MIN_SUSPEND_DELAY_NS while
+  // running Java code, the agent thread then suspends it to pay the delay
+  std::atomic<bool> owes_delay;
+  // Delay paid by being suspended, added to local_delay by the thread itself
+  std::atomic<long> suspended_delay;
+  // Global reference, deleted under user_threads_lock when the thread exits
   jthread java_thread;
+  // Per-thread CPU time timer, only armed when timer sampling is enabled
+  timer_t sampling_timer;
+  bool has_sampling_timer = false;
+  // In scope frames sampled by this thread's signal handler, drained by the
+  // agent thread, also after the thread exited
+  SampleRing<JVMPI_CallFrame, SAMPLE_RING_SIZE> samples;
+  // What the signal handler costs the threads that owned this slot
+  agent_stats::ThreadStats stats;
+  // Owned by the thread registry
+  std::atomic<unsigned int> generation;
+  struct UserThread *next_free = NULL;
 };
 
-struct ProgressPoint
+typedef ThreadRegistry<struct UserThread, THREAD_SLAB_SIZE, MAX_THREAD_SLABS> UserThreadRegistry;
+
+enum experiment_granularity
+{
+  _line_granularity,
+  _method_granularity,
+  _class_granularity,
+  // Methods first, then lines in the methods that matter
+  _auto_granularity,
+};
+
+enum region_state
+{
+  _region_pending,
+  _region_significant,
+  _region_insignificant,
+};
+
+// Session state of a method of a class that was just prepared, applied by the agent thread
+struct SessionSeed
 {
   jmethodID method_id;
-  jint lineno;
-  jlocation location;
+  std::string class_name;
+  // Name and signature, e.g. run(I)V
+  std::string method;
+  const SessionMethod *state;
+};
+
+// Linear regression of the throughput on the speedup of one method, to
+// decide whether its lines are worth experiments (granularity=auto)
+struct RegionStats
+{
+  long experiments = 0;
+  double sum_x = 0;
+  double sum_y = 0;
+  double sum_xx = 0;
+  double sum_xy = 0;
+  region_state state = _region_pending;
+};
+
+enum progress_point_type
+{
+  _throughput_point,
+  _latency_begin_point,
+  _latency_end_point,
+};
+
+enum blocking_method_type
+{
+  _park_method,
+  _timed_park_method,
+  _unpark_method,
+};
+
+// A LockSupport method with a breakpoint at its entry
+struct BlockingMethod
+{
+  jmethodID method_id;
+  blocking_method_type type;
+  // Cleared when profiling stops, set again when it restarts
+  bool breakpoint_set;
+};
+
+struct ProgressPoint
+{
+  // Name reported in the output file, e.g. LMain:21
+  std::string name;
+  // JVM class signature without the trailing ';', e.g. LMain
+  std::string class_name;
+  jint lineno = -1;
+  jmethodID method_id = nullptr;
+  jlocation location = 0;
+  progress_point_type type = _throughput_point;
+  // For latency points, the index of the other end of the pair
+  int pair_index = -1;
+  // Hit through the jcoz.Progress Java API rather than a breakpoint
+  bool api = false;
 };
 
 class SignalHandler
@@ -97,23 +260,63 @@ public:
 
   void ParseOptions(const char *options);
 
-  static std::string &getProgressClass() { return progress_class; }
+  // Parses the options of an agent attached to a running JVM, returns false
+  // (rather than exiting) if they are invalid
+  bool ParseAttachOptions(const char *options);
+
+  // Replaces the scopes and/or progress points given in `options` (same
+  // format as the agent options) while profiling is stopped. Returns an
+  // error message, empty on success
+  static std::string updateOptions(const std::string &options);
+
+  // Names the results of the experiments run so far and writes them out
+  static void flushResults();
+
+  static const std::string &getControlPath() { return control_path; }
+
+  static bool isPaused() { return paused; }
+
+  // Threads that were already running when the agent attached register
+  // themselves when one of their frames returns (see HandleFramePop)
+  static void setAttached() { attached = true; }
+
+  // Without breakpoints (some JVMs do not offer them after an attach),
+  // progress points can only be hit through the jcoz.Progress API
+  static void setBreakpointsAvailable(bool available) { breakpoints_available = available; }
+
+  // Without thread suspension, threads that never block or reach a progress
+  // point are not delayed (see payRunningThreads)
+  static void setSuspendAvailable(bool available) { suspend_available = available; }
 
   static std::shared_ptr<spdlog::logger> &getLogger() { return logger; };
 
   static std::vector<std::string> &get_search_scopes() { return search_scopes; }
   static std::vector<std::string> &get_ignored_scopes() { return ignored_scopes; }
 
-  static std::unordered_set<void *> &getInScopeMethods() { return in_scope_ids; }
+  static bool isInScope(const char *class_sig) { return scope_trie.in_scope(class_sig); }
+
+  // Records the class name of the methods of an in scope class
+  static void addClassNames(const char *class_sig, jint method_count, jmethodID *methods);
+
+  static void clearClassNames() { class_names.clear(); }
+
+  static MethodIdSet &getInScopeMethods() { return in_scope_ids; }
+
+  // Called by the ClassUnload extension event, which may be posted during a
+  // GC and must not call back into the JVM, so the agent thread sweeps the tables
+  static void noteClassUnload() { classes_unloaded.fetch_add(1, std::memory_order_relaxed); }
 
   static struct Experiment &getCurrentExperiment() { return current_experiment; }
 
-  static bool inExperiment() { return in_experiment; }
+  static LineTableCache &getLineTables() { return line_tables; }
 
-  static std::unordered_set<struct UserThread *> &getUserThreads() { return user_threads; }
+  static bool inExperiment() { return in_experiment; }
 
   static void runAgentThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args);
 
+  // Names experiment results for the output file, see Symbolizer
+  static void runResolverThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *args);
+
   static void addUserThread(jthread thread);
 
   static void removeUserThread(jthread thread);
@@ -124,9 +327,43 @@ public:
 
   static void addInScopeMethods(jint method_count, jmethodID *methods);
 
-  static void addProgressPoint(jint method_count, jmethodID *methods);
+  static void addProgressPoints(char *class_sig, jint method_count, jmethodID *methods);
+
+  static void clearProgressPoints();
+
+  static int findProgressPoint(const char *name);
 
-  static void clearProgressPoint();
+  static void hitProgressPoint(int index);
+
+  // Pays the delay the current thread owes to the other threads. Only
+  // called from JVMTI events and JNI calls (never from the signal handler),
+  // where the thread holds no JVM internal locks and a safepoint need not wait for it
+  static void payOwedDelay();
+
+  // Suspends the threads the signal handler found owing a delay while they
+  // run Java code (which may never block or reach a progress point) for as
+  // long as they owe. Called by the agent thread on every experiment tick
+  static void payRunningThreads(JNIEnv *jni_env);
+
+  // Called before the current thread blocks and after it is unblocked. If
+  // another thread woke it up, the current thread skips the delays inserted
+  // while it was blocked: the waking thread paid them before waking it
+  static void preBlock();
+
+  static void postBlock(bool woken);
+
+  // Sets breakpoints at the entry of the park and unpark methods of LockSupport
+  static void addBlockingMethods(char *class_sig, jint method_count, jmethodID *methods);
+
+  // Clears those breakpoints, so a stopped profiler adds no cost to park and unpark
+  static void clearBlockingMethods();
+
+  static void HandleFramePop(
+      jvmtiEnv *jvmti,
+      JNIEnv *jni_env,
+      jthread thread,
+      jmethodID method_id,
+      jboolean was_popped_by_exception);
 
   static void HandleBreakpoint(
       jvmtiEnv *jvmti,
@@ -145,6 +382,12 @@ public:
 
   static bool isRunning();
 
+  static bool isFastStartup() { return fast_startup; }
+
+  // false if nothing needs the jmethodIDs of the class: it is out of scope,
+  // declares no pending progress point and is not LockSupport
+  static bool needsMethodIDs(const char *class_sig);
+
   void init();
 
 private:
@@ -158,8 +401,8 @@ private:
 
   static void Handle(int signum, siginfo_t *info, void *context);
 
-  static bool inline inExperiment(JVMPI_CallFrame &curr_frame);
-  static bool inline frameInScope(JVMPI_CallFrame &curr_frame);
+  static inline const struct ExperimentLine *experimentLine(JVMPI_CallFrame &curr_frame);
+  static bool inline frameInScope(const MethodIdSet::Reader &in_scope, JVMPI_CallFrame &curr_frame);
   DISALLOW_COPY_AND_ASSIGN(Profiler);
 
   static void update_experiment_length();
@@ -168,23 +411,135 @@ private:
   static void add_search_scope(std::string &scope);
   static void add_ignored_scope(std::string &scope);
 
-  static std::unordered_set<void *> in_scope_ids;
+  static ScopeTrie scope_trie;
+
+  static ClassNameTable class_names;
+
+  // Cleaned name of the class declaring `method_id`, false if it cannot be found
+  static bool getClassName(jmethodID method_id, std::string &class_name);
+
+  static MethodIdSet in_scope_ids;
 
   static struct Experiment current_experiment;
 
   static std::vector<JVMPI_CallFrame> call_frames;
 
-  static volatile int frame_lock;
+  static void collect_call_frames();
+
+  // Decaying count of the in scope frames sampled so far, used to select experiments
+  static SampleHistogram sample_histogram;
+
+  static std::shared_ptr<const MethodLineTable> select_experiment_frame(JVMPI_CallFrame &exp_frame);
+
+  static bool add_experiment_line(JNIEnv *jni_env, JVMPI_CallFrame &exp_frame, const MethodLineTable &line_table);
 
+  static bool add_experiment_method(JVMPI_CallFrame &exp_frame);
+
+  static bool add_experiment_class(JNIEnv *jni_env, JVMPI_CallFrame &exp_frame);
+
+  static bool select_experiment_lines(JNIEnv *jni_env);
+
+  // Whether the lines, or whole methods or classes, are sped up
+  static experiment_granularity granularity;
+
+  // Drill-down state of the methods run at method granularity (granularity=auto)
+  static std::unordered_map<jmethodID, RegionStats> method_regions;
+
+  static void update_region_stats(const struct ExperimentLine &line);
+
+  // Decides whether a method is worth profiling line by line, once it ran enough experiments
+  static void classify_region(jmethodID method_id, RegionStats &stats);
+
+  // Schedules experiments together with other JVMs, if the coordinator option is given
+  static CoordinatorClient coordinator;
+
+  // The coordinator's name of each line of the current experiment, no class
+  // name for lines the coordinator was not asked about
+  static LineKey coordinated_lines[MAX_PARALLEL_LINES];
+
+  // Method name and signature of the methods of coordinated lines
+  static std::unordered_map<jmethodID, std::string> method_keys;
+
+  // Claims the line regions of the current experiment from the coordinator,
+  // returns false if all of them are run by other JVMs
+  static bool coordinate_experiment_lines();
+
+  // Ends the claims of the current experiment's lines, with its results if `ran`
+  static void report_coordinated_lines(bool ran);
+
+  // Number of lines to virtually speed up in each experiment
+  static int parallel_lines;
+
+  // Number of in scope frames of each sample (from the top of the stack)
+  // that can be selected for experiments, 1 for the leaf in scope frame only
+  static int call_chain_depth;
+
+  // Line number tables of the methods experiments have been run on
+  static LineTableCache line_tables;
+
+  // Fraction of experiments whose line is chosen uniformly instead of by sample weight
+  static double explore_fraction;
+
+  // Taken while a thread registers or exits and while the sampling timers
+  // are paused or resumed, never by the sampling tick
   static volatile int user_threads_lock;
 
-  static volatile bool in_experiment;
+  // Stored (release) once the lines of the experiment are set up, so a
+  // signal handler that sees it set also sees the lines
+  static std::atomic<bool> in_experiment;
+
+  // Hits of each progress point by threads that are not user threads
+  static std::atomic<long> exited_points_hit[MAX_PROGRESS_POINTS];
+
+  static void sum_points_hit(long *totals);
+
+  static int findProgressPoint(jmethodID method_id, jlocation location);
 
-  static std::atomic_ulong points_hit;
+  static struct BlockingMethod blocking_methods[MAX_BLOCKING_METHODS];
 
-  static std::unordered_set<struct UserThread *> user_threads;
+  static std::atomic<int> num_blocking_methods;
 
-  static bool thread_in_main(jthread thread);
+  static const struct BlockingMethod *findBlockingMethod(jmethodID method_id);
+
+  static void parse_progress_point(std::string &value, progress_point_type type);
+
+  // The line of `records` is named later, by the symbolizer
+  static void write_experiment_results(struct ExperimentLine &line, std::vector<ResultRecord> &records);
+
+  // Logs results named by the symbolizer and queues them for the output file
+  static void write_named_results(std::vector<PendingResult> &results);
+
+  // Writes experiment results to the output file in the background
+  static ResultWriter result_writer;
+
+  // Names the results of experiments off the agent thread
+  static Symbolizer symbolizer;
+
+  // Speedup curves of the results written so far, saved to summary_file
+  // every SUMMARY_INTERVAL_MS and when stopping
+  static ResultSummary result_summary;
+
+  static std::string summary_file;
+
+  static std::mutex summary_lock;
+
+  static std::chrono::steady_clock::time_point last_summary_save;
+
+  static void save_summary();
+
+  static UserThreadRegistry user_threads;
+
+  // Whether a thread is profiled, from its name and group. Decided once per thread
+  static bool thread_included(jthread thread);
+
+  // Patterns (`*` matches any characters) of the names, and the names of the
+  // groups, of the threads to profile. A thread matching either is included
+  static std::vector<std::string> thread_patterns;
+  static std::vector<std::string> thread_group_patterns;
+
+  static void start_sampling_timer(struct UserThread *user_thread);
+
+  static void stop_sampling_timer(struct UserThread *user_thread);
 
   static jvmtiEnv *jvmti;
 
@@ -206,17 +561,20 @@ private:
 
   static char *getClassFromMethodIDLocation(jmethodID method_id);
 
-  static volatile pthread_t in_scope_lock;
-
   static std::atomic_bool profile_done;
 
   static void cleanSignature(char *sig);
 
   static std::string package;
 
-  static struct ProgressPoint *progress_point;
+  static std::vector<struct ProgressPoint> progress_points;
+
+  // Copy of progress_points read by application threads (Breakpoint events
+  // and jcoz.Progress calls), so updateOptions can replace the points while
+  // they run. Published again whenever progress_points changes
+  static RcuSnapshot<std::vector<struct ProgressPoint>> published_points;
 
-  static std::string progress_class;
+  static void publishProgressPoints();
 
   static unsigned long experiment_time;
 
@@ -226,6 +584,117 @@ private:
 
   static bool fix_exp;
 
+  // Relative half-width of the confidence interval of the progress point
+  // rate at which an experiment ends, 0 to use the fixed hit thresholds
+  static double confidence;
+
+  static long min_points_hit_since(const long *start_hits);
+
+  // Lines are no longer selected once they ran this many experiments at
+  // every speedup, 0 for no limit
+  static int line_samples;
+
+  // Experiments that ran a line on its own at each speedup, per (method, line)
+  static std::map<std::pair<jmethodID, jint>, std::vector<SpeedupBin>> line_speedups;
+
+  static void count_line_speedup(const struct ExperimentLine &line);
+
+  static bool line_saturated(jmethodID method_id, jint lineno);
+
+  static bool timer_sampling;
+
+  // Nanoseconds between two samples of a thread, also the unit of the
+  // delays inserted per sample during experiments
+  static long sample_interval;
+
+  // Number of frames AsyncGetCallTrace walks in each sample
+  static int stack_depth;
+
+  // Sampling pauses for duty_cycle_idle_ms after every
+  // duty_cycle_experiments experiments, 0 to sample continuously
+  static int duty_cycle_experiments;
+  static long duty_cycle_idle_ms;
+
+  // JSON file the agent's overhead stats are written to, empty for none
+  static std::string stats_file;
+
+  // File the session is resumed from and saved to, empty for none
+  static std::string session_file;
+
+  // As loaded, only read once profiling starts
+  static Session session;
+
+  // Methods of prepared classes that have session state, guarded by session_lock
+  static std::vector<SessionSeed> session_seeds;
+
+  static volatile int session_lock;
+
+  // Class name and method name with signature of every method the session
+  // state was applied to, so it can be saved without JVMTI
+  static std::unordered_map<jmethodID, std::pair<std::string, std::string>> session_methods;
+
+  static void seedSessionMethods(const std::string &class_name, jint method_count, jmethodID *methods);
+
+  static void apply_session_seeds();
+
+  static void save_session();
+
+  static agent_stats::Snapshot collect_stats();
+
+  // Bytes the agent's tables may take (memory-budget option), 0 for no limit
+  static unsigned long memory_budget;
+
+  static std::atomic<unsigned long> classes_unloaded;
+
+  // Fills in the memory pools of `snapshot`, on the agent thread
+  static void add_memory_usage(agent_stats::Snapshot &snapshot);
+
+  // Drops the in scope jmethodIDs that the JVM no longer knows (their class
+  // was unloaded) from every table, returns how many there were
+  static size_t evict_unloaded_methods();
+
+  // Sweeps the tables after classes were unloaded, and empties the tables
+  // that can be rebuilt while the agent is over its memory budget
+  static void maintain_memory();
+
+  // Session state of the evicted methods, saved along with that of the live ones
+  static Session unloaded_session;
+
+  // Adds the experiment state of this run (of `methods` only, if given) to `target`
+  static void add_session_state(Session &target, const std::unordered_set<jmethodID> *methods);
+
+  // Logs the bytecode index hits (of `methods` only, if given), naming methods from the symbolizer cache
+  static void log_bci_hits(const std::unordered_set<jmethodID> *methods);
+
+  // Logs the agent's overhead and writes it to stats_file
+  static void emit_stats();
+
+  // Set while sampling is paused between experiment batches
+  static volatile bool sampling_paused;
+
+  static void arm_sampling_timer(struct UserThread *user_thread, long interval);
+
+  static void pause_sampling();
+
+  static void resume_sampling();
+
+  // Only create the jmethodIDs of classes that need them, on a background thread
+  static bool fast_startup;
+
+  // Unix socket of the control channel, empty if there is none
+  static std::string control_path;
+
+  // Do not profile until started through the control channel
+  static bool paused;
+
+  static bool attached;
+
+  static bool breakpoints_available;
+
+  static bool suspend_available;
+
+  static bool is_progress_class(const struct ProgressPoint &point, const char *class_sig);
+
   static std::vector<std::string> search_scopes;
   static std::vector<std::string> ignored_scopes;
 
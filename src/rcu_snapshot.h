@@ -0,0 +1,116 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_RCU_SNAPSHOT_H
+#define JCOZ_RCU_SNAPSHOT_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "globals.h"
+#include "reader_counts.h"
+
+// Immutable snapshot of a T, read without a lock while writers replace it.
+//
+// A writer builds a new T and publishes it with a single atomic store (RCU
+// style, like the tables of MethodIdSet). Readers that still hold the old
+// snapshot keep using it, so a replaced snapshot is only freed when no
+// Reader is left: when the next one is published, or on `reclaim()`.
+template <typename T>
+class RcuSnapshot
+{
+public:
+  explicit RcuSnapshot(T *initial) : current_(initial) {}
+
+  ~RcuSnapshot()
+  {
+    delete current_.load(std::memory_order_acquire);
+    for (T *snapshot : retired_)
+    {
+      delete snapshot;
+    }
+  }
+
+  // Holds on to the current snapshot. Wait-free and async-signal-safe.
+  class Reader
+  {
+  public:
+    explicit Reader(const RcuSnapshot &owner) : owner_(owner)
+    {
+      // Sequentially consistent with the store in publish(), so a reader
+      // counted as absent there cannot hold a retired snapshot
+      stripe_ = owner_.readers_.enter();
+      snapshot_ = owner_.current_.load(std::memory_order_seq_cst);
+    }
+
+    ~Reader() { owner_.readers_.exit(stripe_); }
+
+    const T &operator*() const { return *snapshot_; }
+
+    const T *operator->() const { return snapshot_; }
+
+  private:
+    const RcuSnapshot &owner_;
+    const T *snapshot_;
+    unsigned int stripe_;
+
+    DISALLOW_COPY_AND_ASSIGN(Reader);
+  };
+
+  // Takes ownership of `snapshot` and makes it the current one
+  void publish(T *snapshot)
+  {
+    std::lock_guard<std::mutex> guard(writer_lock_);
+    T *old_snapshot = current_.load(std::memory_order_relaxed);
+    current_.store(snapshot, std::memory_order_seq_cst);
+    retired_.push_back(old_snapshot);
+    reclaim_locked();
+  }
+
+  // Frees the replaced snapshots if no reader is using them
+  void reclaim()
+  {
+    std::lock_guard<std::mutex> guard(writer_lock_);
+    reclaim_locked();
+  }
+
+private:
+  void reclaim_locked()
+  {
+    // A reader that enters after its stripe is loaded sees the snapshot stored before it
+    if (retired_.empty() || readers_.any())
+    {
+      return;
+    }
+    for (T *snapshot : retired_)
+    {
+      delete snapshot;
+    }
+    retired_.clear();
+  }
+
+  std::atomic<T *> current_;
+  std::vector<T *> retired_;
+  // Live Readers, counted from JVMTI and JNI callbacks
+  ReaderCounts readers_;
+  std::mutex writer_lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(RcuSnapshot);
+};
+
+#endif // JCOZ_RCU_SNAPSHOT_H
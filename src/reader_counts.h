@@ -0,0 +1,94 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_READER_COUNTS_H
+#define JCOZ_READER_COUNTS_H
+
+#include <atomic>
+
+#include "globals.h"
+
+// Counts the readers of an RCU style structure without a shared counter.
+//
+// Every thread counts itself in one of READER_COUNT_STRIPES counters, each on
+// a cache line of its own and picked once per thread, so readers only share a
+// line when two threads share a stripe. A writer that has published a new
+// version sums the stripes: a reader that entered after the stripe it uses
+// was read also loads the pointer after it was published, and so cannot hold
+// a retired version.
+class ReaderCounts
+{
+public:
+  ReaderCounts()
+  {
+    for (int i = 0; i < READER_COUNT_STRIPES; i++)
+    {
+      stripes_[i].readers.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns the stripe to pass to `exit()`. Sequentially consistent with the
+  // loads in `any()`, so it must come before the reader loads the pointer.
+  // Wait-free and async-signal-safe.
+  unsigned int enter() const
+  {
+    unsigned int stripe = thread_stripe();
+    stripes_[stripe].readers.fetch_add(1, std::memory_order_seq_cst);
+    return stripe;
+  }
+
+  void exit(unsigned int stripe) const { stripes_[stripe].readers.fetch_sub(1, std::memory_order_release); }
+
+  // Must come after the store that published the new version
+  bool any() const
+  {
+    for (int i = 0; i < READER_COUNT_STRIPES; i++)
+    {
+      if (stripes_[i].readers.load(std::memory_order_seq_cst) != 0)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  struct alignas(64) Stripe
+  {
+    std::atomic<long> readers;
+  };
+
+  static unsigned int thread_stripe()
+  {
+    static std::atomic<unsigned int> next_stripe(0);
+    // Stripe + 1, zero until the thread's first read. A signal handler
+    // interrupting the assignment may pick another, which is fine as each
+    // Reader keeps the stripe it entered
+    static thread_local unsigned int stripe = 0;
+    if (stripe == 0)
+    {
+      stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % READER_COUNT_STRIPES + 1;
+    }
+    return stripe - 1;
+  }
+
+  mutable Stripe stripes_[READER_COUNT_STRIPES];
+
+  DISALLOW_COPY_AND_ASSIGN(ReaderCounts);
+};
+
+#endif // JCOZ_READER_COUNTS_H
@@ -0,0 +1,305 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "result_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+void CsvResultSink::encode_header(std::string &out)
+{
+  // There is one row per experiment for each progress point (and each latency point pair)
+  out += "selectedClassLineNo,speedup,duration,effectiveDuration,progressPointHits,"
+         "progressPoint,pointType,latencyDepartures,latencyInFlight,experimentId\n";
+}
+
+void CsvResultSink::encode(const ResultRecord &record, std::string &out)
+{
+  std::stringstream row;
+  row << record.selected << "," << record.speedup << "," << record.duration << "," << record.effective_duration << "," << record.hits
+      << "," << record.progress_point;
+  if (record.latency)
+  {
+    row << "," << "latency" << "," << record.departures << "," << record.in_flight;
+  }
+  else
+  {
+    row << "," << "throughput" << ",,";
+  }
+  row << "," << record.experiment_id << "\n";
+  out += row.str();
+}
+
+// Little-endian helpers for the binary format
+static void put_u8(std::string &out, uint8_t value)
+{
+  out.push_back((char)value);
+}
+
+static void put_u16(std::string &out, uint16_t value)
+{
+  for (int i = 0; i < 2; i++)
+    out.push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void put_u32(std::string &out, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    out.push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void put_i64(std::string &out, int64_t value)
+{
+  uint64_t bits = (uint64_t)value;
+  for (int i = 0; i < 8; i++)
+    out.push_back((char)((bits >> (8 * i)) & 0xff));
+}
+
+static void put_string(std::string &out, const std::string &value)
+{
+  size_t length = std::min(value.size(), (size_t)UINT16_MAX);
+  put_u16(out, (uint16_t)length);
+  out.append(value, 0, length);
+}
+
+void BinaryResultSink::encode_header(std::string &out)
+{
+  out += "JCOZ";
+  put_u32(out, kVersion);
+}
+
+void BinaryResultSink::encode(const ResultRecord &record, std::string &out)
+{
+  std::string payload;
+  put_u8(payload, record.latency ? 1 : 0);
+  put_u32(payload, bit_cast<uint32_t>(record.speedup));
+  put_i64(payload, record.duration);
+  put_i64(payload, record.effective_duration);
+  put_i64(payload, record.hits);
+  put_i64(payload, record.latency ? record.departures : 0);
+  put_i64(payload, record.latency ? record.in_flight : 0);
+  put_string(payload, record.selected);
+  put_string(payload, record.progress_point);
+  put_i64(payload, record.experiment_id);
+
+  put_u32(out, (uint32_t)payload.size());
+  out += payload;
+}
+
+ResultSink *create_result_sink(const std::string &format)
+{
+  if (format == "csv")
+    return new CsvResultSink();
+  if (format == "binary")
+    return new BinaryResultSink();
+  return NULL;
+}
+
+ResultWriter::ResultWriter() : fd_(-1), flush_requested_(false), stopping_(false) {}
+
+ResultWriter::~ResultWriter()
+{
+  close();
+}
+
+bool ResultWriter::open(const std::string &path, ResultSink *sink)
+{
+  sink_.reset(sink);
+  path_ = path;
+  return reopen();
+}
+
+bool ResultWriter::has_header(const std::string &header)
+{
+  int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return errno == ENOENT;
+  }
+  struct stat file_stat;
+  std::string start(header.size(), '\0');
+  bool matches = fstat(fd, &file_stat) == 0 &&
+                 (file_stat.st_size == 0 ||
+                  (pread(fd, &start[0], start.size(), 0) == (ssize_t)start.size() && start == header));
+  ::close(fd);
+  return matches;
+}
+
+bool ResultWriter::reopen()
+{
+  if (fd_ >= 0 || !sink_)
+  {
+    return fd_ >= 0;
+  }
+  std::string header;
+  sink_->encode_header(header);
+
+  // Rows of another layout (e.g. from an older agent, or another format)
+  // would make the file unreadable, so such a file is moved aside to the
+  // first free <path>.<n> rather than appended to
+  moved_to_.clear();
+  if (!has_header(header))
+  {
+    for (int n = 1; moved_to_.empty(); n++)
+    {
+      std::string aside = path_ + "." + std::to_string(n);
+      if (access(aside.c_str(), F_OK) != 0)
+      {
+        if (rename(path_.c_str(), aside.c_str()) != 0)
+        {
+          return false;
+        }
+        moved_to_ = aside;
+      }
+    }
+  }
+
+  fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+  {
+    return false;
+  }
+
+  // Only a new (or empty) file gets a header, so appending to the results
+  // of an earlier run keeps the file readable
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) == 0 && file_stat.st_size == 0)
+  {
+    write_out(header);
+  }
+
+  stopping_ = false;
+  flush_requested_ = false;
+  thread_ = std::thread(&ResultWriter::run, this);
+  return true;
+}
+
+void ResultWriter::write(const ResultRecord &record)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  queue_.push_back(record);
+}
+
+void ResultWriter::write(const std::vector<ResultRecord> &records)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  queue_.insert(queue_.end(), records.begin(), records.end());
+}
+
+void ResultWriter::write_out(const std::string &data)
+{
+  size_t written = 0;
+  while (written < data.size())
+  {
+    ssize_t result = ::write(fd_, data.data() + written, data.size() - written);
+    if (result < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write JCoz results: %s\n", strerror(errno));
+      return;
+    }
+    written += result;
+  }
+}
+
+void ResultWriter::run()
+{
+  auto last_fsync = std::chrono::steady_clock::now();
+  std::vector<ResultRecord> batch;
+  std::string encoded;
+  bool stopping = false;
+  while (!stopping)
+  {
+    bool flushing;
+    {
+      std::unique_lock<std::mutex> guard(mutex_);
+      wakeup_.wait_for(guard, std::chrono::milliseconds(RESULTS_FLUSH_INTERVAL_MS),
+                       [this]
+                       { return stopping_ || flush_requested_; });
+      batch.swap(queue_);
+      stopping = stopping_;
+      flushing = flush_requested_;
+    }
+
+    encoded.clear();
+    for (auto i = batch.begin(); i != batch.end(); i++)
+    {
+      sink_->encode(*i, encoded);
+    }
+    batch.clear();
+    if (!encoded.empty())
+    {
+      write_out(encoded);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (stopping || flushing || now - last_fsync >= std::chrono::milliseconds(RESULTS_FSYNC_INTERVAL_MS))
+    {
+      fsync(fd_);
+      last_fsync = now;
+    }
+
+    if (flushing)
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      flush_requested_ = false;
+      flushed_.notify_all();
+    }
+  }
+}
+
+void ResultWriter::flush()
+{
+  std::unique_lock<std::mutex> guard(mutex_);
+  // Once stopping, the writer thread may already have done its last round
+  if (fd_ < 0 || stopping_)
+  {
+    return;
+  }
+  flush_requested_ = true;
+  wakeup_.notify_all();
+  flushed_.wait(guard, [this]
+                { return !flush_requested_; });
+}
+
+void ResultWriter::close()
+{
+  if (fd_ < 0)
+  {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  wakeup_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  ::close(fd_);
+  fd_ = -1;
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_RESULT_SINK_H
+#define JCOZ_RESULT_SINK_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "globals.h"
+
+// The result of one experiment for one progress point (or latency point pair)
+struct ResultRecord
+{
+  // Records of lines sped up in the same experiment share the id
+  long experiment_id;
+  // Class and line that was virtually sped up, e.g. model.Help:12
+  std::string selected;
+  float speedup;
+  long duration;
+  long effective_duration;
+  long hits;
+  std::string progress_point;
+  bool latency;
+  // Latency points only
+  long departures;
+  long in_flight;
+};
+
+// Encodes result records into the bytes of one output file format
+class ResultSink
+{
+public:
+  virtual ~ResultSink() {}
+
+  // Extension of the output file, e.g. ".csv"
+  virtual const char *extension() const = 0;
+
+  // Written once at the start of a new output file
+  virtual void encode_header(std::string &out) = 0;
+
+  virtual void encode(const ResultRecord &record, std::string &out) = 0;
+};
+
+// The original format, one comma separated row per record
+class CsvResultSink : public ResultSink
+{
+public:
+  const char *extension() const { return ".csv"; }
+
+  void encode_header(std::string &out);
+
+  void encode(const ResultRecord &record, std::string &out);
+};
+
+// Compact length-prefixed binary records, for shipping results off-host.
+//
+// The file starts with the magic "JCOZ" and a little-endian u32 format
+// version. Each record is a little-endian u32 payload length followed by:
+//   u8 type (0 throughput, 1 latency), f32 speedup,
+//   i64 duration, i64 effective duration, i64 hits,
+//   i64 departures, i64 in flight,
+//   u16 length + bytes of the selected line,
+//   u16 length + bytes of the progress point name,
+//   i64 experiment id
+class BinaryResultSink : public ResultSink
+{
+public:
+  static const uint32_t kVersion = 2;
+
+  const char *extension() const { return ".bin"; }
+
+  void encode_header(std::string &out);
+
+  void encode(const ResultRecord &record, std::string &out);
+};
+
+ResultSink *create_result_sink(const std::string &format);
+
+// Appends results to the output file from a background thread, so the agent
+// thread never blocks on file I/O. Records are encoded and written in
+// batches every RESULTS_FLUSH_INTERVAL_MS, and the file is fsync'ed every
+// RESULTS_FSYNC_INTERVAL_MS.
+class ResultWriter
+{
+public:
+  ResultWriter();
+
+  ~ResultWriter();
+
+  // Takes ownership of `sink`. Returns false if the file cannot be opened.
+  bool open(const std::string &path, ResultSink *sink);
+
+  // Opens the file of the last `open` again (with the same sink) after `close`.
+  // Results are only appended to a file that starts with the sink's header,
+  // any other file is moved aside (see `moved_to`) and a new one is started
+  bool reopen();
+
+  // Where the last `open` or `reopen` moved an existing file, empty if it did not
+  const std::string &moved_to() const { return moved_to_; }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  void write(const ResultRecord &record);
+
+  void write(const std::vector<ResultRecord> &records);
+
+  // Writes everything queued so far and fsyncs, returns once that is done
+  void flush();
+
+  // Writes everything queued so far and fsyncs, then stops the background thread
+  void close();
+
+private:
+  void run();
+
+  // Writes `data` to the file, must only be called by the writer thread (or after it stopped)
+  void write_out(const std::string &data);
+
+  // Whether the file at path_ is missing, empty, or starts with `header`
+  bool has_header(const std::string &header);
+
+  std::unique_ptr<ResultSink> sink_;
+  std::string path_;
+  std::string moved_to_;
+  int fd_;
+  std::vector<ResultRecord> queue_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  // Signalled by the writer thread once a requested flush is done
+  std::condition_variable flushed_;
+  bool flush_requested_;
+  bool stopping_;
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultWriter);
+};
+
+#endif // JCOZ_RESULT_SINK_H
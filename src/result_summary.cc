@@ -0,0 +1,177 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "result_summary.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <cmath>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+static const char *const kSummaryHeader =
+    "selectedClassLineNo,progressPoint,speedup,experiments,progressPointHits,"
+    "effectiveDuration,throughputMean,throughputVariance,progressSpeedup";
+
+void SummaryCell::add(double throughput, long cell_hits, long cell_effective_duration)
+{
+  experiments++;
+  hits += cell_hits;
+  effective_duration += cell_effective_duration;
+  double delta = throughput - mean;
+  mean += delta / experiments;
+  m2 += delta * (throughput - mean);
+}
+
+void SummaryCell::merge(const SummaryCell &other)
+{
+  if (other.experiments == 0)
+  {
+    return;
+  }
+  // Chan et al.'s update for combining two sets of samples
+  long total = experiments + other.experiments;
+  double delta = other.mean - mean;
+  m2 += other.m2 + delta * delta * experiments * other.experiments / total;
+  mean += delta * other.experiments / total;
+  experiments = total;
+  hits += other.hits;
+  effective_duration += other.effective_duration;
+}
+
+void ResultSummary::add(const std::vector<ResultRecord> &records)
+{
+  // Lines sped up in each experiment. Only lines that ran alone are summed
+  // into their curves (with parallel-lines the throughput is that of all the
+  // lines together), and a 0% speedup only if no delay was inserted at all
+  std::map<long, std::set<std::string>> experiment_lines;
+  for (auto record = records.begin(); record != records.end(); record++)
+  {
+    experiment_lines[record->experiment_id].insert(record->selected);
+  }
+
+  for (auto record = records.begin(); record != records.end(); record++)
+  {
+    if (record->latency || record->effective_duration <= 0)
+      continue;
+    if (experiment_lines[record->experiment_id].size() != 1)
+      continue;
+    int bin = (int)std::lround(record->speedup * (NUM_SPEEDUPS - 1));
+    if (bin == 0 && record->effective_duration < record->duration)
+      continue;
+
+    std::vector<SummaryCell> &cells = cells_[std::make_pair(record->selected, record->progress_point)];
+    cells.resize(NUM_SPEEDUPS);
+    cells[bin].add(record->hits * 1e9 / record->effective_duration, record->hits, record->effective_duration);
+  }
+}
+
+bool ResultSummary::load(const std::string &path)
+{
+  std::ifstream in(path.c_str());
+  if (!in)
+  {
+    return errno == ENOENT;
+  }
+
+  std::string line;
+  if (!std::getline(in, line) || line != kSummaryHeader)
+  {
+    return false;
+  }
+  while (std::getline(in, line))
+  {
+    // Names contain no commas, the progress speedup is recomputed on save
+    std::vector<std::string> fields;
+    std::stringstream row(line);
+    std::string field;
+    while (std::getline(row, field, ','))
+    {
+      fields.push_back(field);
+    }
+    if (fields.size() < 8)
+    {
+      return false;
+    }
+    SummaryCell cell;
+    int bin;
+    try
+    {
+      bin = (int)std::lround(std::stod(fields[2]) * (NUM_SPEEDUPS - 1));
+      cell.experiments = std::stol(fields[3]);
+      cell.hits = std::stol(fields[4]);
+      cell.effective_duration = std::stol(fields[5]);
+      cell.mean = std::stod(fields[6]);
+      cell.m2 = std::stod(fields[7]) * (cell.experiments - 1);
+    }
+    catch (const std::exception &)
+    {
+      return false;
+    }
+    if (bin < 0 || bin >= NUM_SPEEDUPS)
+    {
+      return false;
+    }
+    std::vector<SummaryCell> &cells = cells_[std::make_pair(fields[0], fields[1])];
+    cells.resize(NUM_SPEEDUPS);
+    cells[bin].merge(cell);
+  }
+  return true;
+}
+
+bool ResultSummary::save(const std::string &path) const
+{
+  std::ostringstream out;
+  out.precision(12);
+  out << kSummaryHeader << "\n";
+  for (auto line = cells_.begin(); line != cells_.end(); line++)
+  {
+    const SummaryCell &baseline = line->second[0];
+    for (int bin = 0; bin < NUM_SPEEDUPS; bin++)
+    {
+      const SummaryCell &cell = line->second[bin];
+      if (cell.experiments == 0)
+        continue;
+      out << line->first.first << "," << line->first.second << "," << (double)bin / (NUM_SPEEDUPS - 1) << ","
+          << cell.experiments << "," << cell.hits << "," << cell.effective_duration << "," << cell.mean << ","
+          << cell.variance() << ",";
+      if (baseline.experiments > 0 && baseline.mean > 0)
+        out << cell.mean / baseline.mean - 1;
+      out << "\n";
+    }
+  }
+
+  std::string tmp_path = path + ".tmp";
+  FILE *file = fopen(tmp_path.c_str(), "w");
+  if (file == NULL)
+    return false;
+  std::string text = out.str();
+  bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+  written = fclose(file) == 0 && written;
+  return written && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+std::string ResultSummary::path_for(const std::string &output_file)
+{
+  size_t dot = output_file.rfind('.');
+  size_t slash = output_file.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+  {
+    return output_file + ".summary.csv";
+  }
+  return output_file.substr(0, dot) + ".summary.csv";
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JCOZ_RESULT_SUMMARY_H
+#define JCOZ_RESULT_SUMMARY_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "globals.h"
+#include "result_sink.h"
+
+// The experiments of one line at one speedup, for one throughput point
+struct SummaryCell
+{
+  long experiments = 0;
+  long hits = 0;
+  long effective_duration = 0;
+  // Running mean and sum of squared deviations (Welford) of the throughput,
+  // in progress point hits per second of effective duration
+  double mean = 0;
+  double m2 = 0;
+
+  void add(double throughput, long cell_hits, long cell_effective_duration);
+
+  void merge(const SummaryCell &other);
+
+  double variance() const { return experiments > 1 ? m2 / (experiments - 1) : 0; }
+};
+
+// Speedup curve of every line, kept up to date as results come in, so a
+// viewer can plot them without reading (and grouping) every experiment.
+// Written as a CSV file with a row per line, progress point and speedup:
+//
+//   selectedClassLineNo,progressPoint,speedup,experiments,progressPointHits,
+//   effectiveDuration,throughputMean,throughputVariance,progressSpeedup
+//
+// progressSpeedup is the throughput relative to that of the line at 0%
+// speedup, empty until the line ran at 0%. Experiments are filtered as
+// jcoz-viewer filters the raw results: no effective duration, or 0% speedup
+// with delays inserted by the line itself. Only experiments that sped up a
+// single line are summarized, and latency points are not.
+class ResultSummary
+{
+public:
+  ResultSummary() {}
+
+  // The records of an experiment must all be in the same call
+  void add(const std::vector<ResultRecord> &records);
+
+  // Adds the cells of a summary written earlier. A missing file is an empty
+  // summary, false if the file is not a summary.
+  bool load(const std::string &path);
+
+  // Replaces the file as a whole, so a live viewer never reads half of it
+  bool save(const std::string &path) const;
+
+  // Default summary file of an output file, e.g. jcoz-output.summary.csv
+  static std::string path_for(const std::string &output_file);
+
+private:
+  // NUM_SPEEDUPS cells by selected line and progress point
+  std::map<std::pair<std::string, std::string>, std::vector<SummaryCell>> cells_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultSummary);
+};
+
+#endif // JCOZ_RESULT_SUMMARY_H
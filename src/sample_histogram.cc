@@ -0,0 +1,141 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sample_histogram.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include "agent_stats.h"
+
+// Uniform random number in [0, 1)
+static double random_fraction()
+{
+  return (double)rand() / ((double)RAND_MAX + 1.0);
+}
+
+void SampleHistogram::add(const JVMPI_CallFrame &frame)
+{
+  weights_[frame] += 1.0;
+}
+
+void SampleHistogram::add(const std::vector<JVMPI_CallFrame> &frames)
+{
+  for (auto i = frames.begin(); i != frames.end(); i++)
+  {
+    add(*i);
+  }
+}
+
+void SampleHistogram::decay(double factor, double min_weight)
+{
+  for (auto i = weights_.begin(); i != weights_.end();)
+  {
+    i->second *= factor;
+    if (i->second < min_weight)
+    {
+      i = weights_.erase(i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+bool SampleHistogram::select(double explore, JVMPI_CallFrame &frame) const
+{
+  if (weights_.empty())
+  {
+    return false;
+  }
+
+  if (explore > 0 && random_fraction() < explore)
+  {
+    auto chosen = weights_.begin();
+    std::advance(chosen, rand() % weights_.size());
+    frame = chosen->first;
+    return true;
+  }
+
+  double total_weight = 0;
+  for (auto i = weights_.begin(); i != weights_.end(); i++)
+  {
+    total_weight += i->second;
+  }
+
+  double target = random_fraction() * total_weight;
+  for (auto i = weights_.begin(); i != weights_.end(); i++)
+  {
+    target -= i->second;
+    if (target < 0)
+    {
+      frame = i->first;
+      return true;
+    }
+  }
+
+  // Rounding can leave a tiny remainder, fall back to any frame
+  frame = weights_.begin()->first;
+  return true;
+}
+
+void SampleHistogram::remove(const JVMPI_CallFrame &frame)
+{
+  weights_.erase(frame);
+}
+
+void SampleHistogram::remove_methods(const std::unordered_set<jmethodID> &methods)
+{
+  for (auto i = weights_.begin(); i != weights_.end();)
+  {
+    if (methods.count(i->first.method_id) > 0)
+    {
+      i = weights_.erase(i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+void SampleHistogram::trim(size_t max_frames)
+{
+  if (weights_.size() <= max_frames)
+  {
+    return;
+  }
+  std::vector<double> weights;
+  weights.reserve(weights_.size());
+  for (auto i = weights_.begin(); i != weights_.end(); i++)
+  {
+    weights.push_back(i->second);
+  }
+  // Only frames heavier than the heaviest one left out are kept, so ties go together
+  std::nth_element(weights.begin(), weights.begin() + max_frames, weights.end(), std::greater<double>());
+  decay(1.0, weights[max_frames] + 1e-12);
+  // Frees the buckets left over by the erased frames
+  weights_.rehash(0);
+}
+
+size_t SampleHistogram::memory_bytes() const
+{
+  return agent_stats::hash_map_bytes(weights_);
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_SAMPLE_HISTOGRAM_H
+#define JCOZ_SAMPLE_HISTOGRAM_H
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "globals.h"
+#include "stacktraces.h"
+
+// Decaying histogram of in scope samples per (method, bci), kept for the
+// whole run so that experiment selection is not biased towards whatever
+// happened to run in the last sampling round. It is only used by the agent
+// thread.
+class SampleHistogram
+{
+public:
+  SampleHistogram() {}
+
+  void add(const JVMPI_CallFrame &frame);
+
+  void add(const std::vector<JVMPI_CallFrame> &frames);
+
+  // Multiplies every weight by `factor` and forgets frames whose weight
+  // has fallen below `min_weight`
+  void decay(double factor, double min_weight);
+
+  // Picks a frame with probability proportional to its weight or, with
+  // probability `explore`, uniformly among all frames (which favours
+  // under-sampled lines). Returns false if the histogram is empty.
+  bool select(double explore, JVMPI_CallFrame &frame) const;
+
+  void remove(const JVMPI_CallFrame &frame);
+
+  // Forgets every frame of these methods (e.g. of unloaded classes)
+  void remove_methods(const std::unordered_set<jmethodID> &methods);
+
+  // Keeps at most the `max_frames` heaviest frames
+  void trim(size_t max_frames);
+
+  size_t memory_bytes() const;
+
+  size_t size() const { return weights_.size(); }
+
+  bool empty() const { return weights_.empty(); }
+
+private:
+  struct FrameHash
+  {
+    size_t operator()(const JVMPI_CallFrame &frame) const
+    {
+      return std::hash<uintptr_t>()((uintptr_t)frame.method_id) * 31 + frame.lineno;
+    }
+  };
+
+  struct FrameEqual
+  {
+    bool operator()(const JVMPI_CallFrame &lhs, const JVMPI_CallFrame &rhs) const
+    {
+      return lhs.method_id == rhs.method_id && lhs.lineno == rhs.lineno;
+    }
+  };
+
+  std::unordered_map<JVMPI_CallFrame, double, FrameHash, FrameEqual> weights_;
+
+  DISALLOW_COPY_AND_ASSIGN(SampleHistogram);
+};
+
+#endif // JCOZ_SAMPLE_HISTOGRAM_H
@@ -0,0 +1,98 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_SAMPLE_RING_H
+#define JCOZ_SAMPLE_RING_H
+
+#include <atomic>
+#include <stddef.h>
+
+#include "globals.h"
+
+// Single-producer/single-consumer ring buffer.
+//
+// The producer is the signal handler of the thread that owns the ring and the
+// consumer is the agent thread, so neither side ever takes a lock. Both
+// indices only ever grow; they are reduced modulo Capacity when a slot is
+// accessed, which is why Capacity has to be a power of two.
+template <class T, unsigned int Capacity>
+class SampleRing
+{
+  static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0,
+                "SampleRing capacity must be a power of two");
+
+public:
+  SampleRing() : head_(0), tail_(0), dropped_(0) {}
+
+  // Producer side - async-signal-safe. Returns false if the ring is full,
+  // in which case the element is dropped and counted.
+  bool push(const T &element)
+  {
+    unsigned int head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= Capacity)
+    {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    slots_[head & (Capacity - 1)] = element;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the ring is empty.
+  bool pop(T &element)
+  {
+    unsigned int tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    element = slots_[tail & (Capacity - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Appends everything currently in the ring to `out`
+  // and returns the number of elements moved.
+  template <class Container>
+  size_t drain(Container &out)
+  {
+    size_t count = 0;
+    T element;
+    while (pop(element))
+    {
+      out.push_back(element);
+      count++;
+    }
+    return count;
+  }
+
+  unsigned long dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  // head_ is written by the producer and tail_ by the consumer, so keep them
+  // on separate cache lines to avoid false sharing between the two.
+  std::atomic<unsigned int> head_;
+  char head_padding_[64 - sizeof(std::atomic<unsigned int>)];
+  std::atomic<unsigned int> tail_;
+  std::atomic<unsigned long> dropped_;
+  T slots_[Capacity];
+
+  DISALLOW_COPY_AND_ASSIGN(SampleRing);
+};
+
+#endif // JCOZ_SAMPLE_RING_H
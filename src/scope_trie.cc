@@ -0,0 +1,70 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "scope_trie.h"
+
+int ScopeTrie::child(int node, char c) const
+{
+  const std::vector<std::pair<char, int>> &children = nodes_[node].children;
+  for (auto i = children.begin(); i != children.end(); i++)
+  {
+    if (i->first == c)
+    {
+      return i->second;
+    }
+  }
+  return -1;
+}
+
+void ScopeTrie::add(const std::string &scope, unsigned char kind)
+{
+  int node = 0;
+  for (auto c = scope.begin(); c != scope.end(); c++)
+  {
+    int next = child(node, *c);
+    if (next == -1)
+    {
+      next = (int)nodes_.size();
+      nodes_.push_back(Node());
+      nodes_[node].children.push_back(std::make_pair(*c, next));
+    }
+    node = next;
+  }
+  nodes_[node].scopes |= kind;
+}
+
+bool ScopeTrie::in_scope(const char *class_sig) const
+{
+  // Skip the leading 'L' of the signature
+  if (*class_sig == '\0')
+  {
+    return false;
+  }
+  const char *c = class_sig + 1;
+
+  unsigned char matched = nodes_[0].scopes;
+  for (int node = 0; *c != '\0' && !(matched & kIgnored); c++)
+  {
+    node = child(node, *c);
+    if (node == -1)
+    {
+      break;
+    }
+    matched |= nodes_[node].scopes;
+  }
+  return matched == kSearch;
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_SCOPE_TRIE_H
+#define JCOZ_SCOPE_TRIE_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "globals.h"
+
+// Prefix trie of the search and ignored scopes (package prefixes such as
+// `com/example/`), so classifying a class costs one walk down the trie over
+// its signature rather than a string comparison for every scope.
+class ScopeTrie
+{
+public:
+  ScopeTrie() : nodes_(1) {}
+
+  void add_search_scope(const std::string &scope) { add(scope, kSearch); }
+
+  void add_ignored_scope(const std::string &scope) { add(scope, kIgnored); }
+
+  // true if `class_sig` (format `L<name>;`) starts with a search scope
+  // and with none of the ignored scopes
+  bool in_scope(const char *class_sig) const;
+
+  void clear() { nodes_.assign(1, Node()); }
+
+private:
+  static const unsigned char kSearch = 1;
+  static const unsigned char kIgnored = 2;
+
+  struct Node
+  {
+    Node() : scopes(0) {}
+    // Kinds of the scopes ending at this node
+    unsigned char scopes;
+    // (character, index of the child node); scopes have few distinct
+    // characters per position, so a scan beats a map
+    std::vector<std::pair<char, int>> children;
+  };
+
+  void add(const std::string &scope, unsigned char kind);
+
+  int child(int node, char c) const;
+
+  std::vector<Node> nodes_;
+};
+
+#endif // JCOZ_SCOPE_TRIE_H
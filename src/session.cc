@@ -0,0 +1,184 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "session.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+bool Session::load(const std::string &path, std::string &error)
+{
+  std::ifstream in(path.c_str());
+  if (!in)
+  {
+    if (errno == ENOENT)
+      return true;
+    error = "cannot read " + path;
+    return false;
+  }
+
+  std::string text;
+  int version = 0;
+  if (!(in >> text >> version) || text != "jcoz-session" || version != kVersion)
+  {
+    error = path + " is not a version " + std::to_string(kVersion) + " session file";
+    return false;
+  }
+
+  std::string line;
+  int line_number = 1;
+  std::getline(in, line);
+  while (std::getline(in, line))
+  {
+    line_number++;
+    std::istringstream fields(line);
+    std::string kind;
+    if (!(fields >> kind))
+      continue;
+
+    bool ok;
+    if (kind == "experiment-time")
+    {
+      ok = (bool)(fields >> experiment_time);
+    }
+    else if (kind == "experiment-id")
+    {
+      ok = (bool)(fields >> experiment_id);
+    }
+    else if (kind == "line")
+    {
+      std::string class_name, method;
+      int lineno;
+      ok = (bool)(fields >> class_name >> method >> lineno);
+      std::vector<SpeedupBin> bins;
+      SpeedupBin bin;
+      char colon;
+      while (ok && fields >> bin.experiments >> colon >> bin.rate_sum)
+      {
+        ok = colon == ':';
+        bins.push_back(bin);
+      }
+      if (ok)
+        classes[class_name][method].lines[lineno] = bins;
+    }
+    else if (kind == "region")
+    {
+      std::string class_name, method;
+      SessionRegion region;
+      ok = (bool)(fields >> class_name >> method >> region.experiments >> region.sum_x >> region.sum_y >> region.sum_xx >> region.sum_xy);
+      if (ok)
+      {
+        SessionMethod &entry = classes[class_name][method];
+        entry.has_region = true;
+        entry.region = region;
+      }
+    }
+    else
+    {
+      ok = false;
+    }
+
+    if (!ok)
+    {
+      error = path + ":" + std::to_string(line_number) + ": malformed line";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Session::save(const std::string &path) const
+{
+  std::ostringstream out;
+  // Rates are sums of many experiments, keep enough digits to merge them again
+  out.precision(17);
+  out << "jcoz-session " << kVersion << "\n"
+      << "experiment-time " << experiment_time << "\n"
+      << "experiment-id " << experiment_id << "\n";
+  for (auto klass = classes.begin(); klass != classes.end(); klass++)
+  {
+    for (auto method = klass->second.begin(); method != klass->second.end(); method++)
+    {
+      for (auto line = method->second.lines.begin(); line != method->second.lines.end(); line++)
+      {
+        out << "line " << klass->first << " " << method->first << " " << line->first;
+        for (auto bin = line->second.begin(); bin != line->second.end(); bin++)
+          out << " " << bin->experiments << ":" << bin->rate_sum;
+        out << "\n";
+      }
+      if (method->second.has_region)
+      {
+        const SessionRegion &region = method->second.region;
+        out << "region " << klass->first << " " << method->first << " " << region.experiments << " " << region.sum_x
+            << " " << region.sum_y << " " << region.sum_xx << " " << region.sum_xy << "\n";
+      }
+    }
+  }
+
+  std::string tmp_path = path + ".tmp";
+  FILE *file = fopen(tmp_path.c_str(), "w");
+  if (file == NULL)
+    return false;
+  std::string text = out.str();
+  bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+  written = fclose(file) == 0 && written;
+  return written && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+void Session::merge(const Session &other)
+{
+  experiment_time = std::max(experiment_time, other.experiment_time);
+  experiment_id = std::max(experiment_id, other.experiment_id);
+  for (auto klass = other.classes.begin(); klass != other.classes.end(); klass++)
+  {
+    for (auto method = klass->second.begin(); method != klass->second.end(); method++)
+    {
+      SessionMethod &entry = classes[klass->first][method->first];
+      for (auto line = method->second.lines.begin(); line != method->second.lines.end(); line++)
+      {
+        std::vector<SpeedupBin> &bins = entry.lines[line->first];
+        bins.resize(std::max(bins.size(), line->second.size()));
+        for (size_t i = 0; i < line->second.size(); i++)
+        {
+          bins[i].experiments += line->second[i].experiments;
+          bins[i].rate_sum += line->second[i].rate_sum;
+        }
+      }
+      if (method->second.has_region)
+      {
+        const SessionRegion &region = method->second.region;
+        entry.has_region = true;
+        entry.region.experiments += region.experiments;
+        entry.region.sum_x += region.sum_x;
+        entry.region.sum_y += region.sum_y;
+        entry.region.sum_xx += region.sum_xx;
+        entry.region.sum_xy += region.sum_xy;
+      }
+    }
+  }
+}
+
+const SessionMethod *Session::find(const std::string &class_name, const std::string &method) const
+{
+  auto klass = classes.find(class_name);
+  if (klass == classes.end())
+    return NULL;
+  auto entry = klass->second.find(method);
+  return entry == klass->second.end() ? NULL : &entry->second;
+}
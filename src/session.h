@@ -0,0 +1,83 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JCOZ_SESSION_H
+#define JCOZ_SESSION_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Experiments run on a line at one speedup, and the sum of the progress
+// rate (hits per second of the least hit progress point) they measured
+struct SpeedupBin
+{
+  long experiments = 0;
+  double rate_sum = 0;
+};
+
+// Drill-down statistics of a method run at method granularity, see RegionStats
+struct SessionRegion
+{
+  long experiments = 0;
+  double sum_x = 0;
+  double sum_y = 0;
+  double sum_xx = 0;
+  double sum_xy = 0;
+};
+
+struct SessionMethod
+{
+  // NUM_SPEEDUPS bins for each source line, -1 for the whole method
+  std::map<int, std::vector<SpeedupBin>> lines;
+  bool has_region = false;
+  SessionRegion region;
+};
+
+// What profiling runs learned about the program, keyed by class and method
+// names rather than jmethodIDs so it carries over to the next JVM, and can
+// be merged with the sessions of other hosts. Saved as lines of text:
+//
+//   jcoz-session <version>
+//   experiment-time <ms>
+//   experiment-id <last experiment id>
+//   line <class> <method><signature> <line> (<experiments>:<rate sum>)...
+//   region <class> <method><signature> <experiments> <sum x> <sum y> <sum xx> <sum xy>
+class Session
+{
+public:
+  static const int kVersion = 1;
+
+  // Experiment length the last run ended with, 0 if unknown
+  unsigned long experiment_time = 0;
+  long experiment_id = 0;
+  // By class name (e.g. model.Help), then method name and signature (e.g. run(I)V)
+  std::map<std::string, std::map<std::string, SessionMethod>> classes;
+
+  // A missing file is an empty session. Returns false with a message in
+  // `error` if the file cannot be read or is not a session.
+  bool load(const std::string &path, std::string &error);
+
+  // Replaces the file as a whole, so a reader never sees half a session
+  bool save(const std::string &path) const;
+
+  // Adds the experiments of `other`, keeping the longer experiment length
+  void merge(const Session &other);
+
+  const SessionMethod *find(const std::string &class_name, const std::string &method) const;
+};
+
+#endif // JCOZ_SESSION_H
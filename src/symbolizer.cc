@@ -0,0 +1,241 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "symbolizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include "spdlog/spdlog.h"
+#include "agent_stats.h"
+
+void Symbolizer::init(jvmtiEnv *jvmti, const ClassNameLookup &class_name, const Output &output)
+{
+  jvmti_ = jvmti;
+  class_name_ = class_name;
+  output_ = output;
+}
+
+void Symbolizer::submit(std::vector<PendingResult> &results)
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    queue_.insert(queue_.end(), results.begin(), results.end());
+  }
+  results.clear();
+  wakeup_.notify_one();
+}
+
+void Symbolizer::run(JNIEnv *jni_env)
+{
+  std::vector<PendingResult> batch;
+  while (true)
+  {
+    unsigned long epoch;
+    {
+      std::unique_lock<std::mutex> guard(mutex_);
+      wakeup_.wait(guard, [this]
+                   { return !queue_.empty(); });
+      in_flight_.swap(queue_);
+      // A copy, a flush that times out outputs the originals
+      batch = in_flight_;
+      busy_ = true;
+      epoch = epoch_;
+    }
+
+    unsigned long dropped = 0;
+    for (auto result = batch.begin(); result != batch.end(); result++)
+    {
+      MethodSymbols symbols = resolve(jni_env, result->method_id);
+      // Results of methods that are gone are thrown out
+      if (!symbols.valid)
+      {
+        dropped++;
+        continue;
+      }
+      result->name = region_name(symbols, result->lineno);
+      for (auto record = result->records.begin(); record != result->records.end(); record++)
+      {
+        record->selected = result->name;
+      }
+    }
+    batch.erase(std::remove_if(batch.begin(), batch.end(), [](const PendingResult &result)
+                               { return result.name.empty(); }),
+                batch.end());
+    if (dropped != 0)
+    {
+      agent_stats::record_dropped_results(dropped);
+    }
+
+    // Taken before `mutex_` is released, so a flush that times out meanwhile
+    // outputs after this batch, and submit() never waits on the sink
+    std::unique_lock<std::mutex> output_guard(output_mutex_, std::defer_lock);
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (epoch == epoch_)
+      {
+        output_guard.lock();
+      }
+      in_flight_.clear();
+    }
+    if (output_guard.owns_lock())
+    {
+      output_(batch);
+      output_guard.unlock();
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      busy_ = false;
+    }
+    drained_.notify_all();
+    batch.clear();
+  }
+}
+
+bool Symbolizer::flush(long timeout_ms)
+{
+  std::unique_lock<std::mutex> guard(mutex_);
+  if (drained_.wait_for(guard, std::chrono::milliseconds(timeout_ms), [this]
+                        { return queue_.empty() && !busy_; }))
+  {
+    return true;
+  }
+
+  // The resolver drops the batch it is on, a batch it is already writing out
+  // holds `output_mutex_` and goes first
+  std::vector<PendingResult> left;
+  left.swap(in_flight_);
+  left.insert(left.end(), queue_.begin(), queue_.end());
+  queue_.clear();
+  epoch_++;
+  std::lock_guard<std::mutex> output_guard(output_mutex_);
+  guard.unlock();
+  for (auto result = left.begin(); result != left.end(); result++)
+  {
+    result->name = raw_name(result->method_id, result->lineno);
+    for (auto record = result->records.begin(); record != result->records.end(); record++)
+    {
+      record->selected = result->name;
+    }
+  }
+  output_(left);
+  return false;
+}
+
+bool Symbolizer::cached(jmethodID method_id, MethodSymbols &symbols)
+{
+  std::lock_guard<std::mutex> guard(cache_mutex_);
+  auto entry = cache_.find(method_id);
+  if (entry == cache_.end())
+  {
+    return false;
+  }
+  symbols = entry->second;
+  return true;
+}
+
+void Symbolizer::clear_cache()
+{
+  std::lock_guard<std::mutex> guard(cache_mutex_);
+  // Swapped so the buckets are freed as well
+  std::unordered_map<jmethodID, MethodSymbols>().swap(cache_);
+}
+
+void Symbolizer::evict(const std::unordered_set<jmethodID> &methods)
+{
+  std::lock_guard<std::mutex> guard(cache_mutex_);
+  for (jmethodID method_id : methods)
+  {
+    cache_.erase(method_id);
+  }
+}
+
+size_t Symbolizer::cache_bytes()
+{
+  std::lock_guard<std::mutex> guard(cache_mutex_);
+  size_t bytes = agent_stats::hash_map_bytes(cache_);
+  for (auto entry = cache_.begin(); entry != cache_.end(); entry++)
+  {
+    const MethodSymbols &symbols = entry->second;
+    bytes += agent_stats::string_bytes(symbols.class_name) + agent_stats::string_bytes(symbols.method_name) +
+             agent_stats::string_bytes(symbols.signature) + agent_stats::string_bytes(symbols.source_file);
+  }
+  return bytes;
+}
+
+MethodSymbols Symbolizer::resolve(JNIEnv *jni_env, jmethodID method_id)
+{
+  MethodSymbols symbols;
+  if (cached(method_id, symbols))
+  {
+    return symbols;
+  }
+
+  // Without the lock, only this thread adds symbols
+  if (class_name_(method_id, symbols.class_name))
+  {
+    symbols.valid = true;
+    JvmtiScopedPtr<char> method_name(jvmti_);
+    JvmtiScopedPtr<char> signature(jvmti_);
+    if (jvmti_->GetMethodName(method_id, method_name.GetRef(), signature.GetRef(), NULL) == JVMTI_ERROR_NONE)
+    {
+      symbols.method_name = method_name.Get();
+      symbols.signature = signature.Get();
+    }
+    jclass klass;
+    if (jvmti_->GetMethodDeclaringClass(method_id, &klass) == JVMTI_ERROR_NONE)
+    {
+      JvmtiScopedPtr<char> source_file(jvmti_);
+      if (jvmti_->GetSourceFileName(klass, source_file.GetRef()) == JVMTI_ERROR_NONE)
+      {
+        symbols.source_file = source_file.Get();
+      }
+      jni_env->DeleteLocalRef(klass);
+    }
+  }
+
+  // A miss is not cached, the class may be named on a later lookup
+  if (symbols.valid)
+  {
+    std::lock_guard<std::mutex> guard(cache_mutex_);
+    cache_[method_id] = symbols;
+  }
+  return symbols;
+}
+
+std::string Symbolizer::region_name(const MethodSymbols &symbols, jint lineno)
+{
+  switch (lineno)
+  {
+  case kMethodRegionLine:
+    return fmt::format("{}.{}", symbols.class_name, symbols.method_name.empty() ? "<unknown>" : symbols.method_name);
+  case kClassRegionLine:
+    return symbols.class_name;
+  default:
+    return fmt::format("{}:{}", symbols.class_name, lineno);
+  }
+}
+
+std::string Symbolizer::raw_name(jmethodID method_id, jint lineno)
+{
+  switch (lineno)
+  {
+  case kMethodRegionLine:
+  case kClassRegionLine:
+    return fmt::format("<method {}>", (void *)method_id);
+  default:
+    return fmt::format("<method {}>:{}", (void *)method_id, lineno);
+  }
+}
@@ -0,0 +1,132 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JCOZ_SYMBOLIZER_H
+#define JCOZ_SYMBOLIZER_H
+
+#include <jvmti.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "globals.h"
+#include "result_sink.h"
+
+// Strings of one method, fetched from JVMTI once
+struct MethodSymbols
+{
+  // false if the method was no longer valid when it was resolved
+  bool valid = false;
+  std::string class_name;
+  std::string method_name;
+  // e.g. (I)V
+  std::string signature;
+  // Empty if the class has no source file attribute
+  std::string source_file;
+};
+
+// The results of one line (or region) of an experiment, recorded with the
+// raw jmethodID so the agent thread never waits on JVMTI to name it
+struct PendingResult
+{
+  long experiment_id;
+  jmethodID method_id;
+  // A source line, or kMethodRegionLine / kClassRegionLine
+  jint lineno;
+  // Logged after the name of the line, e.g. "[speedup: 0.5] ..."
+  std::string summary;
+  // `selected` is filled in once the line is named
+  std::vector<ResultRecord> records;
+  std::string name;
+};
+
+// Names experiment results on a JVMTI agent thread of its own. Results are
+// queued by the agent thread and resolved in batches, fetching the class
+// name, method name and source file of each method at most once.
+class Symbolizer
+{
+public:
+  static const jint kMethodRegionLine = -1;
+  static const jint kClassRegionLine = -2;
+
+  // Copies the class name of a method into the string, false if it has none
+  typedef std::function<bool(jmethodID, std::string &)> ClassNameLookup;
+  // Called with every batch of named results, in order
+  typedef std::function<void(std::vector<PendingResult> &)> Output;
+
+  Symbolizer() : jvmti_(NULL), busy_(false), epoch_(0) {}
+
+  void init(jvmtiEnv *jvmti, const ClassNameLookup &class_name, const Output &output);
+
+  // Queues the results of one experiment, `results` is left empty
+  void submit(std::vector<PendingResult> &results);
+
+  // The resolver loop, never returns
+  void run(JNIEnv *jni_env);
+
+  // Waits until every result submitted so far was output, for at most
+  // `timeout_ms`. Results still unnamed by then are output under their raw
+  // method id, and false is returned.
+  bool flush(long timeout_ms);
+
+  // The symbols of a method resolved earlier, never calls JVMTI
+  bool cached(jmethodID method_id, MethodSymbols &symbols);
+
+  void clear_cache();
+
+  // Drops the cached symbols of these methods (e.g. of unloaded classes)
+  void evict(const std::unordered_set<jmethodID> &methods);
+
+  // Approximate heap footprint of the cache
+  size_t cache_bytes();
+
+  // e.g. model.Help:12, model.Help.run or model.Help
+  static std::string region_name(const MethodSymbols &symbols, jint lineno);
+
+  // Name of a result that could not be resolved in time
+  static std::string raw_name(jmethodID method_id, jint lineno);
+
+private:
+  MethodSymbols resolve(JNIEnv *jni_env, jmethodID method_id);
+
+  jvmtiEnv *jvmti_;
+  ClassNameLookup class_name_;
+  Output output_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable drained_;
+  std::vector<PendingResult> queue_;
+  // The batch the resolver is working on, output raw by a flush that times out
+  std::vector<PendingResult> in_flight_;
+  bool busy_;
+  // Bumped by a flush that timed out, the resolver then drops its batch
+  unsigned long epoch_;
+  // Held while a batch is output, taken after `mutex_`
+  std::mutex output_mutex_;
+
+  // Only the resolver adds symbols, `cached` reads them from other threads
+  std::mutex cache_mutex_;
+  std::unordered_map<jmethodID, MethodSymbols> cache_;
+
+  DISALLOW_COPY_AND_ASSIGN(Symbolizer);
+};
+
+#endif // JCOZ_SYMBOLIZER_H
@@ -0,0 +1,162 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JCOZ_THREAD_REGISTRY_H
+#define JCOZ_THREAD_REGISTRY_H
+
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "globals.h"
+#include "agent_stats.h"
+
+// Registry of the per-thread state of the profiled threads.
+//
+// Slots are allocated in slabs of SlabSize cache line aligned slots and
+// are never freed, only reused, so neither the agent thread nor a signal
+// handler can see freed memory. A slot's generation is odd while a thread
+// owns it: iterating is lock-free and goes over contiguous arrays, so thread
+// start and exit never block the sampling tick. Only taking and returning a
+// slot take a lock, against each other.
+//
+// T must have a `std::atomic<unsigned int> generation` member and a
+// `T *next_free` member, both owned by the registry.
+template <class T, unsigned int SlabSize, unsigned int MaxSlabs>
+class ThreadRegistry
+{
+public:
+  ThreadRegistry() : num_slots_(0), free_(NULL), lock_(0)
+  {
+    for (unsigned int i = 0; i < MaxSlabs; i++)
+    {
+      slabs_[i].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns a slot that is not visible as active until `publish()`, NULL if
+  // SlabSize * MaxSlabs threads are registered already. A reused slot keeps
+  // the state of its previous thread; the caller resets what it needs.
+  T *acquire()
+  {
+    lock();
+    T *slot = free_;
+    if (slot != NULL)
+    {
+      free_ = slot->next_free;
+    }
+    else
+    {
+      slot = new_slot();
+    }
+    unlock();
+    return slot;
+  }
+
+  void publish(T *slot)
+  {
+    slot->generation.fetch_add(1, std::memory_order_release);
+  }
+
+  // The slot stays readable, iteration may still see it for a moment
+  void release(T *slot)
+  {
+    slot->generation.fetch_add(1, std::memory_order_release);
+    lock();
+    slot->next_free = free_;
+    free_ = slot;
+    unlock();
+  }
+
+  static bool active(const T *slot)
+  {
+    return slot->generation.load(std::memory_order_acquire) & 1;
+  }
+
+  // Calls `f` on every slot ever allocated, active or not, e.g. to sum
+  // counters that are kept across the threads owning a slot
+  template <class F>
+  void for_each_slot(F f)
+  {
+    unsigned int num_slots = num_slots_.load(std::memory_order_acquire);
+    for (unsigned int i = 0; i < num_slots; i++)
+    {
+      f(&slabs_[i / SlabSize].load(std::memory_order_acquire)[i % SlabSize]);
+    }
+  }
+
+  // Calls `f` on every slot owned by a thread
+  template <class F>
+  void for_each_active(F f)
+  {
+    for_each_slot([&f](T *slot)
+                  {
+                    if (active(slot))
+                      f(slot);
+                  });
+  }
+
+private:
+  // Must hold lock_
+  T *new_slot()
+  {
+    unsigned int index = num_slots_.load(std::memory_order_relaxed);
+    if (index >= SlabSize * MaxSlabs)
+    {
+      return NULL;
+    }
+    T *slab = slabs_[index / SlabSize].load(std::memory_order_relaxed);
+    if (slab == NULL)
+    {
+      void *memory;
+      if (posix_memalign(&memory, 64, sizeof(T) * SlabSize) != 0)
+      {
+        return NULL;
+      }
+      slab = static_cast<T *>(memory);
+      for (unsigned int i = 0; i < SlabSize; i++)
+      {
+        new (&slab[i]) T();
+      }
+      slabs_[index / SlabSize].store(slab, std::memory_order_release);
+    }
+    num_slots_.store(index + 1, std::memory_order_release);
+    return &slab[index % SlabSize];
+  }
+
+  void lock()
+  {
+    agent_stats::spin_lock(&lock_, 1, agent_stats::_thread_registry_lock);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  void unlock()
+  {
+    std::atomic_thread_fence(std::memory_order_release);
+    lock_ = 0;
+  }
+
+  std::atomic<T *> slabs_[MaxSlabs];
+  std::atomic<unsigned int> num_slots_;
+  T *free_;
+  volatile int lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadRegistry);
+};
+
+#endif // JCOZ_THREAD_REGISTRY_H
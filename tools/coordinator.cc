@@ -0,0 +1,274 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// Schedules the experiments of many JVMs running the same program, see the
+// coordinator option and src/coordinator_client.h: `make coordinator`, then
+//
+//   jcoz-coordinator <port> [<session file>]
+//
+// Each line is run by at most one JVM at a time, at the speedup the fleet
+// has run it at least so far (0% speedup gets the share it gets from a
+// single agent, 5 in 25 experiments). With a session file, the experiments
+// reported by the agents are added to it, so the agents (or the next
+// coordinator) can resume from it.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "globals.h"
+#include "session.h"
+
+namespace
+{
+  struct Client
+  {
+    int fd;
+    std::string buffer;
+  };
+
+  volatile sig_atomic_t stopping = 0;
+
+  typedef std::chrono::steady_clock claim_clock;
+
+  struct Claim
+  {
+    // The connection running the line
+    int fd;
+    // A JVM that neither reports the line nor disconnects loses it then
+    claim_clock::time_point expires;
+  };
+
+  Session session;
+  // Lines being run, by "<class> <method> <line>"
+  std::map<std::string, Claim> claims;
+
+  void on_signal(int signal)
+  {
+    IMPLICITLY_USE(signal);
+    stopping = 1;
+  }
+
+  // The bin the line was run least at, relative to the share of experiments it should get
+  int least_run_bin(const std::vector<SpeedupBin> &bins)
+  {
+    std::vector<int> least;
+    double least_share = 0;
+    for (int i = 0; i < NUM_SPEEDUPS; i++)
+    {
+      double weight = i == 0 ? 5 : 1;
+      double share = (i < (int)bins.size() ? bins[i].experiments : 0) / weight;
+      if (least.empty() || share < least_share)
+      {
+        least.clear();
+        least_share = share;
+      }
+      if (share == least_share)
+        least.push_back(i);
+    }
+    return least[rand() % least.size()];
+  }
+
+  std::string handle_claim(int fd, std::istringstream &fields)
+  {
+    std::string reply = "speedups";
+    std::string class_name, method;
+    int lineno;
+    while (fields >> class_name >> method >> lineno)
+    {
+      std::string key = class_name + " " + method + " " + std::to_string(lineno);
+      auto claim = claims.find(key);
+      if (claim != claims.end() && claim->second.fd != fd && claim_clock::now() < claim->second.expires)
+      {
+        reply += " -";
+        continue;
+      }
+      Claim &entry = claims[key];
+      entry.fd = fd;
+      entry.expires = claim_clock::now() + std::chrono::milliseconds(COORDINATOR_CLAIM_TIMEOUT_MS);
+      const SessionMethod *state = session.find(class_name, method);
+      std::vector<SpeedupBin> bins;
+      if (state != NULL && state->lines.count(lineno) > 0)
+        bins = state->lines.at(lineno);
+      std::ostringstream speedup;
+      speedup << " " << (double)least_run_bin(bins) / (NUM_SPEEDUPS - 1);
+      reply += speedup.str();
+    }
+    return reply;
+  }
+
+  void handle_done(int fd, std::istringstream &fields)
+  {
+    std::string class_name, method;
+    int lineno;
+    double speedup;
+    long effective_duration, points_hit;
+    if (!(fields >> class_name >> method >> lineno >> speedup >> effective_duration >> points_hit))
+      return;
+    std::string key = class_name + " " + method + " " + std::to_string(lineno);
+    auto claim = claims.find(key);
+    if (claim != claims.end() && claim->second.fd == fd)
+      claims.erase(claim);
+    if (effective_duration <= 0)
+      return;
+
+    std::vector<SpeedupBin> &bins = session.classes[class_name][method].lines[lineno];
+    bins.resize(NUM_SPEEDUPS);
+    SpeedupBin &bin = bins[std::min(NUM_SPEEDUPS - 1, std::max(0, (int)(speedup * (NUM_SPEEDUPS - 1) + 0.5)))];
+    bin.experiments++;
+    bin.rate_sum += points_hit * 1e9 / effective_duration;
+  }
+
+  // Returns false once the connection should be closed
+  bool serve(Client &client)
+  {
+    char chunk[4096];
+    ssize_t received = read(client.fd, chunk, sizeof(chunk));
+    if (received < 0 && errno == EINTR)
+      return true;
+    if (received <= 0)
+      return false;
+    client.buffer.append(chunk, received);
+
+    size_t newline;
+    while ((newline = client.buffer.find('\n')) != std::string::npos)
+    {
+      std::istringstream fields(client.buffer.substr(0, newline));
+      client.buffer.erase(0, newline + 1);
+      std::string command;
+      fields >> command;
+      if (command == "claim")
+      {
+        std::string reply = handle_claim(client.fd, fields) + "\n";
+        if (send(client.fd, reply.data(), reply.size(), MSG_NOSIGNAL) != (ssize_t)reply.size())
+          return false;
+      }
+      else if (command == "done")
+      {
+        handle_done(client.fd, fields);
+      }
+    }
+    return true;
+  }
+
+  void drop_claims(int fd)
+  {
+    for (auto claim = claims.begin(); claim != claims.end();)
+    {
+      if (claim->second.fd == fd)
+        claim = claims.erase(claim);
+      else
+        claim++;
+    }
+  }
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 3)
+  {
+    fprintf(stderr, "usage: %s <port> [<session file>]\n", argv[0]);
+    return 2;
+  }
+  std::string session_file = argc == 3 ? argv[2] : "";
+  std::string error;
+  if (!session_file.empty() && !session.load(session_file, error))
+  {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(atoi(argv[1]));
+  if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+  {
+    fprintf(stderr, "cannot listen on port %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  srand(time(NULL));
+
+  std::vector<Client> clients;
+  auto last_save = std::chrono::steady_clock::now();
+  while (!stopping)
+  {
+    std::vector<struct pollfd> poll_fds(1 + clients.size());
+    poll_fds[0].fd = listener;
+    poll_fds[0].events = POLLIN;
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+      poll_fds[i + 1].fd = clients[i].fd;
+      poll_fds[i + 1].events = POLLIN;
+    }
+    if (poll(poll_fds.data(), poll_fds.size(), 1000) < 0 && errno != EINTR)
+      break;
+
+    // Clients first, as accepting one moves the others in `clients`
+    for (size_t i = clients.size(); i > 0; i--)
+    {
+      if (poll_fds[i].revents == 0 || serve(clients[i - 1]))
+        continue;
+      drop_claims(clients[i - 1].fd);
+      close(clients[i - 1].fd);
+      clients.erase(clients.begin() + (i - 1));
+    }
+    if (poll_fds[0].revents & POLLIN)
+    {
+      int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0)
+      {
+        Client client;
+        client.fd = fd;
+        clients.push_back(client);
+      }
+    }
+
+    if (!session_file.empty() && std::chrono::steady_clock::now() - last_save >= std::chrono::milliseconds(SESSION_SAVE_INTERVAL_MS))
+    {
+      if (!session.save(session_file))
+        fprintf(stderr, "cannot write %s\n", session_file.c_str());
+      last_save = std::chrono::steady_clock::now();
+    }
+  }
+
+  if (!session_file.empty() && !session.save(session_file))
+  {
+    fprintf(stderr, "cannot write %s\n", session_file.c_str());
+    return 1;
+  }
+  return 0;
+}
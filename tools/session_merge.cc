@@ -0,0 +1,64 @@
+/*
+ * This file is part of JCoz.
+ *
+ * JCoz is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JCoz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JCoz.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// Combines the session files of several JVMs (e.g. one per host) into one,
+// which each of them can resume from: `make session-merge`, then
+//
+//   jcoz-session-merge <output> <session> <session>...
+//
+// The output may be one of the inputs.
+
+#include <stdio.h>
+
+#include <fstream>
+#include <string>
+
+#include "session.h"
+
+int main(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: %s <output> <session>...\n", argv[0]);
+    return 2;
+  }
+
+  Session merged;
+  for (int i = 2; i < argc; i++)
+  {
+    Session session;
+    std::string error;
+    // Unlike the agent, which starts a new session, a missing input is a mistake
+    if (!std::ifstream(argv[i]))
+    {
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      return 1;
+    }
+    if (!session.load(argv[i], error))
+    {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
+    }
+    merged.merge(session);
+  }
+
+  if (!merged.save(argv[1]))
+  {
+    fprintf(stderr, "cannot write %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}